@@ -123,7 +123,8 @@ block_t bitmap_dump(struct inode *inode, block_t start, block_t count)
  * Modify bits on one block, then adjust ->freeblocks.
  */
 static int bitmap_modify_bits(struct sb *sb, struct buffer_head *buffer,
-			      unsigned offset, unsigned blocks, int set)
+			      unsigned offset, unsigned blocks, int set,
+			      block_t *freeblocks)
 {
 	if(DEBUG_MODE_K==1)
 	{
@@ -152,9 +153,9 @@ static int bitmap_modify_bits(struct sb *sb, struct buffer_head *buffer,
 	blockput(clone);
 
 	if (set)
-		sb->freeblocks -= blocks;
+		*freeblocks -= blocks;
 	else
-		sb->freeblocks += blocks;
+		*freeblocks += blocks;
 
 	return 0;
 }
@@ -195,7 +196,8 @@ static int bitmap_modify(struct sb *sb, block_t start, unsigned blocks, int set)
 		}
 
 		len = min(mapsize - mapoffset, blocks);
-		err = bitmap_modify_bits(sb, buffer, mapoffset, len, set);
+		err = bitmap_modify_bits(sb, buffer, mapoffset, len, set,
+					 &sb->freeblocks);
 		if (err) {
 			blockput(buffer);
 			/* FIXME: error handling */
@@ -215,8 +217,9 @@ static int bitmap_modify(struct sb *sb, block_t start, unsigned blocks, int set)
  * FIXME: If error happened on middle of blocks, modified bits and
  * ->freeblocks are not restored to original. What to do?
  */
-static int bitmap_test_and_modify(struct sb *sb, block_t start, unsigned blocks,
-				  int set)
+static int __bitmap_test_and_modify(struct sb *sb, block_t start,
+				    unsigned blocks, int set,
+				    block_t *freeblocks)
 {
 	if(DEBUG_MODE_K==1)
 	{
@@ -256,7 +259,8 @@ static int bitmap_test_and_modify(struct sb *sb, block_t start, unsigned blocks,
 			return -EIO;	/* FIXME: error code? */
 		}
 
-		err = bitmap_modify_bits(sb, buffer, mapoffset, len, set);
+		err = bitmap_modify_bits(sb, buffer, mapoffset, len, set,
+					 freeblocks);
 		if (err) {
 			blockput(buffer);
 			/* FIXME: error handling */
@@ -270,6 +274,17 @@ static int bitmap_test_and_modify(struct sb *sb, block_t start, unsigned blocks,
 	return 0;
 }
 
+static int bitmap_test_and_modify(struct sb *sb, block_t start, unsigned blocks,
+				  int set)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return __bitmap_test_and_modify(sb, start, blocks, set,
+					&sb->freeblocks);
+}
+
 static void save_seg(struct block_segment *seg, int segs, block_t start,
 		     unsigned count)
 {
@@ -411,7 +426,8 @@ found_range:
 		unsigned foundoffset = found & mapmask;
 		int err;
 
-		err = bitmap_modify_bits(sb, buffer, foundoffset, blocks, 1);
+		err = bitmap_modify_bits(sb, buffer, foundoffset, blocks, 1,
+					 &sb->freeblocks);
 		if (err) {
 			blockput(buffer);
 			/* FIXME: error handling */
@@ -491,6 +507,30 @@ int bfree(struct sb *sb, block_t start, unsigned blocks)
 	return bitmap_test_and_modify(sb, start, blocks, 0);
 }
 
+/*
+ * Replay of bitmap.
+ *
+ * Bitmap updates are queued by replay_update_bitmap() in log order,
+ * then applied by replay_apply_bitmap(). Updates are partitioned by
+ * page of bitmap, and each partition keeps log order. So, partitions
+ * don't depend on each other, and can be applied on several CPUs.
+ */
+
+struct replay_bitmap {
+	struct list_head list;
+	block_t start;		/* start block of this update */
+	unsigned count;		/* count of blocks (within one bitmap page) */
+	int set;		/* allocate or free */
+};
+
+struct replay_bitmap_work {
+	struct work_struct work;
+	struct sb *sb;
+	struct list_head *queue;
+	block_t freeblocks;	/* change of ->freeblocks by this queue */
+	int err;
+};
+
 int replay_update_bitmap(struct replay *rp, block_t start, unsigned blocks,
 			 int set)
 {
@@ -498,5 +538,121 @@ int replay_update_bitmap(struct replay *rp, block_t start, unsigned blocks,
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	return bitmap_test_and_modify(rp->sb, start, blocks, set);
+	/* Blocks covered by one page of bitmap */
+	unsigned pageshift = PAGE_CACHE_SHIFT + 3;
+	block_t pagemask = (1ULL << pageshift) - 1;
+
+	assert(blocks > 0);
+	assert(start + blocks <= rp->sb->volblocks);
+
+	/* Split range at bitmap page boundary */
+	while (blocks) {
+		struct replay_bitmap *update;
+		unsigned len;
+		int i;
+
+		len = min_t(block_t, (start | pagemask) + 1 - start, blocks);
+
+		update = malloc(sizeof(*update));
+		if (!update)
+			return -ENOMEM;
+		update->start = start;
+		update->count = len;
+		update->set = set;
+
+		i = (start >> pageshift) % REPLAY_BITMAP_QUEUES;
+		list_add_tail(&update->list, &rp->bitmap_queue[i]);
+
+		start += len;
+		blocks -= len;
+	}
+
+	return 0;
+}
+
+/* Apply updates on a queue in order, and free those */
+static void replay_bitmap_work_fn(struct work_struct *work)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct replay_bitmap_work *bw =
+		container_of(work, struct replay_bitmap_work, work);
+	struct replay_bitmap *update, *safe;
+
+	list_for_each_entry_safe(update, safe, bw->queue, list) {
+		/* Stop to apply after error, but free all */
+		if (!bw->err) {
+			bw->err = __bitmap_test_and_modify(bw->sb,
+							   update->start,
+							   update->count,
+							   update->set,
+							   &bw->freeblocks);
+		}
+		list_del(&update->list);
+		free(update);
+	}
+}
+
+int replay_apply_bitmap(struct replay *rp)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = rp->sb;
+	struct replay_bitmap_work *works;
+	int i, err = 0;
+
+	works = malloc(sizeof(*works) * REPLAY_BITMAP_QUEUES);
+	if (!works) {
+		replay_discard_bitmap(rp);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < REPLAY_BITMAP_QUEUES; i++) {
+		struct replay_bitmap_work *bw = &works[i];
+
+		INIT_WORK(&bw->work, replay_bitmap_work_fn);
+		bw->sb = sb;
+		bw->queue = &rp->bitmap_queue[i];
+		bw->freeblocks = 0;
+		bw->err = 0;
+		if (!list_empty(bw->queue))
+			queue_work(system_unbound_wq, &bw->work);
+	}
+
+	for (i = 0; i < REPLAY_BITMAP_QUEUES; i++) {
+		struct replay_bitmap_work *bw = &works[i];
+
+		flush_work(&bw->work);
+		sb->freeblocks += bw->freeblocks;
+		if (!err)
+			err = bw->err;
+	}
+
+	free(works);
+
+	return err;
+}
+
+/* Free queued updates without applying (for error path) */
+void replay_discard_bitmap(struct replay *rp)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	int i;
+
+	for (i = 0; i < REPLAY_BITMAP_QUEUES; i++) {
+		struct replay_bitmap *update, *safe;
+
+		list_for_each_entry_safe(update, safe, &rp->bitmap_queue[i],
+					 list) {
+			list_del(&update->list);
+			free(update);
+		}
+	}
 }
@@ -320,29 +320,119 @@ static inline int alloc_cursor_size(int count)
 	return sizeof(struct cursor) + sizeof(struct path_level) * count;
 }
 
-struct cursor *alloc_cursor(struct btree *btree, int extra)
+/*
+ * Cursors are allocated for each lookup on hot paths (map_region,
+ * open_inode, save_inode, etc.). Common depth fits to the slab object,
+ * so we don't use kmalloc() for usual btree.
+ */
+#ifdef __KERNEL__
+static struct kmem_cache *tux_cursor_cachep;
+
+int __init tux3_init_cursor_cache(void)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	int maxlevel = btree->root.depth + extra;
-	struct cursor *cursor = malloc(alloc_cursor_size(maxlevel + 1));
+	tux_cursor_cachep = kmem_cache_create("tux3_cursor_cache",
+			alloc_cursor_size(CURSOR_CACHE_LEVELS), 0,
+			SLAB_MEM_SPREAD, NULL);
+	if (tux_cursor_cachep == NULL)
+		return -ENOMEM;
+	return 0;
+}
 
-	if (cursor) {
-		cursor->btree = btree;
-		cursor->level = -1;
+void tux3_destroy_cursor_cache(void)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	kmem_cache_destroy(tux_cursor_cachep);
+}
+
+static struct cursor *cursor_cache_alloc(void)
+{
+	might_sleep();
+	return kmem_cache_alloc(tux_cursor_cachep, GFP_NOFS);
+}
+
+static void cursor_cache_free(struct cursor *cursor)
+{
+	kmem_cache_free(tux_cursor_cachep, cursor);
+}
+#else /* !__KERNEL__ */
+static struct cursor *cursor_cache_alloc(void)
+{
+	return malloc(alloc_cursor_size(CURSOR_CACHE_LEVELS));
+}
+
+static void cursor_cache_free(struct cursor *cursor)
+{
+	free(cursor);
+}
+#endif /* !__KERNEL__ */
+
+static struct cursor *init_cursor(struct cursor *cursor, struct btree *btree,
+				  int maxlevel, int origin)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	cursor->btree = btree;
+	cursor->origin = origin;
+	cursor->level = -1;
+	cursor->maxlevel = maxlevel;
 #ifdef CURSOR_DEBUG
-		cursor->maxlevel = maxlevel;
-		for (int i = 0; i <= maxlevel; i++) {
-			cursor->path[i].buffer = FREE_BUFFER; /* for debug */
-			cursor->path[i].next = FREE_NEXT; /* for debug */
-		}
+	for (int i = 0; i <= maxlevel; i++) {
+		cursor->path[i].buffer = FREE_BUFFER; /* for debug */
+		cursor->path[i].next = FREE_NEXT; /* for debug */
+	}
 #endif
+	return cursor;
+}
+
+struct cursor *alloc_cursor(struct btree *btree, int extra)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	int maxlevel = btree->root.depth + extra;
+	struct cursor *cursor;
+
+	if (maxlevel < CURSOR_CACHE_LEVELS) {
+		cursor = cursor_cache_alloc();
+		if (cursor)
+			init_cursor(cursor, btree, maxlevel, CURSOR_FROM_CACHE);
+	} else {
+		cursor = malloc(alloc_cursor_size(maxlevel + 1));
+		if (cursor)
+			init_cursor(cursor, btree, maxlevel, CURSOR_FROM_MALLOC);
 	}
 	return cursor;
 }
 
+/*
+ * Use on-stack cursor if btree is shallow enough, otherwise same as
+ * alloc_cursor(). The cursor must be freed by free_cursor() as usual.
+ */
+struct cursor *alloc_cursor_stack(struct btree *btree, int extra,
+				  struct cursor_stack *stack)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	int maxlevel = btree->root.depth + extra;
+
+	if (maxlevel < CURSOR_STACK_LEVELS)
+		return init_cursor(&stack->cursor, btree, maxlevel,
+				   CURSOR_ON_STACK);
+	return alloc_cursor(btree, extra);
+}
+
 void free_cursor(struct cursor *cursor)
 {
 	if(DEBUG_MODE_K==1)
@@ -352,7 +442,16 @@ void free_cursor(struct cursor *cursor)
 #ifdef CURSOR_DEBUG
 	assert(cursor->level == -1);
 #endif
-	free(cursor);
+	switch (cursor->origin) {
+	case CURSOR_FROM_CACHE:
+		cursor_cache_free(cursor);
+		break;
+	case CURSOR_FROM_MALLOC:
+		free(cursor);
+		break;
+	case CURSOR_ON_STACK:
+		break;
+	}
 }
 
 /* Lookup the index entry contains key */
@@ -582,6 +681,127 @@ error:
 	return ret;
 }
 
+/*
+ * Writer side of btree->lock. Writer bumps btree->seq only around the
+ * changes which lockless reader can't notice by buffer_dirty(): root
+ * change, split, and redirect (see btree_read_lockless()). Other
+ * changes are done on dirty buffers in place.
+ */
+void down_write_btree(struct btree *btree)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	down_write(&btree->lock);
+}
+
+void up_write_btree(struct btree *btree)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	up_write(&btree->lock);
+}
+
+/*
+ * Lockless version of btree_probe() + btree_read().
+ *
+ * Committed blocks are never modified in place (cursor_redirect()
+ * copies them first), so a clean buffer on the path is stable while
+ * we hold it. Dirty buffers can be changed in place by the writer, so
+ * we give up on those. btree->seq is checked before following each
+ * pointer, and after reading the leaf, so the result is only used if
+ * no writer redirected, split, or changed root meanwhile.
+ *
+ * This doesn't use cursor_advance_down() etc., because those assert
+ * against btree->root which can change under us.
+ *
+ * return value:
+ * < 0 - error
+ *   0 - success
+ *   1 - raced with writer (or path is dirty), caller should retry
+ *       with btree->lock
+ */
+int btree_read_lockless(struct cursor *cursor, struct btree_key_range *key)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct btree *btree = cursor->btree;
+	struct sb *sb = btree->sb;
+	tuxkey_t bottom = 0, limit = TUXKEY_LIMIT;
+	struct root root;
+	block_t block;
+	unsigned seq;
+	int level, ret = 1;
+
+	seq = raw_seqcount_begin(&btree->seq);
+	root = btree->root;
+	if (read_seqcount_retry(&btree->seq, seq))
+		return 1;
+	/* Empty btree is cheap, leave it to locked path */
+	if (root.block == no_root.block && root.depth == no_root.depth)
+		return 1;
+	if (root.depth > cursor->maxlevel)
+		return 1;
+
+	block = root.block;
+	for (level = 0; level <= root.depth; level++) {
+		struct buffer_head *buffer;
+		struct index_entry *next, *top;
+		struct bnode *node;
+
+		buffer = vol_bread(sb, block);
+		if (!buffer) {
+			ret = -EIO; /* FIXME: stupid, it might have been NOMEM */
+			goto out;
+		}
+		cursor_push(cursor, buffer, NULL);
+
+		/* Writer can change dirty buffer in place */
+		if (buffer_dirty(buffer) || read_seqcount_retry(&btree->seq, seq))
+			goto out;
+
+		if (level == root.depth) {
+			if (!btree->ops->leaf_sniff(btree, bufdata(buffer)))
+				goto out;
+			break;
+		}
+
+		node = bufdata(buffer);
+		if (!bnode_sniff(node) || !bcount(node) ||
+		    bcount(node) > sb->entries_per_node)
+			goto out;
+
+		next = bnode_lookup(node, key->start);
+		top = node->entries + bcount(node);
+		cursor->path[level].next = next + 1;
+		/* Same as cursor_this_key() and cursor_next_key() */
+		bottom = be64_to_cpu(next->key);
+		if (next + 1 < top)
+			limit = be64_to_cpu((next + 1)->key);
+		block = be64_to_cpu(next->block);
+
+		if (read_seqcount_retry(&btree->seq, seq))
+			goto out;
+	}
+
+	if (bottom > key->start || key->start >= limit)
+		goto out;
+
+	ret = btree->ops->leaf_read(btree, bottom, limit,
+				    bufdata(cursor->path[root.depth].buffer),
+				    key);
+	if (ret >= 0 && read_seqcount_retry(&btree->seq, seq))
+		ret = 1;
+out:
+	release_cursor(cursor);
+	return ret;
+}
+
 /*
  * Traverse btree for specified range
  * key: start to traverse (cursor should point leaf is including key)
@@ -772,11 +992,14 @@ int cursor_redirect(struct cursor *cursor)
 		}
 
 		trace("update parent");
+		/* Lockless reader may be on the old block, tell it */
+		write_seqcount_begin(&btree->seq);
 		if (!level) {
 			/* Update pointer in btree->root */
 			trace("redirect root");
 			assert(oldblock == btree->root.block);
 			btree->root.block = newblock;
+			write_seqcount_end(&btree->seq);
 			tux3_mark_btree_dirty(btree);
 			continue;
 		}
@@ -784,6 +1007,7 @@ int cursor_redirect(struct cursor *cursor)
 		parent = bufindex(cursor->path[level - 1].buffer);
 		entry = cursor->path[level - 1].next - 1;
 		entry->block = cpu_to_be64(newblock);
+		write_seqcount_end(&btree->seq);
 		log_bnode_update(sb, parent, newblock, be64_to_cpu(entry->key));
 	}
 
@@ -1014,7 +1238,7 @@ int btree_chop(struct btree *btree, tuxkey_t start, u64 len)
 		goto error_alloc_cursor;
 	}
 
-	down_write(&btree->lock);
+	down_write_btree(btree);
 	ret = btree_probe(cursor, start);
 	if (ret)
 		goto error_btree_probe;
@@ -1118,8 +1342,10 @@ chop_root:
 	/* Remove depth if possible */
 	while (btree->root.depth > 1 && bcount(bufdata(prev[0])) == 1) {
 		trace("drop btree level");
+		write_seqcount_begin(&btree->seq);
 		btree->root.block = bufindex(prev[1]);
 		btree->root.depth--;
+		write_seqcount_end(&btree->seq);
 		tux3_mark_btree_dirty(btree);
 
 		/*
@@ -1146,7 +1372,7 @@ out:
 	}
 	release_cursor(cursor);
 error_btree_probe:
-	up_write(&btree->lock);
+	up_write_btree(btree);
 
 	free_cursor(cursor);
 error_alloc_cursor:
@@ -1247,7 +1473,9 @@ static int insert_leaf(struct cursor *cursor, tuxkey_t childkey, struct buffer_h
 		unsigned half = bcount(parent) / 2;
 		u64 newkey = be64_to_cpu(parent->entries[half].key);
 
+		write_seqcount_begin(&btree->seq);
 		bnode_split(parent, half, newnode);
+		write_seqcount_end(&btree->seq);
 		log_bnode_split(sb, bufindex(parentbuf), half, bufindex(newbuf));
 
 		/* if the cursor is in the new node, use that as the parent */
@@ -1296,8 +1524,10 @@ static int insert_leaf(struct cursor *cursor, tuxkey_t childkey, struct buffer_h
 	log_bnode_root(sb, newrootblock, 2, oldrootblock, childblock, childkey);
 
 	/* Change btree to point the new root */
+	write_seqcount_begin(&btree->seq);
 	btree->root.block = newrootblock;
 	btree->root.depth++;
+	write_seqcount_end(&btree->seq);
 
 	mark_buffer_unify_non(newbuf);
 	tux3_mark_btree_dirty(btree);
@@ -1341,8 +1571,10 @@ static int btree_leaf_split(struct cursor *cursor, tuxkey_t key, tuxkey_t hint)
 	log_balloc(btree->sb, bufindex(newbuf), 1);
 
 	struct buffer_head *leafbuf = cursor_leafbuf(cursor);
+	write_seqcount_begin(&btree->seq);
 	tuxkey_t newkey = btree->ops->leaf_split(btree, hint, bufdata(leafbuf),
 						 bufdata(newbuf));
+	write_seqcount_end(&btree->seq);
 	assert(cursor_this_key(cursor) < newkey);
 	assert(newkey < cursor_next_key(cursor));
 	if (key < newkey)
@@ -1425,6 +1657,7 @@ void init_btree(struct btree *btree, struct sb *sb, struct root root, struct btr
 	btree->ops = ops;
 	btree->root = root;
 	init_rwsem(&btree->lock);
+	seqcount_init(&btree->seq);
 	ops->btree_init(btree);
 }
 
@@ -1457,7 +1690,9 @@ int alloc_empty_btree(struct btree *btree)
 	mark_buffer_dirty_non(leafbuf);
 	blockput(leafbuf);
 
+	write_seqcount_begin(&btree->seq);
 	btree->root = (struct root){ .block = rootblock, .depth = 1 };
+	write_seqcount_end(&btree->seq);
 	tux3_mark_btree_dirty(btree);
 
 	return 0;
@@ -1489,7 +1724,9 @@ int free_empty_btree(struct btree *btree)
 		return -EIO;
 	assert(bnode_sniff(bufdata(rootbuf)));
 	/* Make btree has no root */
+	write_seqcount_begin(&btree->seq);
 	btree->root = no_root;
+	write_seqcount_end(&btree->seq);
 	tux3_mark_btree_dirty(btree);
 
 	struct bnode *rootnode = bufdata(rootbuf);
@@ -111,10 +111,12 @@ int buffer_can_modify(struct buffer_head *buffer, unsigned delta)
 /*
  * Caller must hold lock_page() or backend (otherwise, you may race
  * with buffer fork or clear dirty)
+ *
+ * Return 1 if buffer was newly added to dirty list.
  */
-void tux3_set_buffer_dirty_list(struct address_space *mapping,
-				struct buffer_head *buffer, int delta,
-				struct list_head *head)
+int tux3_set_buffer_dirty_list(struct address_space *mapping,
+			       struct buffer_head *buffer, int delta,
+			       struct list_head *head)
 {
 	if(DEBUG_MODE_K==1)
 	{
@@ -133,7 +135,9 @@ void tux3_set_buffer_dirty_list(struct address_space *mapping,
 		/* FIXME: hack for save delta */
 		tux3_set_bufdelta(buffer, delta);
 		spin_unlock(&mapping->private_lock);
+		return 1;
 	}
+	return 0;
 }
 
 void tux3_set_buffer_dirty(struct address_space *mapping,
@@ -144,7 +148,11 @@ void tux3_set_buffer_dirty(struct address_space *mapping,
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	struct list_head *head = tux3_dirty_buffers(mapping->host, delta);
-	tux3_set_buffer_dirty_list(mapping, buffer, delta, head);
+	if (tux3_set_buffer_dirty_list(mapping, buffer, delta, head)) {
+		/* For delta sizing policy, see need_delta() */
+		atomic_inc(&tux3_sb_ddc(tux_sb(mapping->host->i_sb),
+					delta)->dirty_blocks);
+	}
 }
 
 /*
@@ -64,9 +64,9 @@ static inline struct buffer_head *set_buffer_empty(struct buffer_head *buffer)
 
 int buffer_already_dirty(struct buffer_head *buffer, unsigned delta);
 int buffer_can_modify(struct buffer_head *buffer, unsigned delta);
-void tux3_set_buffer_dirty_list(struct address_space *mapping,
-				struct buffer_head *buffer, int delta,
-				struct list_head *head);
+int tux3_set_buffer_dirty_list(struct address_space *mapping,
+			       struct buffer_head *buffer, int delta,
+			       struct list_head *head);
 void tux3_set_buffer_dirty(struct address_space *mapping,
 			   struct buffer_head *buffer, int delta);
 void tux3_clear_buffer_dirty(struct buffer_head *buffer, unsigned delta);
@@ -79,6 +79,7 @@ void tux3_invalidate_buffer(struct buffer_head *buffer);
 struct iowait {
 	atomic_t inflight;		/* In-flight I/O count */
 	struct completion done;		/* completion for in-flight I/O */
+	void (*end_io)(struct iowait *);/* called when all I/O was done */
 };
 
 /* Helper for compressed I/O */
@@ -170,9 +171,11 @@ static inline block_t bufvec_contig_last_index(struct bufvec *bufvec)
 
 void tux3_iowait_init(struct iowait *iowait);
 void tux3_iowait_wait(struct iowait *iowait);
+void tux3_iowait_async(struct iowait *iowait, void (*end_io)(struct iowait *));
 int bufvec_compressed_io(int rw, struct bufvec *bufvec, block_t physical, unsigned count);
 int bufvec_io(int rw, struct bufvec *bufvec, block_t physical, unsigned count);
 int bufvec_contig_add(struct bufvec *bufvec, struct buffer_head *buffer);
+void tux3_cancel_dirty_buffer(struct sb *sb, struct buffer_head *buffer);
 int flush_list(struct address_space *mapping, struct tux3_iattr_data *idata,
 	       struct list_head *head);
 int __tux3_volmap_io(int rw, struct bufvec *bufvec, block_t physical,
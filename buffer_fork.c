@@ -39,9 +39,12 @@ static void forked_buffer_add(struct sb *sb, struct buffer_head *buffer)
 	spin_lock(&sb->forked_buffers_lock);
 	link_add(buffer_link(buffer), &sb->forked_buffers);
 	spin_unlock(&sb->forked_buffers_lock);
+	/* For dirty throttling, see tux3_balance_dirty() */
+	atomic_inc(&sb->forked_count);
 }
 
-static void forked_buffer_del(struct link *prev, struct buffer_head *buffer)
+static void forked_buffer_del(struct sb *sb, struct link *prev,
+			      struct buffer_head *buffer)
 {
 	if(DEBUG_MODE_K==1)
 	{
@@ -50,6 +53,7 @@ static void forked_buffer_del(struct link *prev, struct buffer_head *buffer)
 	link_del_next(prev);
 	/* Unpin buffer */
 	put_bh(buffer);
+	atomic_dec(&sb->forked_count);
 }
 
 /* Cleaning and free forked page */
@@ -211,7 +215,7 @@ void free_forked_buffers(struct sb *sb, struct inode *inode, int force)
 		struct buffer_head *buffer = buffer_link_entry(free_list.next);
 		struct page *page = buffer->b_page;
 
-		forked_buffer_del(&free_list, buffer);
+		forked_buffer_del(sb, &free_list, buffer);
 		free_forked_page(page);
 	}
 }
@@ -23,8 +23,12 @@ static void iowait_inflight_dec(struct iowait *iowait)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	if (atomic_dec_and_test(&iowait->inflight))
+	if (atomic_dec_and_test(&iowait->inflight)) {
 		complete(&iowait->done);
+		/* ->end_io() may reuse iowait, so this must be last */
+		if (iowait->end_io)
+			iowait->end_io(iowait);
+	}
 }
 
 void tux3_iowait_init(struct iowait *iowait)
@@ -39,6 +43,7 @@ void tux3_iowait_init(struct iowait *iowait)
 	 */
 	init_completion(&iowait->done);
 	atomic_set(&iowait->inflight, 1);
+	iowait->end_io = NULL;
 }
 
 void tux3_iowait_wait(struct iowait *iowait)
@@ -52,6 +57,22 @@ void tux3_iowait_wait(struct iowait *iowait)
 	wait_for_completion(&iowait->done);
 }
 
+/*
+ * Don't wait I/O. Instead, ->end_io() is called when all I/O was
+ * done. (->end_io() may be called from bio completion context, or
+ * from here if I/O was already done.)
+ */
+void tux3_iowait_async(struct iowait *iowait, void (*end_io)(struct iowait *))
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	iowait->end_io = end_io;
+	/* All I/O was submitted, release initial 1 */
+	iowait_inflight_dec(iowait);
+}
+
 /*
  * Helper for buffer vector I/O.
  */
@@ -969,6 +990,27 @@ static void bufvec_cancel_dirty_outside(struct bufvec *bufvec)
 	bufvec_cancel_and_unlock_page(page, outside_index);
 }
 
+/*
+ * Cancel dirty buffer of backend delta without I/O (e.g. data was
+ * saved to other place). Like cancel of buffers outside i_size, this
+ * doesn't touch buffers forked to frontend delta.
+ */
+void tux3_cancel_dirty_buffer(struct sb *sb, struct buffer_head *buffer)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct page *page = buffer->b_page;
+
+	lock_page(page);
+	list_del_init(&buffer->b_assoc_buffers);
+	tux3_clear_buffer_dirty_for_io(buffer, sb, 0);
+	tux3_clear_buffer_dirty_for_io_hack(buffer);
+	tux3_try_cancel_dirty_page(page);
+	unlock_page(page);
+}
+
 /*
  * Try to add buffer to bufvec as contiguous range.
  *
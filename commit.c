@@ -16,6 +16,7 @@
 
 static void __delta_transition(struct sb *sb, struct delta_ref *delta_ref);
 static void schedule_flush_delta(struct sb *sb);
+static void commit_work_fn(struct work_struct *work);
 
 /*
  * Need frontend modification of backend buffers. (modification
@@ -47,16 +48,38 @@ static void init_sb(struct sb *sb)
 	INIT_LIST_HEAD(&sb->orphan_del);
 	stash_init(&sb->defree);
 	stash_init(&sb->deunify);
+	stash_init(&sb->fsync_blocks);
 	INIT_LIST_HEAD(&sb->unify_buffers);
+	INIT_WORK(&sb->commit_work, commit_work_fn);
 
 	INIT_LIST_HEAD(&sb->alloc_inodes);
+	INIT_RADIX_TREE(&sb->inum_index, GFP_NOFS);
 	spin_lock_init(&sb->forked_buffers_lock);
+	spin_lock_init(&sb->atom_hash_lock);
+	mutex_init(&sb->xvalue_lock);
 	init_link_circular(&sb->forked_buffers);
+	atomic_set(&sb->forked_count, 0);
 	spin_lock_init(&sb->dirty_inodes_lock);
 
 	/* Initialize sb_delta_dirty */
 	for (i = 0; i < ARRAY_SIZE(sb->s_ddc); i++)
 		INIT_LIST_HEAD(&sb->s_ddc[i].dirty_inodes);
+
+	/* Default limits of delta, see need_delta() */
+	sb->delta_max_bytes = 64 << 20;
+	sb->delta_max_inodes = 4096;
+	sb->delta_max_changes = 10000;
+	sb->delta_max_age = 5 * HZ;
+	sb->delta_max_logbytes = 1 << 20;
+	/* Default limit of dirty state, see tux3_balance_dirty() */
+	sb->dirty_max_bytes = 2 * sb->delta_max_bytes;
+
+	/* Default bounds of log to replay, see need_unify() */
+	sb->unify_min_logblocks = 8;
+	sb->unify_max_logblocks = 1024;
+
+	/* Default limit of fast fsync, see tux3_fast_fsync() */
+	sb->fsync_max_blocks = 256;
 }
 
 static void setup_roots(struct sb *sb, struct disksuper *super)
@@ -91,6 +114,7 @@ static void __setup_sb(struct sb *sb, struct disksuper *super)
 	sb->unify		= TUX3_INIT_DELTA;
 	sb->marshal_delta	= TUX3_INIT_DELTA - 1;
 	sb->committed_delta	= TUX3_INIT_DELTA - 1;
+	sb->sync_delta		= TUX3_INIT_DELTA - 1;
 
 	/* Setup initial delta_ref */
 	__delta_transition(sb, &sb->delta_refs[0]);
@@ -116,6 +140,8 @@ static void __setup_sb(struct sb *sb, struct disksuper *super)
 	sb->atomdictsize = be64_to_cpu(super->atomdictsize);
 	sb->atomgen = be32_to_cpu(super->atomgen);
 	sb->freeatom = be32_to_cpu(super->freeatom);
+	sb->freexvalue = be32_to_cpu(super->freexvalue);
+	sb->xvaluegen = be32_to_cpu(super->xvaluegen);
 	/* logchain and logcount are read from super directly */
 	trace("blocksize %u, blockbits %u, blockmask %08x",
 	      sb->blocksize, sb->blockbits, sb->blockmask);
@@ -156,14 +182,43 @@ int load_sb(struct sb *sb)
 	err = devio(READ, sb_dev(sb), SB_LOC, super, SB_LEN);
 	if (err)
 		return err;
-	if (memcmp(super->magic, TUX3_MAGIC_STR, sizeof(super->magic)))
+	if (!memcmp(super->magic, TUX3_MAGIC_OLD_STR, sizeof(super->magic))) {
+		/*
+		 * Old format is a subset of new one (no flags, and log
+		 * is !LOGBLOCK_COMPACT). Next commit writes new magic,
+		 * so old code can't mount after we wrote new format.
+		 */
+		if (super->flags)
+			return -EINVAL;
+		memcpy(super->magic, TUX3_MAGIC_STR, sizeof(super->magic));
+	} else if (memcmp(super->magic, TUX3_MAGIC_STR, sizeof(super->magic)))
 		return -EINVAL;
+	/* Format is changed by flags, refuse if we don't know it */
+	if (super->flags & ~cpu_to_be64(TUX3_FLAGS_SUPPORTED)) {
+		tux3_err(sb, "unsupported format flags %Lx",
+			 be64_to_cpu(super->flags) & ~TUX3_FLAGS_SUPPORTED);
+		return -EOPNOTSUPP;
+	}
 
 	__setup_sb(sb, super);
 
 	return 0;
 }
 
+/* Write sb->super as is */
+static int write_sb(struct sb *sb)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	/*
+	 * This is the commit block. Flush previous writes of delta
+	 * before this, and make this stable before returning.
+	 */
+	return devio(WRITE_FLUSH_FUA, sb_dev(sb), SB_LOC, &sb->super, SB_LEN);
+}
+
 int save_sb(struct sb *sb)
 {
 	if(DEBUG_MODE_K==1)
@@ -182,31 +237,34 @@ int save_sb(struct sb *sb)
 	super->atomdictsize = cpu_to_be64(sb->atomdictsize);
 	super->freeatom = cpu_to_be32(sb->freeatom);
 	super->atomgen = cpu_to_be32(sb->atomgen);
+	super->freexvalue = cpu_to_be32(sb->freexvalue);
+	super->xvaluegen = cpu_to_be32(sb->xvaluegen);
 	/* logchain and logcount are written to super directly */
 
-	return devio(WRITE_SYNC, sb_dev(sb), SB_LOC, super, SB_LEN);
+	return write_sb(sb);
 }
 
 /* Delta transition */
 
-static int relog_frontend_defer_as_bfree(struct sb *sb, u64 val)
+static int relog_frontend_defer_as_bfree(struct sb *sb, block_t block,
+					 unsigned count)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	log_bfree_relog(sb, val & ~(-1ULL << 48), val >> 48);
+	log_bfree_relog(sb, block, count);
 	return 0;
 }
 
-static int relog_as_bfree(struct sb *sb, u64 val)
+static int relog_as_bfree(struct sb *sb, block_t block, unsigned count)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	log_bfree_relog(sb, val & ~(-1ULL << 48), val >> 48);
-	return stash_value(&sb->defree, val);
+	log_bfree_relog(sb, block, count);
+	return defer_bfree(&sb->defree, block, count);
 }
 
 /* Obsolete the old unify, then start the log of new unify */
@@ -288,6 +346,7 @@ static int unify_log(struct sb *sb)
 	 */
 	list_splice_init(&sb->unify_buffers,
 			 tux3_dirty_buffers(sb->volmap, TUX3_INIT_DELTA));
+	sb->unify_buffers_count = 0;
 	/*
 	 * tux3_mark_buffer_unify() doesn't dirty inode, so we make
 	 * sure volmap is dirty for unify buffers, now.
@@ -384,14 +443,28 @@ static int write_log(struct sb *sb)
 	return tux3_flush_inode_internal(sb->logmap, TUX3_INIT_DELTA);
 }
 
+/*
+ * Data copies of fast fsync are obsoleted by this delta, so free
+ * those after this delta like other defered bfree.
+ */
+static int fsync_blocks_bfree(struct sb *sb, block_t block, unsigned count)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	log_bfree(sb, block, count);
+	return defer_bfree(&sb->defree, block, count);
+}
+
 /* userland only */
-int apply_defered_bfree(struct sb *sb, u64 val)
+int apply_defered_bfree(struct sb *sb, block_t block, unsigned count)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	return bfree(sb, val & ~(-1ULL << 48), val >> 48);
+	return bfree(sb, block, count);
 }
 
 static int commit_delta(struct sb *sb)
@@ -422,16 +495,137 @@ static void post_commit(struct sb *sb, unsigned delta)
 	free_forked_buffers(sb, NULL, 0);
 
 	tux3_clear_dirty_inodes(sb, delta);
+
+	/* Dirty buffers of this delta were written */
+	atomic_set(&tux3_sb_ddc(sb, delta)->dirty_blocks, 0);
+}
+
+/*
+ * Delta was committed (or failed), wake up waiters and allow next delta
+ * transition. If failed, ->committed_delta is not advanced, and waiters
+ * see TUX3_COMMIT_ERROR_BIT instead.
+ */
+static void flush_delta_done(struct sb *sb, unsigned delta, int err)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	if (err)
+		set_bit(TUX3_COMMIT_ERROR_BIT, &sb->backend_state);
+	else
+		sb->committed_delta = delta;
+	smp_mb__before_clear_bit();
+	clear_bit(TUX3_COMMIT_WRITING_BIT, &sb->backend_state);
+	clear_bit(TUX3_COMMIT_RUNNING_BIT, &sb->backend_state);
+
+	/* Wake up waiters for delta commit */
+	wake_up_all(&sb->delta_event_wq);
+}
+
+/*
+ * Write the commit block after all I/O of delta was done. This runs
+ * from workqueue, so backend can return without waiting I/O, and
+ * frontend can continue next delta until next delta transition.
+ */
+static void commit_work_fn(struct work_struct *work)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = container_of(work, struct sb, commit_work);
+	unsigned delta = sb->commit_delta;
+	int err;
+
+	tux3_start_backend(sb);
+	err = commit_delta(sb);
+	if (err)
+		tux3_err(sb, "commit of delta %u failed (err %d)", delta, err);
+	tux3_end_backend();
+	printk(KERN_INFO"<<<<<<<<< commit done %u", delta);
+
+	post_commit(sb, delta);
+	printk(KERN_INFO"<<<<<<<<< post commit done %u", delta);
+
+	flush_delta_done(sb, delta, err);
 }
 
+/*
+ * Commit block write is needed to finish delta, i.e. to clean dirty
+ * pages. So, this has to progress under memory pressure.
+ */
+static struct workqueue_struct *tux3_commit_wq;
+
+int __init tux3_init_commit_wq(void)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	tux3_commit_wq = alloc_workqueue("tux3-commit", WQ_MEM_RECLAIM, 0);
+	if (!tux3_commit_wq)
+		return -ENOMEM;
+	return 0;
+}
+
+void tux3_destroy_commit_wq(void)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	destroy_workqueue(tux3_commit_wq);
+}
+
+/* Called when all I/O of delta was done (maybe from bio completion) */
+static void commit_iowait_end_io(struct iowait *iowait)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = container_of(iowait, struct sb, commit_iowait);
+	queue_work(tux3_commit_wq, &sb->commit_work);
+}
+
+/* Wait until commit_work was done, e.g. for umount */
+void tux3_wait_commit_work(struct sb *sb)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	wait_event(sb->delta_event_wq,
+		   !test_bit(TUX3_COMMIT_WRITING_BIT, &sb->backend_state));
+	flush_work(&sb->commit_work);
+}
+
+/*
+ * Unify scheduling. Replay has to read and apply all log blocks since
+ * last unify, while unify has to write unify_buffers (bnodes) and relog
+ * deunify stash. So, unify when the log to replay outweighs the cost
+ * of unify, and always if replay would go over ->unify_max_logblocks.
+ */
 static int need_unify(struct sb *sb)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	static unsigned crudehack;
-	return !(++crudehack % 3);
+	unsigned logcount = be32_to_cpu(sb->super.logcount);
+	unsigned cost;
+
+	if (logcount < sb->unify_min_logblocks)
+		return 0;
+	if (logcount >= sb->unify_max_logblocks)
+		return 1;
+
+	/* Blocks to write for unify, relog is about a u64 per deunify extent */
+	cost = sb->unify_buffers_count;
+	cost += (sb->deunify.count * sizeof(u64)) >> sb->blockbits;
+
+	return logcount >= cost;
 }
 
 enum unify_flags { NO_UNIFY, ALLOW_UNIFY, FORCE_UNIFY, };
@@ -474,19 +668,22 @@ static int do_commit(struct sb *sb, enum unify_flags unify_flag)
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	unsigned delta = sb->marshal_delta;
-	struct iowait iowait;
 	int err = 0;
 
 	printk(KERN_INFO">>>>>>>>> commit delta %u", delta);
 	/* further changes of frontend belong to the next delta */
 	tux3_start_backend(sb);
 
-	/* Prepare to wait I/O */
-	tux3_iowait_init(&iowait);
-	sb->iowait = &iowait;
+	/*
+	 * Prepare to wait I/O. Previous commit_work was done, because
+	 * we are holding TUX3_COMMIT_RUNNING_BIT.
+	 */
+	tux3_iowait_init(&sb->commit_iowait);
+	sb->iowait = &sb->commit_iowait;
 
-	/* Add delta log for debugging. */
+	/* Add delta log, this obsoletes logs of fast fsync */
 	log_delta(sb);
+	unstash(sb, &sb->fsync_blocks, fsync_blocks_bfree);
 
 	/*
 	 * NOTE: This works like modification from frontend. (i.e. this
@@ -516,26 +713,18 @@ static int do_commit(struct sb *sb, enum unify_flags unify_flag)
 
 	write_btree(sb, delta);
 	write_log(sb);
-
-	/* Wait I/O was submitted */
-	tux3_iowait_wait(&iowait);
+	tux3_end_backend();
 
 	/*
-	 * Commit last block (for now, this is sync I/O).
-	 *
-	 * FIXME: If this is not data integrity write, we don't have
-	 * to wait the commit block. The commit block just have to
-	 * written before next block block. (But defree must be after
-	 * commit block.)
+	 * All I/O of delta was submitted. Don't wait it here, the
+	 * commit block is written by commit_work after all I/O was
+	 * done, and TUX3_COMMIT_RUNNING_BIT is held until then.
 	 */
-	commit_delta(sb);
-	tux3_end_backend();
-	printk(KERN_INFO"<<<<<<<<< commit done %u", delta);
+	sb->commit_delta = delta;
+	set_bit(TUX3_COMMIT_WRITING_BIT, &sb->backend_state);
+	tux3_iowait_async(&sb->commit_iowait, commit_iowait_end_io);
 
-	post_commit(sb, delta);
-	printk(KERN_INFO"<<<<<<<<< post commit done %u", delta);
-
-	return err; /* FIXME: error handling */
+	return err;
 }
 
 /*
@@ -559,12 +748,226 @@ static int flush_delta(struct sb *sb)
 #endif
 
 	err = do_commit(sb, unify_flag);
+	if (err) {
+		/*
+		 * FIXME: error handling. Commit block was not submitted,
+		 * so delta is not committed. Just wait I/O of delta
+		 * submitted so far, and report error to waiters.
+		 */
+		tux3_end_backend();
+		tux3_iowait_wait(&sb->commit_iowait);
+		tux3_err(sb, "commit of delta %u failed (err %d)", delta, err);
+		flush_delta_done(sb, delta, err);
+	}
 
-	sb->committed_delta = delta;
-	clear_bit(TUX3_COMMIT_RUNNING_BIT, &sb->backend_state);
+	return err;
+}
 
-	/* Wake up waiters for delta commit */
+/*
+ * Fast fsync
+ *
+ * Instead of committing whole delta, write the copy of dirty data of
+ * one inode to new blocks, and log those (LOG_FSYNC_DATA) with size
+ * and timestamps (LOG_FSYNC_ATTR). Then write log blocks, and superblock
+ * to update log chain (other fields are still of last commit).
+ *
+ * Next delta commit writes the data as usual, and obsoletes the logs
+ * by LOG_DELTA, then frees the copies. On replay, fast fsync logs
+ * after last LOG_DELTA are redone by replay_stage3().
+ */
+
+/* Max vecs of one bio for data copy */
+#define FSYNC_BIO_VECS		16
+
+/* Can inode use fast fsync? (caller must hold backend) */
+static int can_fast_fsync(struct inode *inode, unsigned delta)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(inode->i_sb);
+	struct tux3_inode *tuxnode = tux_inode(inode);
+
+	/* Only block data of regular file can be logged */
+	if (!S_ISREG(inode->i_mode) || !inode->i_nlink)
+		return 0;
+	if (tuxnode->inline_data || i_size_read(inode) <= tux3_inline_max(sb))
+		return 0;
+	/* Inode is not in itree yet, replay can't find it */
+	if (!list_empty(&tuxnode->alloc_list))
+		return 0;
+	/* Truncate and hole punch are not logged */
+	if (!list_empty(&tux3_inode_ddc(inode, delta)->dirty_holes))
+		return 0;
+	/* Only size and timestamps are logged, not other attributes */
+	if (tux3_iattr_changed(inode, delta))
+		return 0;
+	/* Xattrs are not logged */
+	if (tux3_xattr_is_dirty(inode))
+		return 0;
+	return 1;
+}
+
+static int buffer_index_cmp(const void *a, const void *b)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	block_t ia = bufindex(*(struct buffer_head **)a);
+	block_t ib = bufindex(*(struct buffer_head **)b);
+
+	return ia < ib ? -1 : ia > ib;
+}
+
+/* Write copy of buffers to new blocks, and log those */
+static int fsync_write_data(struct sb *sb, inum_t inum,
+			    struct buffer_head **bufs, unsigned count)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned max_vecs = min(FSYNC_BIO_VECS, bio_get_nr_vecs(sb_dev(sb)));
+	struct bio_vec vecs[FSYNC_BIO_VECS];
+	unsigned i = 0;
+	int err;
+
+	while (i < count) {
+		struct block_segment seg;
+		block_t block, limit;
+
+		err = balloc_partial(sb, count - i, &seg, 1);
+		if (err)
+			return err;
+		/* Free copies after next delta */
+		err = defer_bfree(&sb->fsync_blocks, seg.block, seg.count);
+		if (err) {
+			bfree(sb, seg.block, seg.count);
+			return err;
+		}
+
+		block = seg.block;
+		limit = seg.block + seg.count;
+		while (block < limit) {
+			block_t index = bufindex(bufs[i]);
+			unsigned n = 0;
+
+			/* Make I/O and log for contiguous index */
+			do {
+				struct buffer_head *buffer = bufs[i + n];
+				vecs[n] = (struct bio_vec){
+					.bv_page	= buffer->b_page,
+					.bv_offset	= bh_offset(buffer),
+					.bv_len		= sb->blocksize,
+				};
+				n++;
+			} while (block + n < limit && n < max_vecs &&
+				 bufindex(bufs[i + n]) == index + n);
+
+			err = syncio(WRITE, sb_dev(sb), block << sb->blockbits,
+				     n, vecs);
+			if (err) {
+				/*
+				 * Deferred free logs LOG_BFREE for whole
+				 * segment, so log the copies not logged by
+				 * LOG_FSYNC_DATA as allocated.
+				 */
+				log_balloc(sb, block, limit - block);
+				return err;
+			}
+			log_fsync_data(sb, inum, index, block, n);
+
+			block += n;
+			i += n;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Return 1 if inode can't use fast fsync, caller should commit delta
+ * instead. Caller must hold ->i_mutex.
+ */
+int tux3_fast_fsync(struct inode *inode)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(inode->i_sb);
+	struct address_space *mapping = inode->i_mapping;
+	struct buffer_head **bufs, *buffer;
+	struct list_head *head;
+	struct iowait iowait;
+	unsigned delta, count = 0, logblocks, i;
+	int err = 1;
+
+	if (!sb->fsync_max_blocks)
+		return 1;
+	bufs = malloc(sb->fsync_max_blocks * sizeof(*bufs));
+	if (!bufs)
+		return 1;
+
+	/* Hold backend, so no delta transition and no commit is running */
+	wait_event(sb->delta_event_wq,
+		   !test_and_set_bit(TUX3_COMMIT_RUNNING_BIT,
+				     &sb->backend_state));
+	delta = rcu_dereference_check(sb->current_delta, 1)->delta;
+
+	if (!can_fast_fsync(inode, delta))
+		goto out;
+
+	/* Grab dirty buffers of inode on current delta */
+	head = tux3_dirty_buffers(inode, delta);
+	spin_lock(&mapping->private_lock);
+	list_for_each_entry(buffer, head, b_assoc_buffers) {
+		if (count == sb->fsync_max_blocks)
+			break;
+		bufs[count++] = buffer;
+		get_bh(buffer);
+	}
+	if (&buffer->b_assoc_buffers != head) {
+		/* Too many, cheaper to commit delta */
+		spin_unlock(&mapping->private_lock);
+		goto out_put;
+	}
+	spin_unlock(&mapping->private_lock);
+
+	sort(bufs, count, sizeof(*bufs), buffer_index_cmp, NULL);
+
+	tux3_start_backend(sb);
+	tux3_iowait_init(&iowait);
+	sb->iowait = &iowait;
+
+	err = fsync_write_data(sb, tux_inode(inode)->inum, bufs, count);
+	if (!err) {
+		log_fsync_attr(sb, tux_inode(inode)->inum, i_size_read(inode),
+			       inode->i_mtime, inode->i_ctime);
+		/* write_log() resets ->lognext */
+		logblocks = sb->lognext;
+		err = write_log(sb);
+		/* Account log pinned until unify, see need_delta() */
+		if (!err)
+			atomic_add(logblocks, &tux3_sb_ddc(sb, delta)->log_blocks);
+	}
+	tux3_iowait_wait(&iowait);
+	/* FIXME: error handling. Logs may be written partially */
+	if (!err)
+		err = write_sb(sb);
+	tux3_end_backend();
+	trace("fast fsync inum %Lu, %u blocks, err %d",
+	      tux_inode(inode)->inum, count, err);
+
+out_put:
+	for (i = 0; i < count; i++)
+		put_bh(bufs[i]);
+out:
+	clear_bit(TUX3_COMMIT_RUNNING_BIT, &sb->backend_state);
 	wake_up_all(&sb->delta_event_wq);
+	free(bufs);
 
 	return err;
 }
@@ -621,11 +1024,20 @@ static void __delta_transition(struct sb *sb, struct delta_ref *delta_ref)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
+	struct sb_delta_dirty *s_ddc;
+
 	/* Set the initial refcount is released by try_delta_transition(). */
 	assert(atomic_read(&delta_ref->refcount) == 0);
 	atomic_set(&delta_ref->refcount, 1);
 	/* Assign the delta number */
 	delta_ref->delta = sb->next_delta++;
+	/* Reset stats of new delta, previous user of s_ddc was committed */
+	s_ddc = tux3_sb_ddc(sb, delta_ref->delta);
+	s_ddc->dirty_count = 0;
+	atomic_set(&s_ddc->dirty_blocks, 0);
+	atomic_set(&s_ddc->changes, 0);
+	atomic_set(&s_ddc->log_blocks, 0);
+	s_ddc->start = jiffies;
 #ifdef UNIFY_DEBUG
 	delta_ref->unify_flag = ALLOW_UNIFY;
 #endif
@@ -711,6 +1123,16 @@ int force_delta(struct sb *sb)
 	return sync_current_delta(sb, NO_UNIFY);
 }
 
+/* Start the commit of current delta, but don't wait it */
+int kick_delta(struct sb *sb)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return start_current_delta(sb);
+}
+
 unsigned tux3_get_current_delta(void)
 {
 	if(DEBUG_MODE_K==1)
@@ -809,23 +1231,111 @@ void change_end_atomic_nested(struct sb *sb, void *ptr)
 	current->journal_info = ptr;
 }
 
+/*
+ * Delta sizing policy. Start delta transition if current delta grew
+ * over one of per-sb limits (dirty bytes, dirty inodes, changes, log
+ * bytes), or is older than ->delta_max_age. So, deltas are big under
+ * throughput load, and short lived under light load.
+ *
+ * Log of delta itself is written at commit, so log bytes counts only
+ * log written by fast fsync on this delta. It is pinned until unify,
+ * and the delta has to be committed before unify can obsolete it.
+ */
 static int need_delta(struct sb *sb)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	static unsigned crudehack;
-	return !(++crudehack % 10);
+	struct delta_ref *delta_ref = rcu_dereference_check(sb->current_delta, 1);
+	struct sb_delta_dirty *s_ddc = tux3_sb_ddc(sb, delta_ref->delta);
+	unsigned changes = atomic_inc_return(&s_ddc->changes);
+	u64 dirty = (u64)atomic_read(&s_ddc->dirty_blocks) << sb->blockbits;
+	u64 logbytes = (u64)atomic_read(&s_ddc->log_blocks) << sb->blockbits;
+
+	if (dirty >= sb->delta_max_bytes)
+		return 1;
+	if (ACCESS_ONCE(s_ddc->dirty_count) >= sb->delta_max_inodes)
+		return 1;
+	if (changes >= sb->delta_max_changes)
+		return 1;
+	if (logbytes >= sb->delta_max_logbytes)
+		return 1;
+	return time_after(jiffies, s_ddc->start + sb->delta_max_age);
 }
 
+#if TUX3_FLUSHER != TUX3_FLUSHER_SYNC
+/* Max time to pause writer, same with MAX_PAUSE of balance_dirty_pages() */
+#define TUX3_MAX_PAUSE		(HZ / 5)
+
+/*
+ * Dirty state of frontend not written yet, in blocks. This is dirty
+ * buffers of deltas not committed yet, forked buffers not freed yet,
+ * and log blocks pinned until unify.
+ */
+static unsigned long tux3_dirty_blocks(struct sb *sb)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned long dirty = 0;
+	int i;
+
+	for (i = 0; i < TUX3_MAX_DELTA; i++)
+		dirty += atomic_read(&sb->s_ddc[i].dirty_blocks);
+	dirty += atomic_read(&sb->forked_count);
+	dirty += be32_to_cpu(ACCESS_ONCE(sb->super.logcount));
+
+	return dirty;
+}
+
+/*
+ * Dirty throttling, similar to balance_dirty_pages(). Writers run
+ * freely until dirty state is half of ->dirty_max_bytes. Over it, this
+ * starts delta transition, and pauses writer in proportion to dirty
+ * state over half, up to TUX3_MAX_PAUSE at the limit. Pause ends early
+ * if delta commit reduced dirty state.
+ *
+ * Caller must not hold delta, otherwise delta transition can't finish.
+ */
+static void tux3_balance_dirty(struct sb *sb)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned long limit = sb->dirty_max_bytes >> sb->blockbits;
+	unsigned long freerun = limit / 2;
+	unsigned long dirty = tux3_dirty_blocks(sb);
+	long pause;
+
+	if (dirty <= freerun)
+		return;
+
+	start_background_delta(sb);
+
+	dirty = min(dirty, limit);
+	pause = TUX3_MAX_PAUSE * (dirty - freerun) / (limit - freerun);
+	if (pause > 0) {
+		wait_event_timeout(sb->delta_event_wq,
+				   tux3_dirty_blocks(sb) <= freerun, pause);
+	}
+}
+#else /* TUX3_FLUSHER == TUX3_FLUSHER_SYNC */
+static inline void tux3_balance_dirty(struct sb *sb)
+{
+	/* change_end() flushes delta synchronously, no need to throttle */
+}
+#endif /* TUX3_FLUSHER == TUX3_FLUSHER_SYNC */
+
 /*
  * Normal version of change_begin/end. If there is no special
  * requirement, we should use this version.
  *
  * This checks backend job and run if disabled asynchronous backend,
  * and blocked if disabled asynchronous backend and backend is
- * running.
+ * running. And writers are throttled if dirty state is over budget.
  */
 void change_begin(struct sb *sb)
 {
@@ -833,6 +1343,7 @@ void change_begin(struct sb *sb)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
+	tux3_balance_dirty(sb);
 #if TUX3_FLUSHER == TUX3_FLUSHER_SYNC
 	down_read(&sb->delta_lock);
 #endif
@@ -853,8 +1364,14 @@ int change_end(struct sb *sb)
 
 	down_write(&sb->delta_lock);
 #endif
-	if (need_delta(sb))
+	if (need_delta(sb)) {
+#if TUX3_FLUSHER == TUX3_FLUSHER_SYNC
 		try_delta_transition(sb);
+#else
+		/* try_delta_transition() is no-op for ASYNC_HACK */
+		start_background_delta(sb);
+#endif
+	}
 
 #if TUX3_FLUSHER == TUX3_FLUSHER_SYNC
 	err = flush_pending_delta(sb);
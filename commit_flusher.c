@@ -204,7 +204,8 @@ static int try_flush_pending_until_delta(struct sb *sb, unsigned delta)
 		flush_pending_delta(sb);
 #endif
 
-	return delta_after_eq(sb->committed_delta, delta);
+	return delta_after_eq(sb->committed_delta, delta) ||
+		test_bit(TUX3_COMMIT_ERROR_BIT, &sb->backend_state);
 }
 
 static int wait_for_commit(struct sb *sb, unsigned delta)
@@ -248,6 +249,8 @@ static int sync_current_delta(struct sb *sb, enum unify_flags unify_flag)
 
 	/* Wait until committing the current delta */
 	err = wait_for_commit(sb, delta);
+	if (!err && test_bit(TUX3_COMMIT_ERROR_BIT, &sb->backend_state))
+		err = -EIO;
 	assert(err || delta_after_eq(sb->committed_delta, delta));
 #if TUX3_FLUSHER == TUX3_FLUSHER_SYNC
 	up_write(&sb->delta_lock);
@@ -255,4 +258,39 @@ static int sync_current_delta(struct sb *sb, enum unify_flags unify_flag)
 
 	return err;
 }
+
+static int start_current_delta(struct sb *sb)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+#if TUX3_FLUSHER == TUX3_FLUSHER_SYNC
+	/* Nobody runs backend asynchronously */
+	return sync_current_delta(sb, NO_UNIFY);
+#else
+	struct delta_ref *delta_ref;
+	unsigned delta;
+
+	delta_ref = delta_get(sb);
+	delta = delta_ref->delta;
+	delta_put(sb, delta_ref);
+
+	/* If backend is running, delta transition is done by later caller */
+	try_delta_transition_until_delta(sb, delta);
+	return 0;
+#endif
+}
+
+#if TUX3_FLUSHER != TUX3_FLUSHER_SYNC
+/* Start delta transition without waiting, for dirty throttling */
+static void start_background_delta(struct sb *sb)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	try_delta_transition(sb);
+}
+#endif
 #endif /* TUX3_FLUSHER == TUX3_FLUSHER_ASYNC_HACK */
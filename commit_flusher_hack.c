@@ -493,6 +493,15 @@ static void tux3_wakeup_writeback(struct backing_dev_info *bdi)
 	wake_up_process(bdi->wb.task);
 }
 
+static void tux3_kick_writeback(struct backing_dev_info *bdi)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	tux3_wakeup_writeback(bdi);
+}
+
 static void tux3_destroy_writeback(struct backing_dev_info *bdi)
 {
 	if(DEBUG_MODE_K==1)
@@ -612,6 +621,15 @@ static void tux3_wakeup_writeback(struct backing_dev_info *bdi)
 {
 }
 
+static void tux3_kick_writeback(struct backing_dev_info *bdi)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	mod_delayed_work(kernel_bdi_wq, &bdi->wb.dwork, 0);
+}
+
 static void tux3_destroy_writeback(struct backing_dev_info *bdi)
 {
 	if(DEBUG_MODE_K==1)
@@ -699,18 +717,87 @@ static void try_delta_transition(struct sb *sb)
 #endif
 }
 
+/*
+ * Group commit. Return true if caller has to start sync of delta. If
+ * other caller already started sync of delta (or later), caller's
+ * changes will be committed by it, so caller just waits the commit.
+ */
+static int sync_delta_start(struct sb *sb, unsigned delta)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned old = ACCESS_ONCE(sb->sync_delta);
+
+	while (!delta_after_eq(old, delta)) {
+		unsigned prev = cmpxchg(&sb->sync_delta, old, delta);
+		if (prev == old)
+			return 1;
+		old = prev;
+	}
+	return 0;
+}
+
 static int sync_current_delta(struct sb *sb, enum unify_flags unify_flag)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
+	struct delta_ref *delta_ref;
+	unsigned delta;
+
 	/* FORCE_UNIFY is not supported */
 	WARN_ON(unify_flag == FORCE_UNIFY);
-	/* This is called only for fsync, so we can take ->s_umount here */
-	down_read(&vfs_sb(sb)->s_umount);
-	sync_inodes_sb(vfs_sb(sb));
-	up_read(&vfs_sb(sb)->s_umount);
-	return 0;	/* FIXME: error code */
+
+	/* Get delta that have to write */
+	delta_ref = delta_get(sb);
+	delta = delta_ref->delta;
+	delta_put(sb, delta_ref);
+
+	/* Only one caller per delta runs writeback, others just wait */
+	if (sync_delta_start(sb, delta)) {
+		/* This is called only for fsync, so we can take ->s_umount */
+		down_read(&vfs_sb(sb)->s_umount);
+		sync_inodes_sb(vfs_sb(sb));
+		up_read(&vfs_sb(sb)->s_umount);
+	}
+
+	/* Commit block is written asynchronously, wait it */
+	wait_event(sb->delta_event_wq,
+		   delta_after_eq(sb->committed_delta, delta) ||
+		   test_bit(TUX3_COMMIT_ERROR_BIT, &sb->backend_state));
+	if (test_bit(TUX3_COMMIT_ERROR_BIT, &sb->backend_state))
+		return -EIO;
+	return 0;
+}
+
+static int start_current_delta(struct sb *sb)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	/*
+	 * Caller holds ->s_umount. This waits writeback work (i.e.
+	 * flush_delta()), but not the commit block.
+	 */
+	writeback_inodes_sb(vfs_sb(sb), WB_REASON_SYNC);
+	return 0;
+}
+
+/*
+ * Start delta transition without waiting, for dirty throttling. Caller
+ * may not be able to take ->s_umount, so just kick our flusher. It
+ * writes delta by background flush.
+ */
+static void start_background_delta(struct sb *sb)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	tux3_kick_writeback(vfs_sb(sb)->s_bdi);
 }
 #endif /* TUX3_FLUSHER != TUX3_FLUSHER_ASYNC_HACK */
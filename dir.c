@@ -150,50 +150,245 @@ void tux_update_dirent(struct inode *dir, struct buffer_head *buffer,
 	tux3_mark_inode_dirty(dir);
 }
 
-loff_t tux_create_entry(struct inode *dir, const char *name, unsigned len,
-			inum_t inum, umode_t mode, loff_t *size)
+static int dx_is_node(struct sb *sb, void *data);
+
+/*
+ * Find space for new entry of reclen in dirent block. Return NULL if
+ * there is no space.
+ */
+static tux_dirent *tux_find_space(struct inode *dir, struct buffer_head *buffer,
+				  unsigned reclen, unsigned *name_len,
+				  unsigned *rec_len)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	unsigned delta = tux3_get_current_delta();
 	struct sb *sb = tux_sb(dir->i_sb);
-	tux_dirent *entry;
-	struct buffer_head *buffer, *clone;
-	unsigned reclen = TUX_REC_LEN(len), rec_len, offset;
-	unsigned uninitialized_var(name_len);
-	unsigned blocksize = sb->blocksize;
-	block_t block, blocks = *size >> sb->blockbits;
-	void *olddata;
+	tux_dirent *entry = bufdata(buffer);
+	tux_dirent *limit = bufdata(buffer) + sb->blocksize - reclen;
 
-	for (block = 0; block < blocks; block++) {
-		buffer = blockread(mapping(dir), block);
-		if (!buffer)
-			return -EIO;
-		entry = bufdata(buffer);
-		tux_dirent *limit = bufdata(buffer) + blocksize - reclen;
-		while (entry <= limit) {
-			if (entry->rec_len == 0) {
-				blockput(buffer);
-				tux_zero_len_error(dir, block);
-				return -EIO;
-			}
-			name_len = TUX_REC_LEN(entry->name_len);
-			rec_len = tux_rec_len_from_disk(entry->rec_len);
-			if (is_deleted(entry) && rec_len >= reclen)
-				goto create;
-			if (rec_len >= name_len + reclen)
-				goto create;
-			entry = (void *)entry + rec_len;
+	/* Index block looks like one big deleted dirent, don't use it */
+	if (dx_is_node(sb, bufdata(buffer)))
+		return NULL;
+
+	while (entry <= limit) {
+		if (entry->rec_len == 0) {
+			tux_zero_len_error(dir, bufindex(buffer));
+			return ERR_PTR(-EIO);
 		}
+		*name_len = TUX_REC_LEN(entry->name_len);
+		*rec_len = tux_rec_len_from_disk(entry->rec_len);
+		if (is_deleted(entry) && *rec_len >= reclen)
+			return entry;
+		if (*rec_len >= *name_len + reclen)
+			return entry;
+		entry = (void *)entry + *rec_len;
+	}
+	return NULL;
+}
+
+/*
+ * Free space map of directory
+ *
+ * To find space for new entry, we had to read dirent blocks from
+ * first block on each create. Instead, this remembers the largest
+ * space for new entry in each block. The map is made by first create
+ * (reads all blocks once), then create/delete keep it up to date.
+ * Blocks not in the map yet (e.g. appended by index) are read lazily.
+ *
+ * The map is protected by i_mutex, like dirent blocks. Backend deletes
+ * atable dirents (atomref()) without i_mutex, so it doesn't touch the
+ * map, just marks it stale. Deletion only adds space, so stale map is
+ * still safe to use. It is rebuilt by next dir_space_get().
+ */
+struct dir_space {
+	block_t blocks;		/* Number of blocks in map */
+	block_t maxblocks;	/* Number of allocated slots */
+	u16 space[];		/* Largest space in TUX_DIR_ALIGN unit */
+};
+
+/* Return largest reclen which can be added to dirent block */
+static unsigned tux_block_space(struct inode *dir, void *data)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(dir->i_sb);
+	tux_dirent *entry = data;
+	tux_dirent *limit = data + sb->blocksize - TUX_REC_LEN(1);
+	unsigned space = 0;
+
+	if (dx_is_node(sb, data))
+		return 0;
+
+	while (entry <= limit) {
+		unsigned rec_len = tux_rec_len_from_disk(entry->rec_len);
+		unsigned used = 0;
+
+		/* Corrupted, tux_find_space() will report it if used */
+		if (rec_len == 0)
+			return 0;
+		if (!is_deleted(entry))
+			used = TUX_REC_LEN(entry->name_len);
+		if (rec_len > used)
+			space = max(space, rec_len - used);
+		entry = (void *)entry + rec_len;
+	}
+	return space;
+}
+
+void free_dir_space(struct inode *dir)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct tux3_inode *tuxnode = tux_inode(dir);
+
+	if (tuxnode->dir_space) {
+		free(tuxnode->dir_space);
+		tuxnode->dir_space = NULL;
+	}
+}
+
+/* Make room in map for blocks */
+static int dir_space_expand(struct inode *dir, block_t blocks)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct tux3_inode *tuxnode = tux_inode(dir);
+	struct dir_space *map = tuxnode->dir_space, *new;
+	block_t maxblocks = 16;
+
+	if (map) {
+		if (blocks <= map->maxblocks)
+			return 0;
+		maxblocks = map->maxblocks;
+	}
+	while (maxblocks < blocks)
+		maxblocks *= 2;
+
+	new = malloc(sizeof(*new) + maxblocks * sizeof(new->space[0]));
+	if (!new)
+		return -ENOMEM;
+	new->blocks = 0;
+	new->maxblocks = maxblocks;
+	if (map) {
+		new->blocks = map->blocks;
+		memcpy(new->space, map->space,
+		       map->blocks * sizeof(map->space[0]));
+		free(map);
+	}
+	tuxnode->dir_space = new;
+
+	return 0;
+}
+
+/*
+ * Get map which covers dirent blocks below size. If we couldn't make
+ * map, return NULL. Caller falls back to reading all blocks.
+ */
+static struct dir_space *dir_space_get(struct inode *dir, loff_t size)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(dir->i_sb);
+	struct tux3_inode *tuxnode = tux_inode(dir);
+	block_t blocks = size >> sb->blockbits;
+	struct dir_space *map;
+
+	if (dir_space_expand(dir, blocks))
+		return NULL;
+
+	map = tuxnode->dir_space;
+	/* Backend changed some blocks, read all again */
+	if (atomic_xchg(&tuxnode->dir_space_stale, 0))
+		map->blocks = 0;
+	while (map->blocks < blocks) {
+		struct buffer_head *buffer;
+
+		buffer = blockread(mapping(dir), map->blocks);
+		if (!buffer)
+			return NULL;
+		map->space[map->blocks] =
+			tux_block_space(dir, bufdata(buffer)) / TUX_DIR_ALIGN;
+		map->blocks++;
 		blockput(buffer);
 	}
-	entry = NULL;
-	buffer = blockget(mapping(dir), block);
-	assert(!buffer_dirty(buffer));
+	return map;
+}
+
+/* Update map for modified dirent block, or add if it was appended */
+static void dir_space_update(struct inode *dir, struct buffer_head *buffer)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct tux3_inode *tuxnode = tux_inode(dir);
+	struct dir_space *map;
+	block_t block = bufindex(buffer);
+
+	/* Backend doesn't hold i_mutex, map may be reallocated */
+	if (tux3_under_backend(tux_sb(dir->i_sb))) {
+		atomic_set(&tuxnode->dir_space_stale, 1);
+		return;
+	}
+
+	map = tuxnode->dir_space;
+	if (!map || block > map->blocks)
+		return;
+	if (block == map->blocks) {
+		if (dir_space_expand(dir, block + 1))
+			return;
+		map = tuxnode->dir_space;
+		map->blocks++;
+	}
+	map->space[block] = tux_block_space(dir, bufdata(buffer)) / TUX_DIR_ALIGN;
+}
+
+/* Find first block which has space for reclen, from block */
+static block_t dir_space_find(struct dir_space *map, block_t block,
+			      unsigned reclen)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	for (; block < map->blocks; block++) {
+		if (map->space[block] * TUX_DIR_ALIGN >= reclen)
+			break;
+	}
+	return block;
+}
+
+/*
+ * Add entry to space found by tux_find_space(), or to new block if
+ * entry == NULL. This releases buffer.
+ */
+static loff_t tux_add_entry(struct inode *dir, struct buffer_head *buffer,
+			    tux_dirent *entry, unsigned name_len,
+			    unsigned rec_len, const char *name, unsigned len,
+			    inum_t inum, umode_t mode, loff_t *size)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned delta = tux3_get_current_delta();
+	struct sb *sb = tux_sb(dir->i_sb);
+	unsigned blocksize = sb->blocksize;
+	block_t block = bufindex(buffer);
+	struct buffer_head *clone;
+	unsigned offset;
+	void *olddata;
 
-create:
 	/*
 	 * The directory is protected by i_mutex.
 	 * blockdirty() should never return -EAGAIN.
@@ -228,32 +423,109 @@ create:
 	entry->name_len = len;
 	memcpy(entry->name, name, len);
 	offset = (void *)entry - bufdata(clone);
+	dir_space_update(dir, clone);
 	/* this releases buffer */
 	tux_update_entry(clone, entry, inum, mode);
 
 	return (block << sb->blockbits) + offset; /* only for xattr create */
 }
 
-int tux_create_dirent(struct inode *dir, const struct qstr *qstr, inum_t inum,
-		      umode_t mode)
+/*
+ * Find dirent block which has space for reclen, below size. If there
+ * is no space, return new block after size with *result == NULL.
+ */
+static struct buffer_head *tux_get_space(struct inode *dir, loff_t size,
+					 unsigned reclen, tux_dirent **result,
+					 unsigned *name_len, unsigned *rec_len)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	loff_t where;
+	struct sb *sb = tux_sb(dir->i_sb);
+	block_t block, blocks = size >> sb->blockbits;
+	struct dir_space *map = dir_space_get(dir, size);
+	struct buffer_head *buffer;
+	tux_dirent *entry;
 
-	tux3_iattrdirty(dir);
+	for (block = 0; block < blocks; block++) {
+		if (map) {
+			block = dir_space_find(map, block, reclen);
+			if (block >= blocks)
+				break;
+		}
+		buffer = blockread(mapping(dir), block);
+		if (!buffer)
+			return ERR_PTR(-EIO);
+		entry = tux_find_space(dir, buffer, reclen, name_len, rec_len);
+		if (IS_ERR(entry)) {
+			blockput(buffer);
+			return ERR_CAST(entry);
+		}
+		if (entry) {
+			*result = entry;
+			return buffer;
+		}
+		if (map) {
+			/* FIXME: map was wrong, should not happen */
+			dir_space_update(dir, buffer);
+		}
+		blockput(buffer);
+	}
 
-	where = tux_create_entry(dir, (const char *)qstr->name, qstr->len, inum,
-				 mode, &dir->i_size);
-	if (where < 0)
-		return where;
+	*result = NULL;
+	buffer = blockget(mapping(dir), blocks);
+	if (!buffer)
+		return ERR_PTR(-ENOMEM);
+	assert(!buffer_dirty(buffer));
 
-	dir->i_mtime = dir->i_ctime = gettime();
-	tux3_mark_inode_dirty(dir);
+	return buffer;
+}
 
-	return 0;
+loff_t tux_create_entry(struct inode *dir, const char *name, unsigned len,
+			inum_t inum, umode_t mode, loff_t *size)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	tux_dirent *entry;
+	struct buffer_head *buffer;
+	unsigned reclen = TUX_REC_LEN(len), rec_len = 0;
+	unsigned uninitialized_var(name_len);
+
+	buffer = tux_get_space(dir, *size, reclen, &entry, &name_len,
+			       &rec_len);
+	if (IS_ERR(buffer))
+		return PTR_ERR(buffer);
+
+	return tux_add_entry(dir, buffer, entry, name_len, rec_len, name, len,
+			     inum, mode, size);
+}
+
+/* Find name in dirent block. Return NULL if not found. */
+static tux_dirent *tux_find_name(struct inode *dir, struct buffer_head *buffer,
+				 const char *name, unsigned len)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(dir->i_sb);
+	unsigned reclen = TUX_REC_LEN(len);
+	tux_dirent *entry = bufdata(buffer);
+	tux_dirent *limit = (void *)entry + sb->blocksize - reclen;
+
+	while (entry <= limit) {
+		if (entry->rec_len == 0) {
+			tux_zero_len_error(dir, bufindex(buffer));
+			return ERR_PTR(-EIO);
+		}
+		if (tux_match(entry, name, len))
+			return entry;
+		entry = next_entry(entry);
+	}
+	return NULL;
 }
 
 tux_dirent *tux_find_entry(struct inode *dir, const char *name, unsigned len,
@@ -264,7 +536,6 @@ tux_dirent *tux_find_entry(struct inode *dir, const char *name, unsigned len,
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	struct sb *sb = tux_sb(dir->i_sb);
-	unsigned reclen = TUX_REC_LEN(len);
 	block_t block, blocks = size >> sb->blockbits;
 	int err = -ENOENT;
 
@@ -274,20 +545,15 @@ tux_dirent *tux_find_entry(struct inode *dir, const char *name, unsigned len,
 			err = -EIO; // need ERR_PTR for blockread!!!
 			goto error;
 		}
-		tux_dirent *entry = bufdata(buffer);
-		tux_dirent *limit = (void *)entry + sb->blocksize - reclen;
-		while (entry <= limit) {
-			if (entry->rec_len == 0) {
+		tux_dirent *entry = tux_find_name(dir, buffer, name, len);
+		if (entry) {
+			if (IS_ERR(entry)) {
 				blockput(buffer);
-				tux_zero_len_error(dir, block);
-				err = -EIO;
+				err = PTR_ERR(entry);
 				goto error;
 			}
-			if (tux_match(entry, name, len)) {
-				*result = buffer;
-				return entry;
-			}
-			entry = next_entry(entry);
+			*result = buffer;
+			return entry;
 		}
 		blockput(buffer);
 	}
@@ -296,6 +562,44 @@ error:
 	return ERR_PTR(err);
 }
 
+#include "dir_index.c"
+
+int tux_create_dirent(struct inode *dir, const struct qstr *qstr, inum_t inum,
+		      umode_t mode)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	loff_t where, old_size = dir->i_size;
+
+	tux3_iattrdirty(dir);
+
+	where = 0;
+	if (!dir_is_indexed(dir) && dx_want_index(dir))
+		where = dx_convert(dir);
+	if (!where) {
+		if (dir_is_indexed(dir))
+			where = dx_create_entry(dir, (const char *)qstr->name,
+						qstr->len, inum, mode);
+		else
+			where = tux_create_entry(dir, (const char *)qstr->name,
+						 qstr->len, inum, mode,
+						 &dir->i_size);
+	}
+	if (where < 0) {
+		/* Save i_size for blocks added before error */
+		if (dir->i_size != old_size)
+			tux3_mark_inode_dirty(dir);
+		return where;
+	}
+
+	dir->i_mtime = dir->i_ctime = gettime();
+	tux3_mark_inode_dirty(dir);
+
+	return 0;
+}
+
 tux_dirent *tux_find_dirent(struct inode *dir, const struct qstr *qstr,
 			    struct buffer_head **result)
 {
@@ -303,6 +607,9 @@ tux_dirent *tux_find_dirent(struct inode *dir, const struct qstr *qstr,
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
+	if (dir_is_indexed(dir))
+		return dx_find_entry(dir, (const char *)qstr->name, qstr->len,
+				     result);
 	return tux_find_entry(dir, (const char *)qstr->name, qstr->len,
 			      result, dir->i_size);
 }
@@ -331,13 +638,39 @@ int tux_readdir(struct file *file, void *state, filldir_t filldir)
 	unsigned blockbits = sb->blockbits;
 	block_t block, blocks = dir->i_size >> blockbits;
 	unsigned offset = pos & sb->blockmask;
+	struct tux3_inode *tuxnode = tux_inode(dir);
+	unsigned long *sa_state = &tuxnode->statahead;
+	inum_t *inums = NULL;
+	int statahead;
 
 	assert(!(dir->i_size & sb->blockmask));
 
+	/*
+	 * Statahead only if lookup of children followed readdir. readdir
+	 * from start checks the pattern again, so plain readdir after
+	 * "ls -l" doesn't keep reading inodes.
+	 */
+	if (!pos) {
+		statahead = test_and_clear_bit(TUX3_SA_STAT, sa_state);
+		set_bit(TUX3_SA_READDIR, sa_state);
+		tuxnode->sa_entries = 0;
+		tuxnode->sa_hits = 0;
+	} else
+		statahead = test_bit(TUX3_SA_STAT, sa_state);
+
+	/* If no memory, just go without statahead */
+	if (statahead)
+		inums = malloc(sb->blocksize / TUX_REC_LEN(1) * sizeof(*inums));
+
 	for (block = pos >> blockbits ; block < blocks; block++) {
+		/* Keep reading ahead of the dirent blocks we walk */
+		blockread_ahead(file, mapping(dir), block, blocks);
+
 		struct buffer_head *buffer = blockread(mapping(dir), block);
-		if (!buffer)
+		if (!buffer) {
+			free(inums);
 			return -EIO;
+		}
 		void *base = bufdata(buffer);
 		if (revalidate) {
 			if (offset) {
@@ -352,10 +685,21 @@ int tux_readdir(struct file *file, void *state, filldir_t filldir)
 			revalidate = 0;
 		}
 		tux_dirent *limit = base + sb->blocksize - TUX_REC_LEN(1);
+		if (inums) {
+			/* Read inodes of this block before caller stat them */
+			unsigned count = 0;
+			for (tux_dirent *entry = base + offset; entry <= limit && entry->rec_len; entry = next_entry(entry)) {
+				if (!is_deleted(entry))
+					inums[count++] = be64_to_cpu(entry->inum);
+			}
+			if (count)
+				tux3_statahead(sb, inums, count);
+		}
 		for (tux_dirent *entry = base + offset; entry <= limit; entry = next_entry(entry)) {
 			if (entry->rec_len == 0) {
 				blockput(buffer);
 				tux_zero_len_error(dir, block);
+				free(inums);
 				return -EIO;
 			}
 			if (!is_deleted(entry)) {
@@ -366,17 +710,45 @@ int tux_readdir(struct file *file, void *state, filldir_t filldir)
 					be64_to_cpu(entry->inum), type);
 				if (lame) {
 					blockput(buffer);
+					free(inums);
 					return 0;
 				}
+				tuxnode->sa_entries++;
 			}
 			file->f_pos += tux_rec_len_from_disk(entry->rec_len);
 		}
 		blockput(buffer);
 		offset = 0;
 	}
+	free(inums);
 	return 0;
 }
 
+/*
+ * Lookup found a child after readdir. If enough of the entries
+ * returned by readdir were looked up (e.g. "ls -l"), next readdir
+ * does statahead. Caller holds i_mutex of dir.
+ */
+void tux_readdir_hit(struct inode *dir)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct tux3_inode *tuxnode = tux_inode(dir);
+
+	if (!test_bit(TUX3_SA_READDIR, &tuxnode->statahead))
+		return;
+
+	tuxnode->sa_hits++;
+	if (tuxnode->sa_hits >= TUX3_SA_MIN_HITS &&
+	    tuxnode->sa_hits * 4 >= tuxnode->sa_entries) {
+		set_bit(TUX3_SA_STAT, &tuxnode->statahead);
+		/* Pattern was used, next readdir from start checks again */
+		clear_bit(TUX3_SA_READDIR, &tuxnode->statahead);
+	}
+}
+
 int tux_delete_entry(struct inode *dir, struct buffer_head *buffer,
 		     tux_dirent *entry)
 {
@@ -419,6 +791,7 @@ int tux_delete_entry(struct inode *dir, struct buffer_head *buffer,
 	entry->name_len = entry->type = 0;
 	entry->inum = 0;
 
+	dir_space_update(dir, clone);
 	mark_buffer_dirty_non(clone);
 	blockput(clone);
 
@@ -432,16 +805,36 @@ int tux_delete_dirent(struct inode *dir, struct buffer_head *buffer,
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
+	block_t block = bufindex(buffer);
+	u32 hash = 0;
 	int err;
 
+	/* Entry is cleared by delete, so get hash before */
+	if (dir_is_indexed(dir))
+		hash = dx_hash(entry->name, entry->name_len);
+
 	err = tux_delete_entry(dir, buffer, entry); /* this releases buffer */
-	if (!err) {
-		tux3_iattrdirty(dir);
-		dir->i_ctime = dir->i_mtime = gettime();
-		tux3_mark_inode_dirty(dir);
+	if (err)
+		return err;
+
+	tux3_iattrdirty(dir);
+	dir->i_ctime = dir->i_mtime = gettime();
+	tux3_mark_inode_dirty(dir);
+
+	/*
+	 * Remove index only after dirent was deleted. If this failed,
+	 * stale index remains, but lookup checks names on dirent block,
+	 * so it only costs a block read.
+	 */
+	if (dir_is_indexed(dir)) {
+		err = dx_remove(dir, hash, block);
+		if (err)
+			tux3_warn(tux_sb(dir->i_sb),
+				  "failed to remove index: inum %Lu, err %d",
+				  tux_inode(dir)->inum, err);
 	}
 
-	return err;
+	return 0;
 }
 
 int tux_dir_is_empty(struct inode *dir)
@@ -0,0 +1,974 @@
+/*
+ * Hashed directory index
+ *
+ * Big directory has index of name hash to dirent block, so lookup,
+ * create, and delete don't have to read all dirent blocks.
+ *
+ * Index blocks are in the directory file, mixed with dirent blocks.
+ * Index block starts with a deleted dirent covering whole block, so
+ * readdir() and the other linear walkers just skip it. Unlike ext3
+ * htree, dirents are never moved by index, so readdir position is
+ * stable.
+ *
+ * Index is a btree of name hash. Leaf (level 0) has one entry for
+ * each dirent, points dirent block. Entry of upper level points index
+ * block, and its hash is lowest hash in the child. Entries with same
+ * hash are not split into different leaves if possible. If a leaf is
+ * full of one hash, it is split anyway, and the new leaf gets the hash
+ * with DX_HASH_CONT in parent, like ext3 htree. Lookup continues to
+ * next leaves while those are continuation of the hash.
+ *
+ * Root block is tuxnode->dx_root (DIR_INDEX_ATTR), and never moves. If
+ * root is full, root entries are moved to new child, and root grows
+ * one level. Full nodes are split on the way down, so parent always
+ * has space for new index.
+ *
+ * Linear directory is converted when it grows to DX_MIN_BLOCKS, only
+ * if TUX3_FLAG_DIRINDEX is set (old kernel can't read DIR_INDEX_ATTR).
+ *
+ * Empty index block is removed from parent, and reused as dirent
+ * block. FIXME: sparse index blocks are not merged, and the directory
+ * is never converted back to linear.
+ */
+
+#include "iattr.h"
+
+#define DX_MIN_BLOCKS		4	/* Blocks to convert directory */
+#define DX_MAX_LEVELS		8
+#define DX_NODE_OFFSET		TUX_REC_LEN(0)
+/* dx_hash() is even. Odd hash in upper level is continuation of hash */
+#define DX_HASH_CONT		1
+
+struct dx_node {
+	__be16 magic;
+	u8 level;		/* 0 is leaf */
+	u8 unused;
+	__be16 count;
+	__be16 unused2;
+	struct dx_entry {
+		__be32 hash;
+		__be32 block;
+	} entries[];
+};
+
+/* Lifted from ext3 dx_hack_hash(), but byte is unsigned */
+static u32 dx_hash(const char *name, unsigned len)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	const unsigned char *p = (const unsigned char *)name;
+	u32 hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+	while (len--) {
+		hash = hash1 + (hash0 ^ (*p++ * 7152373));
+		if (hash & 0x80000000)
+			hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return hash0 << 1;
+}
+
+static inline int dir_is_indexed(struct inode *dir)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return tux_inode(dir)->present & DIR_INDEX_BIT;
+}
+
+static inline struct dx_node *dx_node(void *data)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return data + DX_NODE_OFFSET;
+}
+
+static inline unsigned dx_count(struct dx_node *node)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return be16_to_cpu(node->count);
+}
+
+static inline unsigned dx_limit(struct sb *sb)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return (sb->blocksize - DX_NODE_OFFSET - sizeof(struct dx_node)) /
+		sizeof(struct dx_entry);
+}
+
+static int dx_is_node(struct sb *sb, void *data)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	tux_dirent *entry = data;
+
+	return is_deleted(entry) &&
+		tux_rec_len_from_disk(entry->rec_len) == sb->blocksize &&
+		dx_node(data)->magic == cpu_to_be16(TUX3_MAGIC_DXNODE);
+}
+
+/* Find position to insert hash, i.e. next of last entry <= hash */
+static struct dx_entry *dx_upper_bound(struct dx_node *node, u32 hash)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned lo = 0, hi = dx_count(node);
+
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (be32_to_cpu(node->entries[mid].hash) <= hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return node->entries + lo;
+}
+
+/* Find first entry >= hash */
+static struct dx_entry *dx_lower_bound(struct dx_node *node, u32 hash)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned lo = 0, hi = dx_count(node);
+
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (be32_to_cpu(node->entries[mid].hash) < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return node->entries + lo;
+}
+
+static void dx_add_at(struct dx_node *node, struct dx_entry *p, u32 hash,
+		      block_t block)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned count = dx_count(node);
+
+	vecmove(p + 1, p, node->entries + count - p);
+	p->hash = cpu_to_be32(hash);
+	p->block = cpu_to_be32(block);
+	node->count = cpu_to_be16(count + 1);
+}
+
+static void dx_add(struct dx_node *node, u32 hash, block_t block)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	dx_add_at(node, dx_upper_bound(node, hash), hash, block);
+}
+
+static void dx_del(struct dx_node *node, struct dx_entry *p)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned count = dx_count(node);
+	__be32 lowest = node->entries[0].hash;
+
+	vecmove(p, p + 1, node->entries + count - p - 1);
+	node->count = cpu_to_be16(count - 1);
+	/* Lookup of upper level depends on lowest hash of node */
+	if (node->level && count > 1)
+		node->entries[0].hash = lowest;
+}
+
+/* Path of index walk. Index of entry followed on each level */
+struct dx_frame {
+	block_t block;
+	unsigned at;
+};
+
+#define dx_corrupt_error(dir, block)					\
+	tux3_fs_error(tux_sb((dir)->i_sb),				\
+		      "bad directory index at inum %Lu, block %Lu",	\
+		      tux_inode(dir)->inum, (block_t)(block))
+
+static struct dx_node *dx_read(struct inode *dir, block_t block,
+			       struct buffer_head **bufp)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(dir->i_sb);
+	struct buffer_head *buffer;
+
+	if (block >= dir->i_size >> sb->blockbits) {
+		dx_corrupt_error(dir, block);
+		return ERR_PTR(-EIO);
+	}
+	buffer = blockread(mapping(dir), block);
+	if (!buffer)
+		return ERR_PTR(-EIO);
+	if (!dx_is_node(sb, bufdata(buffer))) {
+		blockput(buffer);
+		dx_corrupt_error(dir, block);
+		return ERR_PTR(-EIO);
+	}
+	*bufp = buffer;
+	return dx_node(bufdata(buffer));
+}
+
+/*
+ * The directory is protected by i_mutex.
+ * blockdirty() should never return -EAGAIN.
+ */
+static struct dx_node *dx_read_dirty(struct inode *dir, block_t block,
+				     struct buffer_head **bufp)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned delta = tux3_get_current_delta();
+	struct buffer_head *buffer, *clone;
+	struct dx_node *node;
+
+	node = dx_read(dir, block, &buffer);
+	if (IS_ERR(node))
+		return node;
+	clone = blockdirty(buffer, delta);
+	if (IS_ERR(clone)) {
+		assert(PTR_ERR(clone) != -EAGAIN);
+		blockput(buffer);
+		return ERR_CAST(clone);
+	}
+	*bufp = clone;
+	return dx_node(bufdata(clone));
+}
+
+/* Append new index block to directory */
+static struct dx_node *dx_new_node(struct inode *dir, unsigned level,
+				   struct buffer_head **bufp)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned delta = tux3_get_current_delta();
+	struct sb *sb = tux_sb(dir->i_sb);
+	block_t block = dir->i_size >> sb->blockbits;
+	struct buffer_head *buffer, *clone;
+	struct dx_node *node;
+	tux_dirent *entry;
+
+	buffer = blockget(mapping(dir), block);
+	if (!buffer)
+		return ERR_PTR(-ENOMEM);
+	assert(!buffer_dirty(buffer));
+	clone = blockdirty(buffer, delta);
+	if (IS_ERR(clone)) {
+		assert(PTR_ERR(clone) != -EAGAIN);
+		blockput(buffer);
+		return ERR_CAST(clone);
+	}
+
+	/* Looks like deleted dirent for linear walkers */
+	entry = bufdata(clone);
+	memset(entry, 0, sb->blocksize);
+	entry->rec_len = tux_rec_len_to_disk(sb->blocksize);
+
+	node = dx_node(bufdata(clone));
+	node->magic = cpu_to_be16(TUX3_MAGIC_DXNODE);
+	node->level = level;
+
+	dir->i_size += sb->blocksize;
+	*bufp = clone;
+	return node;
+}
+
+/* Walk down to leaf for hash, and remember path. Return depth of path. */
+static int dx_walk(struct inode *dir, u32 hash, struct dx_frame *frames)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	block_t block = tux_inode(dir)->dx_root;
+	struct buffer_head *buffer;
+	struct dx_node *node;
+	struct dx_entry *p;
+	unsigned level = DX_MAX_LEVELS;
+	int depth = 0;
+
+	while (1) {
+		node = dx_read(dir, block, &buffer);
+		if (IS_ERR(node))
+			return PTR_ERR(node);
+		if (node->level >= level || (node->level && !dx_count(node))) {
+			blockput(buffer);
+			dx_corrupt_error(dir, block);
+			return -EIO;
+		}
+		level = node->level;
+		frames[depth].block = block;
+		frames[depth].at = 0;
+		if (!level)
+			break;
+
+		p = dx_upper_bound(node, hash);
+		if (p > node->entries)
+			p--;
+		frames[depth].at = p - node->entries;
+		block = be32_to_cpu(p->block);
+		blockput(buffer);
+		depth++;
+	}
+	blockput(buffer);
+
+	return depth + 1;
+}
+
+/*
+ * If next leaf is continuation of hash (see dx_split()), move path to
+ * it. Return 1 if moved, 0 if hash doesn't continue, or error.
+ */
+static int dx_next_leaf(struct inode *dir, u32 hash, struct dx_frame *frames,
+			int depth)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct buffer_head *buffer;
+	struct dx_node *node;
+	int i = depth - 1, found = 0;
+
+	/* Find nearest upper level which has next entry */
+	while (!found && i-- > 0) {
+		node = dx_read(dir, frames[i].block, &buffer);
+		if (IS_ERR(node))
+			return PTR_ERR(node);
+		if (frames[i].at + 1 < dx_count(node)) {
+			u32 key = be32_to_cpu(node->entries[frames[i].at + 1].hash);
+			if (key != (hash | DX_HASH_CONT)) {
+				blockput(buffer);
+				return 0;
+			}
+			found = 1;
+		}
+		blockput(buffer);
+	}
+	if (!found)
+		return 0;
+
+	/* Walk down to the leftmost leaf of next entry */
+	frames[i].at++;
+	for (; i < depth - 1; i++) {
+		node = dx_read(dir, frames[i].block, &buffer);
+		if (IS_ERR(node))
+			return PTR_ERR(node);
+		if (node->level != depth - 1 - i || frames[i].at >= dx_count(node)) {
+			blockput(buffer);
+			dx_corrupt_error(dir, frames[i].block);
+			return -EIO;
+		}
+		frames[i + 1].block = be32_to_cpu(node->entries[frames[i].at].block);
+		frames[i + 1].at = 0;
+		blockput(buffer);
+	}
+
+	return 1;
+}
+
+/* Read leaf at end of path */
+static struct dx_node *dx_read_leaf(struct inode *dir, struct dx_frame *frames,
+				    int depth, struct buffer_head **bufp)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	block_t block = frames[depth - 1].block;
+	struct dx_node *leaf;
+
+	leaf = dx_read(dir, block, bufp);
+	if (!IS_ERR(leaf) && leaf->level) {
+		blockput(*bufp);
+		dx_corrupt_error(dir, block);
+		return ERR_PTR(-EIO);
+	}
+	return leaf;
+}
+
+static tux_dirent *dx_find_entry(struct inode *dir, const char *name,
+				 unsigned len, struct buffer_head **result)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	u32 hash = dx_hash(name, len);
+	struct dx_frame frames[DX_MAX_LEVELS];
+	struct buffer_head *leafbuf, *buffer;
+	struct dx_node *leaf;
+	struct dx_entry *p, *limit;
+	tux_dirent *entry;
+	int depth, err;
+
+	depth = dx_walk(dir, hash, frames);
+	if (depth < 0) {
+		err = depth;
+		goto error;
+	}
+
+	while (1) {
+		leaf = dx_read_leaf(dir, frames, depth, &leafbuf);
+		if (IS_ERR(leaf)) {
+			err = PTR_ERR(leaf);
+			goto error;
+		}
+
+		limit = leaf->entries + dx_count(leaf);
+		for (p = dx_lower_bound(leaf, hash); p < limit; p++) {
+			if (be32_to_cpu(p->hash) != hash)
+				break;
+
+			buffer = blockread(mapping(dir), be32_to_cpu(p->block));
+			if (!buffer) {
+				err = -EIO;
+				goto error_leafbuf;
+			}
+			entry = tux_find_name(dir, buffer, name, len);
+			if (entry) {
+				if (IS_ERR(entry)) {
+					blockput(buffer);
+					err = PTR_ERR(entry);
+					goto error_leafbuf;
+				}
+				blockput(leafbuf);
+				*result = buffer;
+				return entry;
+			}
+			blockput(buffer);
+		}
+		blockput(leafbuf);
+
+		/* Same hash may continue to next leaf */
+		if (p < limit)
+			break;
+		err = dx_next_leaf(dir, hash, frames, depth);
+		if (err < 0)
+			goto error;
+		if (!err)
+			break;
+	}
+	err = -ENOENT;
+	goto error;
+
+error_leafbuf:
+	blockput(leafbuf);
+error:
+	*result = NULL;		/* for debug */
+	return ERR_PTR(err);
+}
+
+/* Move root entries to new child, then root grows one level */
+static int dx_grow_root(struct inode *dir)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct buffer_head *rootbuf, *newbuf;
+	struct dx_node *root, *newnode;
+	unsigned count;
+
+	root = dx_read_dirty(dir, tux_inode(dir)->dx_root, &rootbuf);
+	if (IS_ERR(root))
+		return PTR_ERR(root);
+	if (root->level + 1 >= DX_MAX_LEVELS) {
+		blockput(rootbuf);
+		return -ENOSPC;
+	}
+	newnode = dx_new_node(dir, root->level, &newbuf);
+	if (IS_ERR(newnode)) {
+		blockput(rootbuf);
+		return PTR_ERR(newnode);
+	}
+
+	count = dx_count(root);
+	memcpy(newnode->entries, root->entries, count * sizeof(*root->entries));
+	newnode->count = root->count;
+
+	root->level++;
+	root->count = cpu_to_be16(1);
+	root->entries[0].hash = 0;
+	root->entries[0].block = cpu_to_be32(bufindex(newbuf));
+
+	mark_buffer_dirty_non(newbuf);
+	blockput(newbuf);
+	mark_buffer_dirty_non(rootbuf);
+	blockput(rootbuf);
+
+	return 0;
+}
+
+/* Split full node to new node, then add new node to parent */
+static int dx_split(struct inode *dir, block_t parent, block_t block)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct buffer_head *buffer, *newbuf, *parentbuf;
+	struct dx_node *node, *newnode, *pnode;
+	struct dx_entry *p, *limit;
+	unsigned count, mid, i;
+	u32 key, cont = 0;
+
+	node = dx_read_dirty(dir, block, &buffer);
+	if (IS_ERR(node))
+		return PTR_ERR(node);
+	count = dx_count(node);
+
+	/* Don't split same hash into two leaves. Find nearest boundary. */
+	mid = count / 2;
+	if (!node->level) {
+		for (i = 0; i < count / 2; i++) {
+			if (node->entries[mid - i - 1].hash !=
+			    node->entries[mid - i].hash) {
+				mid -= i;
+				break;
+			}
+			if (mid + i + 1 < count &&
+			    node->entries[mid + i].hash !=
+			    node->entries[mid + i + 1].hash) {
+				mid += i + 1;
+				break;
+			}
+		}
+		if (i == count / 2) {
+			/* All entries have same hash, continue to new leaf */
+			mid = count / 2;
+			cont = DX_HASH_CONT;
+		}
+	}
+	key = be32_to_cpu(node->entries[mid].hash) | cont;
+
+	pnode = dx_read_dirty(dir, parent, &parentbuf);
+	if (IS_ERR(pnode)) {
+		blockput(buffer);
+		return PTR_ERR(pnode);
+	}
+	assert(dx_count(pnode) < dx_limit(tux_sb(dir->i_sb)));
+
+	/*
+	 * New node must be next of the split node. Continuation of
+	 * hash has same key with next node, so don't use dx_add().
+	 */
+	limit = pnode->entries + dx_count(pnode);
+	for (p = pnode->entries; p < limit; p++) {
+		if (be32_to_cpu(p->block) == block)
+			break;
+	}
+	if (p == limit) {
+		blockput(parentbuf);
+		blockput(buffer);
+		dx_corrupt_error(dir, parent);
+		return -EIO;
+	}
+
+	newnode = dx_new_node(dir, node->level, &newbuf);
+	if (IS_ERR(newnode)) {
+		blockput(parentbuf);
+		blockput(buffer);
+		return PTR_ERR(newnode);
+	}
+	memcpy(newnode->entries, node->entries + mid,
+	       (count - mid) * sizeof(*node->entries));
+	newnode->count = cpu_to_be16(count - mid);
+	node->count = cpu_to_be16(mid);
+	dx_add_at(pnode, p + 1, key, bufindex(newbuf));
+
+	mark_buffer_dirty_non(parentbuf);
+	blockput(parentbuf);
+	mark_buffer_dirty_non(newbuf);
+	blockput(newbuf);
+	mark_buffer_dirty_non(buffer);
+	blockput(buffer);
+
+	return 0;
+}
+
+/* Add index of hash => dirent block */
+static int dx_insert(struct inode *dir, u32 hash, block_t child)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(dir->i_sb);
+	block_t root = tux_inode(dir)->dx_root;
+	block_t block = root, parent = root;
+	struct buffer_head *buffer;
+	struct dx_node *node;
+	unsigned level = DX_MAX_LEVELS;
+	int err;
+
+	while (1) {
+		node = dx_read(dir, block, &buffer);
+		if (IS_ERR(node))
+			return PTR_ERR(node);
+		if (node->level >= level) {
+			blockput(buffer);
+			dx_corrupt_error(dir, block);
+			return -EIO;
+		}
+
+		if (dx_count(node) == dx_limit(sb)) {
+			blockput(buffer);
+			if (block == root)
+				err = dx_grow_root(dir);
+			else
+				err = dx_split(dir, parent, block);
+			if (err)
+				return err;
+			/* Retry from root */
+			block = parent = root;
+			level = DX_MAX_LEVELS;
+			continue;
+		}
+		level = node->level;
+		if (!level)
+			break;
+
+		parent = block;
+		block = be32_to_cpu((dx_upper_bound(node, hash) - 1)->block);
+		blockput(buffer);
+	}
+	blockput(buffer);
+
+	node = dx_read_dirty(dir, block, &buffer);
+	if (IS_ERR(node))
+		return PTR_ERR(node);
+	dx_add(node, hash, child);
+	mark_buffer_dirty_non(buffer);
+	blockput(buffer);
+
+	return 0;
+}
+
+/* Turn empty index block back to empty dirent block */
+static void dx_free_node(struct inode *dir, struct buffer_head *buffer)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(dir->i_sb);
+	tux_dirent *entry = bufdata(buffer);
+
+	memset(entry, 0, sb->blocksize);
+	entry->rec_len = tux_rec_len_to_disk(sb->blocksize);
+	dir_space_update(dir, buffer);
+}
+
+/*
+ * Remove index of hash => dirent block. If node became empty, remove
+ * it from parent too, and reuse the block as dirent block. Root is
+ * never freed, empty root becomes empty leaf.
+ */
+static int dx_remove(struct inode *dir, u32 hash, block_t child)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	block_t root = tux_inode(dir)->dx_root, block;
+	struct dx_frame frames[DX_MAX_LEVELS];
+	struct buffer_head *buffer;
+	struct dx_node *node;
+	struct dx_entry *p, *limit;
+	int depth, err;
+
+	depth = dx_walk(dir, hash, frames);
+	if (depth < 0)
+		return depth;
+
+	/* Find hash => child on leaf, hash may continue to next leaves */
+	while (1) {
+		node = dx_read_leaf(dir, frames, depth, &buffer);
+		if (IS_ERR(node))
+			return PTR_ERR(node);
+
+		limit = node->entries + dx_count(node);
+		for (p = dx_lower_bound(node, hash); p < limit; p++) {
+			if (be32_to_cpu(p->hash) != hash)
+				break;
+			if (be32_to_cpu(p->block) == child)
+				goto found;
+		}
+		blockput(buffer);
+
+		err = 0;
+		if (p == limit)
+			err = dx_next_leaf(dir, hash, frames, depth);
+		if (err < 0)
+			return err;
+		if (!err) {
+			dx_corrupt_error(dir, frames[depth - 1].block);
+			return -EIO;
+		}
+	}
+found:
+	frames[depth - 1].at = p - node->entries;
+	blockput(buffer);
+
+	while (depth--) {
+		block = frames[depth].block;
+		node = dx_read_dirty(dir, block, &buffer);
+		if (IS_ERR(node))
+			return PTR_ERR(node);
+
+		/* Entry on path must point child */
+		p = node->entries + frames[depth].at;
+		if (frames[depth].at >= dx_count(node) ||
+		    be32_to_cpu(p->block) != child) {
+			blockput(buffer);
+			dx_corrupt_error(dir, block);
+			return -EIO;
+		}
+
+		dx_del(node, p);
+		if (dx_count(node) || block == root) {
+			if (!dx_count(node))
+				node->level = 0;
+			mark_buffer_dirty_non(buffer);
+			blockput(buffer);
+			break;
+		}
+
+		/* Node is empty, remove from parent */
+		dx_free_node(dir, buffer);
+		mark_buffer_dirty_non(buffer);
+		blockput(buffer);
+		child = block;
+	}
+
+	return 0;
+}
+
+static int dx_want_index(struct inode *dir)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(dir->i_sb);
+
+	if (!(sb->super.flags & cpu_to_be64(TUX3_FLAG_DIRINDEX)))
+		return 0;
+	return dir->i_size >= (loff_t)DX_MIN_BLOCKS << sb->blockbits;
+}
+
+/*
+ * Make index for linear directory. Caller must call tux3_iattrdirty()
+ * before this, to save DIR_INDEX_ATTR.
+ */
+static int dx_convert(struct inode *dir)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(dir->i_sb);
+	struct tux3_inode *tuxnode = tux_inode(dir);
+	block_t block, blocks = dir->i_size >> sb->blockbits;
+	struct buffer_head *buffer;
+	struct dx_node *root;
+	int err = 0;
+
+	root = dx_new_node(dir, 0, &buffer);
+	if (IS_ERR(root))
+		return PTR_ERR(root);
+	tuxnode->dx_root = bufindex(buffer);
+	mark_buffer_dirty_non(buffer);
+	blockput(buffer);
+
+	for (block = 0; block < blocks; block++) {
+		buffer = blockread(mapping(dir), block);
+		if (!buffer) {
+			err = -EIO;
+			goto error;
+		}
+
+		tux_dirent *entry = bufdata(buffer);
+		tux_dirent *limit = bufdata(buffer) + sb->blocksize - TUX_REC_LEN(1);
+		for (; entry <= limit; entry = next_entry(entry)) {
+			if (!entry->rec_len) {
+				blockput(buffer);
+				tux_zero_len_error(dir, block);
+				err = -EIO;
+				goto error;
+			}
+			if (is_deleted(entry))
+				continue;
+			err = dx_insert(dir, dx_hash(entry->name, entry->name_len),
+					block);
+			if (err) {
+				blockput(buffer);
+				goto error;
+			}
+		}
+		blockput(buffer);
+	}
+	tuxnode->present |= DIR_INDEX_BIT;
+
+	return 0;
+
+error:
+	/*
+	 * Stay as linear directory. All blocks after the dirent blocks
+	 * are index blocks, turn those into free dirent blocks.
+	 */
+	tuxnode->dx_root = 0;
+	for (block = blocks; block < dir->i_size >> sb->blockbits; block++) {
+		root = dx_read_dirty(dir, block, &buffer);
+		if (IS_ERR(root))
+			continue;	/* FIXME: leaves unusable block */
+		dx_free_node(dir, buffer);
+		mark_buffer_dirty_non(buffer);
+		blockput(buffer);
+	}
+	return err;
+}
+
+static loff_t dx_create_entry(struct inode *dir, const char *name,
+			      unsigned len, inum_t inum, umode_t mode)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(dir->i_sb);
+	unsigned reclen = TUX_REC_LEN(len), rec_len = 0;
+	unsigned uninitialized_var(name_len);
+	struct buffer_head *buffer;
+	tux_dirent *entry;
+	block_t block;
+	loff_t where;
+	int err;
+
+	buffer = tux_get_space(dir, dir->i_size, reclen, &entry, &name_len,
+			       &rec_len);
+	if (IS_ERR(buffer))
+		return PTR_ERR(buffer);
+	block = bufindex(buffer);
+
+	where = tux_add_entry(dir, buffer, entry, name_len, rec_len, name, len,
+			      inum, mode, &dir->i_size);
+	if (where < 0)
+		return where;
+
+	err = dx_insert(dir, dx_hash(name, len), block);
+	if (err) {
+		/* Couldn't index, remove the dirent again */
+		buffer = blockread(mapping(dir), block);
+		if (buffer) {
+			entry = bufdata(buffer) + (where & sb->blockmask);
+			tux_delete_entry(dir, buffer, entry);
+		}
+		return err;
+	}
+
+	return where;
+}
+
+#ifdef TUX3_SELFTEST
+/* Selftest of index node operations */
+int dx_selftest(void)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	static const u32 hashes[] = { 300, 100, 200, 200, 0, 200, 400, };
+	struct sb *sb;
+	struct dx_node *node;
+	struct dx_entry *p;
+	void *data = NULL;
+	unsigned i;
+	int err = -ENOMEM;
+
+	sb = kzalloc(sizeof(*sb), GFP_KERNEL);
+	if (!sb)
+		goto out;
+	sb->blocksize = 4096;
+	data = kzalloc(sb->blocksize, GFP_KERNEL);
+	if (!data)
+		goto out;
+
+	err = -EINVAL;
+	((tux_dirent *)data)->rec_len = tux_rec_len_to_disk(sb->blocksize);
+	node = dx_node(data);
+	node->magic = cpu_to_be16(TUX3_MAGIC_DXNODE);
+	if (!dx_is_node(sb, data))
+		goto out;
+
+	/* Leaf is sorted by hash, and keeps order of same hash */
+	for (i = 0; i < ARRAY_SIZE(hashes); i++)
+		dx_add(node, hashes[i], i);
+	if (dx_count(node) != ARRAY_SIZE(hashes))
+		goto out;
+	for (i = 1; i < dx_count(node); i++) {
+		if (be32_to_cpu(node->entries[i - 1].hash) >
+		    be32_to_cpu(node->entries[i].hash))
+			goto out;
+	}
+	p = dx_lower_bound(node, 200);
+	if (p - node->entries != 2 || be32_to_cpu(p->block) != 2 ||
+	    dx_upper_bound(node, 200) - node->entries != 5)
+		goto out;
+
+	/* Delete middle of same hashes */
+	dx_del(node, p + 1);
+	p = dx_lower_bound(node, 200);
+	if (be32_to_cpu(p[0].block) != 2 || be32_to_cpu(p[1].block) != 5)
+		goto out;
+
+	/* Upper level keeps lowest hash, after first entry was deleted */
+	node->level = 1;
+	dx_del(node, node->entries);
+	if (dx_count(node) != ARRAY_SIZE(hashes) - 2 ||
+	    be32_to_cpu(node->entries[0].hash) != 0 ||
+	    be32_to_cpu(node->entries[0].block) != 1 ||
+	    be32_to_cpu((dx_upper_bound(node, 50) - 1)->block) != 1)
+		goto out;
+
+	err = 0;
+out:
+	printk(KERN_INFO "TUX3: dx selftest %s\n", err ? "failed" : "passed");
+	kfree(data);
+	kfree(sb);
+
+	return err;
+}
+#endif /* !TUX3_SELFTEST */
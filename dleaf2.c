@@ -131,6 +131,313 @@ static inline void put_extent_compressed_hack(struct diskextent2 *dex,
 	dex->verhi_logical  = cpu_to_be64(verhi << COMPRESS_BITS | logical);
 }
 
+/*
+ * Compact leaf (dleaf3)
+ *
+ * Extents in one leaf usually share high bits of logical and physical
+ * address. So, dleaf3 stores those as offset from per-leaf base, with
+ * just enough bytes for the widest offset in the leaf.
+ *
+ * Each extent is packed as compress:8, logical offset:lbytes*8,
+ * physical offset:pbytes*8. Physical offset is (physical - base + 1),
+ * and 0 is hole.
+ *
+ * Modification is done on unpacked (dleaf2) image with dleaf2 code,
+ * then the image is packed again. If packed image doesn't fit, caller
+ * has to retry with less extents (or split).
+ *
+ * FIXME: version is not stored, like dleaf2 which is ignoring version.
+ */
+struct dleaf3 {
+	__be16 magic;			/* dleaf3 magic */
+	__be16 count;			/* count of extents */
+	u8 lbytes;			/* bytes of logical offset */
+	u8 pbytes;			/* bytes of physical offset */
+	__be16 __unused;
+	__be64 base_logical;		/* logical of first extent */
+	__be64 base_physical;		/* lowest physical in leaf */
+	u8 table[];			/* packed extents */
+};
+
+static inline int is_dleaf3(void *leaf)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct dleaf3 *dleaf = leaf;
+	return dleaf->magic == cpu_to_be16(TUX3_MAGIC_DLEAF3);
+}
+
+static inline unsigned dleaf2_max_entries(struct sb *sb)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return (sb->blocksize - sizeof(struct dleaf2)) / sizeof(struct diskextent2);
+}
+
+/* This is also the capacity of unpacked image */
+static inline unsigned dleaf3_max_entries(struct sb *sb)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	/* Assume 8 bytes per extent, twice of dleaf2 */
+	return (sb->blocksize - sizeof(struct dleaf3)) / 8;
+}
+
+static inline unsigned dleaf_max_entries(struct sb *sb, void *leaf)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	if (is_dleaf3(leaf))
+		return dleaf3_max_entries(sb);
+	return dleaf2_max_entries(sb);
+}
+
+static inline unsigned dleaf3_extent_size(struct dleaf3 *dleaf)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return 1 + dleaf->lbytes + dleaf->pbytes;
+}
+
+/* Bytes to store val */
+static inline unsigned dleaf3_bytes(u64 val)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned bytes = 0;
+	while (val) {
+		bytes++;
+		val >>= 8;
+	}
+	return bytes;
+}
+
+static inline u64 dleaf3_get_val(u8 *p, unsigned bytes)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	u64 val = 0;
+	while (bytes--)
+		val = (val << 8) | *p++;
+	return val;
+}
+
+static inline void dleaf3_put_val(u8 *p, unsigned bytes, u64 val)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	while (bytes--) {
+		p[bytes] = val;
+		val >>= 8;
+	}
+}
+
+static inline block_t dleaf3_get_logical(struct dleaf3 *dleaf, unsigned i)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	u8 *p = dleaf->table + i * dleaf3_extent_size(dleaf) + 1;
+	return be64_to_cpu(dleaf->base_logical) + dleaf3_get_val(p, dleaf->lbytes);
+}
+
+static void dleaf3_get_extent(struct dleaf3 *dleaf, unsigned i,
+			      struct extent *ex)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	u8 *p = dleaf->table + i * dleaf3_extent_size(dleaf);
+	u64 val;
+
+	ex->compress_count = *p++;
+	ex->version = 0;
+	ex->logical = be64_to_cpu(dleaf->base_logical) +
+		dleaf3_get_val(p, dleaf->lbytes);
+	p += dleaf->lbytes;
+	val = dleaf3_get_val(p, dleaf->pbytes);
+	ex->physical = val ? be64_to_cpu(dleaf->base_physical) + val - 1 : 0;
+}
+
+/* Get extent from dleaf2 or dleaf3 */
+static void dleaf_get_extent(void *leaf, unsigned i, struct extent *ex)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	if (is_dleaf3(leaf))
+		dleaf3_get_extent(leaf, i, ex);
+	else
+		get_extent(((struct dleaf2 *)leaf)->table + i, ex);
+}
+
+/*
+ * Calculate layout of dleaf3 to pack extents [start, start + count)
+ * of leaf. Return the size of packed dleaf3.
+ */
+static unsigned dleaf3_layout(void *leaf, unsigned start, unsigned count,
+			      struct dleaf3 *head)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	block_t lmin = 0, lmax = 0, pmin = MAX_BLOCKS, pmax = 0;
+	struct extent ex;
+	unsigned i;
+
+	for (i = start; i < start + count; i++) {
+		dleaf_get_extent(leaf, i, &ex);
+		/* extents are sorted by logical */
+		if (i == start)
+			lmin = ex.logical;
+		lmax = ex.logical;
+		if (ex.physical) {
+			pmin = min(pmin, ex.physical);
+			pmax = max(pmax, ex.physical);
+		}
+	}
+	if (!pmax)
+		pmin = 0;
+
+	*head = (struct dleaf3){
+		.magic		= cpu_to_be16(TUX3_MAGIC_DLEAF3),
+		.count		= cpu_to_be16(count),
+		.lbytes		= dleaf3_bytes(lmax - lmin),
+		.pbytes		= pmax ? dleaf3_bytes(pmax - pmin + 1) : 0,
+		.base_logical	= cpu_to_be64(lmin),
+		.base_physical	= cpu_to_be64(pmin),
+	};
+
+	return sizeof(*head) + count * dleaf3_extent_size(head);
+}
+
+/* Pack extents [start, start + count) of leaf by layout of head */
+static void dleaf3_pack(void *leaf, unsigned start, unsigned count,
+			struct dleaf3 *head, struct dleaf3 *dleaf)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	block_t base_logical = be64_to_cpu(head->base_logical);
+	block_t base_physical = be64_to_cpu(head->base_physical);
+	struct extent ex;
+	unsigned i;
+	u8 *p;
+
+	assert(leaf != dleaf);
+	p = dleaf->table;
+	for (i = 0; i < count; i++) {
+		dleaf_get_extent(leaf, start + i, &ex);
+
+		p[0] = ex.compress_count;
+		dleaf3_put_val(p + 1, head->lbytes, ex.logical - base_logical);
+		dleaf3_put_val(p + 1 + head->lbytes, head->pbytes,
+			       ex.physical ? ex.physical - base_physical + 1 : 0);
+		p += dleaf3_extent_size(head);
+	}
+	*dleaf = *head;
+}
+
+/* Unpack dleaf2 or dleaf3 to dleaf2 image */
+static void dleaf_unpack(void *leaf, struct dleaf2 *image)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct dleaf2 *dleaf = leaf;
+	unsigned i, count = be16_to_cpu(dleaf->count);
+
+	if (!is_dleaf3(leaf)) {
+		memcpy(image, dleaf,
+		       sizeof(*dleaf) + sizeof(dleaf->table[0]) * count);
+		return;
+	}
+
+	*image = (struct dleaf2){
+		.magic = cpu_to_be16(TUX3_MAGIC_DLEAF2),
+		.count = dleaf->count,
+	};
+	for (i = 0; i < count; i++) {
+		struct diskextent2 *dex = image->table + i;
+		struct extent ex;
+
+		dleaf3_get_extent(leaf, i, &ex);
+		dex->verhi_logical =
+			cpu_to_be64((u64)ex.compress_count << COMPRESS_BITS |
+				    ex.logical);
+		dex->verlo_physical = cpu_to_be64(ex.physical);
+	}
+}
+
+/*
+ * Pack dleaf2 image to leaf by format of leaf.
+ * Return 0 if success, 1 if image doesn't fit to leaf.
+ */
+static int dleaf_pack(struct btree *btree, struct dleaf2 *image, void *leaf)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned count = be16_to_cpu(image->count);
+	struct dleaf3 head;
+
+	if (!is_dleaf3(leaf)) {
+		assert(count <= dleaf2_max_entries(btree->sb));
+		memcpy(leaf, image,
+		       sizeof(*image) + sizeof(image->table[0]) * count);
+		return 0;
+	}
+
+	if (dleaf3_layout(image, 0, count, &head) > btree->sb->blocksize)
+		return 1;
+	dleaf3_pack(image, 0, count, &head, leaf);
+	return 0;
+}
+
+static struct dleaf2 *dleaf_alloc_image(struct sb *sb, int nr)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	size_t size = sizeof(struct dleaf2) +
+		sizeof(struct diskextent2) * dleaf3_max_entries(sb);
+	return malloc(size * nr);
+}
+
+static inline struct dleaf2 *dleaf_next_image(struct sb *sb,
+					      struct dleaf2 *image)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return (void *)image->table + sizeof(image->table[0]) * dleaf3_max_entries(sb);
+}
+
 static void dleaf2_btree_init(struct btree *btree)
 {
 	if(DEBUG_MODE_K==1)
@@ -138,9 +445,12 @@ static void dleaf2_btree_init(struct btree *btree)
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	struct sb *sb = btree->sb;
-	unsigned datasize = sb->blocksize - sizeof(struct dleaf2);
-	btree->entries_per_leaf = datasize / sizeof(struct diskextent2);
-	
+
+	/* Format of new leaves. Both of dleaf2 and dleaf3 are readable */
+	if (sb->super.flags & cpu_to_be64(TUX3_FLAG_DLEAF3))
+		btree->entries_per_leaf = dleaf3_max_entries(sb);
+	else
+		btree->entries_per_leaf = dleaf2_max_entries(sb);
 }
 
 static int dleaf2_init(struct btree *btree, void *leaf)
@@ -150,6 +460,15 @@ static int dleaf2_init(struct btree *btree, void *leaf)
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	struct dleaf2 *dleaf = leaf;
+
+	if (btree->entries_per_leaf > dleaf2_max_entries(btree->sb)) {
+		*(struct dleaf3 *)leaf = (struct dleaf3){
+			.magic = cpu_to_be16(TUX3_MAGIC_DLEAF3),
+			.count = 0,
+		};
+		return 0;
+	}
+
 	*dleaf = (struct dleaf2){
 		.magic = cpu_to_be16(TUX3_MAGIC_DLEAF2),
 		.count = 0,
@@ -164,13 +483,13 @@ static int dleaf2_sniff(struct btree *btree, void *leaf)
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	struct dleaf2 *dleaf = leaf;
-	if (dleaf->magic != cpu_to_be16(TUX3_MAGIC_DLEAF2))
+	if (dleaf->magic != cpu_to_be16(TUX3_MAGIC_DLEAF2) && !is_dleaf3(leaf))
 		return 1;
 	if (!dleaf->count)
 		return 1;
 	/* Last should be sentinel */
 	struct extent ex;
-	get_extent(dleaf->table + be16_to_cpu(dleaf->count) - 1, &ex);
+	dleaf_get_extent(leaf, be16_to_cpu(dleaf->count) - 1, &ex);
 	if (ex.physical == 0)
 		return 1;
 	return 0;
@@ -231,14 +550,13 @@ dleaf2_lookup_index(struct btree *btree, struct dleaf2 *dleaf, tuxkey_t index)
 /*
  * Split diskextent2, and return split key.
  */
-static tuxkey_t dleaf2_split(struct btree *btree, tuxkey_t hint,
-			     void *vfrom, void *vinto)
+static tuxkey_t __dleaf2_split(struct btree *btree, tuxkey_t hint,
+			       struct dleaf2 *from, struct dleaf2 *into)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	struct dleaf2 *from = vfrom, *into = vinto;
 	struct diskextent2 *dex;
 	struct extent ex;
 	unsigned split_at, count = be16_to_cpu(from->count);
@@ -283,13 +601,13 @@ static tuxkey_t dleaf2_split(struct btree *btree, tuxkey_t hint,
  * 0 - couldn't merge
  * 1 - merged
  */
-static int dleaf2_merge(struct btree *btree, void *vinto, void *vfrom)
+static int __dleaf2_merge(struct btree *btree, struct dleaf2 *into,
+			  struct dleaf2 *from, unsigned capacity)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	struct dleaf2 *into = vinto, *from = vfrom;
 	struct extent into_ex, from_ex;
 	unsigned into_count, from_count;
 	int can_merge, from_size;
@@ -322,7 +640,7 @@ static int dleaf2_merge(struct btree *btree, void *vinto, void *vfrom)
 	if (into_ex.logical == from_ex.logical)
 		can_merge = 1;
 
-	if (into_count + from_count - can_merge > btree->entries_per_leaf)
+	if (into_count + from_count - can_merge > capacity)
 		return 0;
 
 	if (!from_ex.physical) {
@@ -349,14 +667,14 @@ static int dleaf2_merge(struct btree *btree, void *vinto, void *vfrom)
  *   1 - modified
  *   0 - not modified
  */
-static int dleaf2_chop(struct btree *btree, tuxkey_t start, u64 len, void *leaf)
+static int __dleaf2_chop(struct btree *btree, tuxkey_t start, u64 len,
+			 struct dleaf2 *dleaf)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	struct sb *sb = btree->sb;
-	struct dleaf2 *dleaf = leaf;
 	struct diskextent2 *dex, *dex_limit;
 	struct extent ex;
 	block_t block;
@@ -475,10 +793,10 @@ static tuxkey_t dleaf2_split_at_center(struct dleaf2 *dleaf)
 /*
  * Write extents.
  */
-static int dleaf2_write(struct btree *btree, tuxkey_t key_bottom,
-			tuxkey_t key_limit,
-			void *leaf, struct btree_key_range *key,
-			tuxkey_t *split_hint)
+static int __dleaf2_write(struct btree *btree, unsigned capacity,
+			  tuxkey_t key_bottom, tuxkey_t key_limit,
+			  struct dleaf2 *dleaf, struct btree_key_range *key,
+			  tuxkey_t *split_hint)
 {
 	if(DEBUG_MODE_K==1)
 	{
@@ -486,7 +804,6 @@ static int dleaf2_write(struct btree *btree, tuxkey_t key_bottom,
 	}
 	struct dleaf_req *rq = container_of(key, struct dleaf_req, key);
 	struct sb *sb = btree->sb;
-	struct dleaf2 *dleaf = leaf;
 	struct diskextent2 *dex_start, *dex_end, *dex_limit;
 	struct extent ex;
 	tuxkey_t limit;
@@ -554,7 +871,7 @@ recheck:
 	need_split = 0;
 	rest_segs = 0;
 	/* Check if we need leaf split */
-	if (need > btree->entries_per_leaf) {
+	if (need > capacity) {
 		need_split = 1;
 
 		/*
@@ -563,7 +880,7 @@ recheck:
 		 * will be overwritten by real segs after split)
 		 * to avoid re-calculate for temporary state.
 		 */
-		rest_segs = need - btree->entries_per_leaf;
+		rest_segs = need - capacity;
 		/* Can we write 1 seg at least? */
 		if (rest_segs >= write_segs) {
 			/* FIXME: use better split position */
@@ -638,17 +955,37 @@ recheck:
 	return need_split;
 }
 
+/* Between sentinel and key_limit is hole */
+static void dleaf_fill_hole(struct dleaf_req *rq, struct btree_key_range *key,
+			    tuxkey_t key_limit)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	if (key->start < key_limit && key->len && rq->seg_idx < rq->seg_max) {
+		struct block_segment *seg = rq->seg + rq->seg_idx;
+
+		seg->count = min_t(tuxkey_t, key->len, key_limit - key->start);
+		seg->block = 0;
+		seg->state = BLOCK_SEG_HOLE;
+
+		key->start += seg->count;
+		key->len -= seg->count;
+		rq->seg_idx++;
+	}
+}
+
 /* Read extents */
-static int dleaf2_read(struct btree *btree, tuxkey_t key_bottom,
-		       tuxkey_t key_limit,
-		       void *leaf, struct btree_key_range *key)
+static int __dleaf2_read(struct btree *btree, tuxkey_t key_bottom,
+			 tuxkey_t key_limit,
+			 struct dleaf2 *dleaf, struct btree_key_range *key)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	struct dleaf_req *rq = container_of(key, struct dleaf_req, key);
-	struct dleaf2 *dleaf = leaf;
 	struct diskextent2 *dex, *dex_limit;
 	struct extent next;
 	block_t physical;
@@ -702,22 +1039,319 @@ static int dleaf2_read(struct btree *btree, tuxkey_t key_bottom,
 	} while (key->len && rq->seg_idx < rq->seg_max && dex < dex_limit);
 
 fill_seg:
-	/* Between sentinel and key_limit is hole */
-	if (key->start < key_limit && key->len && rq->seg_idx < rq->seg_max) {
+	dleaf_fill_hole(rq, key, key_limit);
+
+	return 0;
+}
+
+/* Lookup logical address in dleaf3 <= index, same with dleaf2_lookup_index() */
+static unsigned dleaf3_lookup_index(struct dleaf3 *dleaf, tuxkey_t index)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned count = be16_to_cpu(dleaf->count);
+	unsigned lo = 0, hi = count;
+
+	/* Find first extent of logical >= index */
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (dleaf3_get_logical(dleaf, mid) < index)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < count) {
+		if (dleaf3_get_logical(dleaf, lo) == index)
+			return lo;
+		/* should have extent of bottom logical on leaf */
+		assert(lo > 0);
+		return lo - 1;
+	}
+
+	/* Not found - last should be sentinel (hole) */
+	if (count) {
+		struct extent ex;
+		dleaf3_get_extent(dleaf, count - 1, &ex);
+		assert(ex.physical == 0);
+	}
+
+	return count;
+}
+
+/* Read extents from dleaf3, same with __dleaf2_read() */
+static int dleaf3_read(struct btree *btree, tuxkey_t key_bottom,
+		       tuxkey_t key_limit,
+		       struct dleaf3 *dleaf, struct btree_key_range *key)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct dleaf_req *rq = container_of(key, struct dleaf_req, key);
+	unsigned i, count = be16_to_cpu(dleaf->count);
+	struct extent next;
+	block_t physical;
+
+	if (rq->seg_idx >= rq->seg_max)
+		return 0;
+
+	/* Lookup the extent is including index */
+	i = dleaf3_lookup_index(dleaf, key->start);
+	if (i + 1 >= count) {
+		/* paranoia check */
+		if (i < count) {
+			dleaf3_get_extent(dleaf, count - 1, &next);
+			assert(next.physical == 0);
+		}
+		/* If sentinel, fill by bottom key */
+		goto fill_seg;
+	}
+
+	/* Get start position of logical and physical */
+	dleaf3_get_extent(dleaf, i, &next);
+	physical = next.physical;
+	if (physical)
+		physical += key->start - next.logical;	/* add offset */
+	i++;
+
+	do {
 		struct block_segment *seg = rq->seg + rq->seg_idx;
+		seg->compress_count = next.compress_count;
 
-		seg->count = min_t(tuxkey_t, key->len, key_limit - key->start);
-		seg->block = 0;
-		seg->state = BLOCK_SEG_HOLE;
+		dleaf3_get_extent(dleaf, i, &next);
+		/* Check of logical addr range of current and next. */
+		seg->count = min_t(u64, key->len, next.logical - key->start);
+		if (physical) {
+			seg->block = physical;
+			seg->state = 0;
+		} else {
+			seg->block = 0;
+			seg->state = BLOCK_SEG_HOLE;
+		}
 
+		physical = next.physical;
 		key->start += seg->count;
 		key->len -= seg->count;
 		rq->seg_idx++;
-	}
+		i++;
+	} while (key->len && rq->seg_idx < rq->seg_max && i < count);
+
+fill_seg:
+	dleaf_fill_hole(rq, key, key_limit);
 
 	return 0;
 }
 
+static int dleaf2_read(struct btree *btree, tuxkey_t key_bottom,
+		       tuxkey_t key_limit,
+		       void *leaf, struct btree_key_range *key)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	/* dleaf3 is read without unpack, this is called without lock */
+	if (is_dleaf3(leaf))
+		return dleaf3_read(btree, key_bottom, key_limit, leaf, key);
+	return __dleaf2_read(btree, key_bottom, key_limit, leaf, key);
+}
+
+static tuxkey_t dleaf2_split(struct btree *btree, tuxkey_t hint,
+			     void *vfrom, void *vinto)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct dleaf3 *from = vfrom, *into = vinto, head;
+	struct extent ex;
+	unsigned split_at, count;
+
+	if (!is_dleaf3(vfrom)) {
+		/* Keep format of "from", so the half always fits */
+		*(struct dleaf2 *)vinto = (struct dleaf2){
+			.magic = cpu_to_be16(TUX3_MAGIC_DLEAF2),
+			.count = 0,
+		};
+		return __dleaf2_split(btree, hint, vfrom, vinto);
+	}
+
+	/*
+	 * Split dleaf3 without unpack (we can't return error). Same
+	 * with __dleaf2_split(), tail extents go to "into" with new
+	 * layout, and "from" keeps layout, and gets sentinel.
+	 */
+	count = be16_to_cpu(from->count);
+	/* need 2 extents except sentinel, at least */
+	assert(count >= 3);
+
+	split_at = dleaf3_lookup_index(from, hint);
+	if (split_at == count) {
+		dleaf3_get_extent(from, count - 1, &ex);
+		assert(ex.physical == 0);
+		return ex.logical;	/* use sentinel of previous leaf */
+	}
+
+	dleaf3_layout(from, split_at, count - split_at, &head);
+	dleaf3_pack(from, split_at, count - split_at, &head, into);
+
+	/* Put sentinel. Physical offset 0 is hole in any layout */
+	dleaf3_get_extent(from, split_at, &ex);
+	dleaf3_put_val(from->table + split_at * dleaf3_extent_size(from) +
+		       1 + from->lbytes, from->pbytes, 0);
+	from->count = cpu_to_be16(split_at + 1);
+
+	return ex.logical;
+}
+
+/* Merge dleaf2 or dleaf3, "into" keeps format */
+static int dleaf2_merge(struct btree *btree, void *vinto, void *vfrom)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = btree->sb;
+	struct dleaf2 *into = vinto, *from = vfrom, *into_image, *from_image;
+	int ret;
+
+	if (!is_dleaf3(vinto) && !is_dleaf3(vfrom))
+		return __dleaf2_merge(btree, into, from,
+				      dleaf2_max_entries(sb));
+
+	/* If we can't allocate image, just don't merge */
+	into_image = dleaf_alloc_image(sb, 2);
+	if (!into_image)
+		return 0;
+	from_image = dleaf_next_image(sb, into_image);
+
+	dleaf_unpack(vinto, into_image);
+	dleaf_unpack(vfrom, from_image);
+	ret = __dleaf2_merge(btree, into_image, from_image,
+			     dleaf_max_entries(sb, vinto));
+	if (ret && !from_image->count) {
+		/* Merged. But if packed "into" doesn't fit, don't merge */
+		if (dleaf_pack(btree, into_image, vinto))
+			ret = 0;
+		else
+			from->count = 0;
+	}
+	free(into_image);
+
+	return ret;
+}
+
+/* Chop dleaf2 or dleaf3 */
+static int dleaf2_chop(struct btree *btree, tuxkey_t start, u64 len, void *leaf)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct dleaf2 *image;
+	int ret, err;
+
+	if (!is_dleaf3(leaf))
+		return __dleaf2_chop(btree, start, len, leaf);
+
+	image = dleaf_alloc_image(btree->sb, 1);
+	if (!image)
+		return -ENOMEM;
+
+	dleaf_unpack(leaf, image);
+	ret = __dleaf2_chop(btree, start, len, image);
+	if (ret > 0) {
+		/* Chop never widens offsets, so this always fits */
+		err = dleaf_pack(btree, image, leaf);
+		assert(!err);
+	}
+	free(image);
+
+	return ret;
+}
+
+/*
+ * Write extents to dleaf3 via image. If packed image doesn't fit,
+ * retry with capacity which fits the widths of the failed try.
+ */
+static int dleaf3_write(struct btree *btree, tuxkey_t key_bottom,
+			tuxkey_t key_limit,
+			struct dleaf3 *dleaf, struct btree_key_range *key,
+			tuxkey_t *split_hint)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct dleaf_req *rq = container_of(key, struct dleaf_req, key);
+	struct sb *sb = btree->sb;
+	unsigned capacity = dleaf3_max_entries(sb);
+	tuxkey_t start = key->start;
+	int seg_idx = rq->seg_idx;
+	struct dleaf2 *image;
+	int ret;
+
+	image = dleaf_alloc_image(sb, 1);
+	if (!image)
+		return -ENOMEM;
+
+	while (1) {
+		struct dleaf3 head;
+		unsigned size, count;
+
+		dleaf_unpack(dleaf, image);
+		ret = __dleaf2_write(btree, capacity, key_bottom, key_limit,
+				     image, key, split_hint);
+		if (ret < 0)
+			break;
+
+		count = be16_to_cpu(image->count);
+		size = dleaf3_layout(image, 0, count, &head);
+		if (size <= sb->blocksize) {
+			dleaf3_pack(image, 0, count, &head, dleaf);
+			break;
+		}
+
+		/*
+		 * Doesn't fit. Blocks were already assigned to segs,
+		 * and seg_alloc() doesn't allocate for those again. So,
+		 * just rewind the request, and retry with less extents.
+		 * Worst case size of extent always fits, so this ends.
+		 */
+		capacity = min(capacity - 1,
+			       (unsigned)((sb->blocksize - sizeof(head)) /
+					  dleaf3_extent_size(&head)));
+		key->start = start;
+		rq->seg_idx = seg_idx;
+		key->len = seg_total_count(rq->seg + rq->seg_idx,
+					   rq->seg_cnt - rq->seg_idx);
+	}
+	free(image);
+
+	return ret;
+}
+
+/* Write extents to dleaf2 or dleaf3 */
+static int dleaf2_write(struct btree *btree, tuxkey_t key_bottom,
+			tuxkey_t key_limit,
+			void *leaf, struct btree_key_range *key,
+			tuxkey_t *split_hint)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	if (is_dleaf3(leaf))
+		return dleaf3_write(btree, key_bottom, key_limit, leaf, key,
+				    split_hint);
+	return __dleaf2_write(btree, dleaf2_max_entries(btree->sb),
+			      key_bottom, key_limit, leaf, key, split_hint);
+}
+
+
 struct btree_ops dtree2_ops = {
 	.btree_init	= dleaf2_btree_init,
 	.leaf_init	= dleaf2_init,
@@ -733,3 +1367,157 @@ struct btree_ops dtree2_ops = {
 	.leaf_can_free	= dleaf2_can_free,
 	.leaf_dump	= dleaf2_dump,
 };
+
+#ifdef TUX3_SELFTEST
+/*
+ * Selftest of dleaf3. Write extents to leaf until it needs split, then
+ * split and chop, and check extents after each step.
+ *
+ * Extent i has logical i, and even i is data, odd i is hole.
+ */
+static block_t dleaf3_test_physical(unsigned i)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return i & 1 ? 0 : 0x12340000 + i * 3;
+}
+
+/* Blocks were assigned to seg by caller already */
+static int dleaf3_test_seg_alloc(struct btree *btree, struct dleaf_req *rq,
+				 int new_extents)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return 0;
+}
+
+/* Check leaf has extents [start, start + count), last is sentinel */
+static int dleaf3_test_check(void *leaf, unsigned start, unsigned count)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct extent ex;
+	unsigned i;
+
+	if (!is_dleaf3(leaf) ||
+	    be16_to_cpu(((struct dleaf3 *)leaf)->count) != count)
+		return -EINVAL;
+	for (i = 0; i < count; i++) {
+		block_t physical = dleaf3_test_physical(start + i);
+
+		if (i == count - 1)
+			physical = 0;
+		dleaf_get_extent(leaf, i, &ex);
+		if (ex.logical != start + i || ex.physical != physical)
+			return -EINVAL;
+	}
+	return 0;
+}
+
+int dleaf3_selftest(void)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb;
+	struct btree btree;
+	void *leaf = NULL, *into = NULL, *logbuf = NULL;
+	tuxkey_t hint;
+	unsigned i, count, split_at, chop_at;
+	int err = -ENOMEM, ret;
+
+	sb = kzalloc(sizeof(*sb), GFP_KERNEL);
+	if (!sb)
+		return err;
+	sb->blockbits = 12;
+	sb->blocksize = 1 << sb->blockbits;
+	sb->super.flags = cpu_to_be64(TUX3_FLAG_DLEAF3);
+	stash_init(&sb->defree);
+
+	leaf = kzalloc(sb->blocksize, GFP_KERNEL);
+	into = kzalloc(sb->blocksize, GFP_KERNEL);
+	logbuf = kzalloc(sb->blocksize, GFP_KERNEL);
+	if (!leaf || !into || !logbuf)
+		goto out;
+	/* Chop logs bfree, give log buffer which is big enough */
+	sb->logpos = logbuf;
+	sb->logtop = logbuf + sb->blocksize;
+
+	btree = (struct btree){ .sb = sb, .ops = &dtree2_ops, };
+	dleaf2_btree_init(&btree);
+	dleaf2_init(&btree, leaf);
+
+	tux3_start_backend(sb);
+
+	/* Write until leaf needs split */
+	err = -EINVAL;
+	for (i = 0; ; i += 2) {
+		struct block_segment seg = {
+			.block	= dleaf3_test_physical(i),
+			.count	= 1,
+		};
+		struct dleaf_req rq = {
+			.key = {
+				.start	= i,
+				.len	= 1,
+			},
+			.seg_cnt	= 1,
+			.seg_max	= 1,
+			.seg		= &seg,
+			.seg_alloc	= dleaf3_test_seg_alloc,
+		};
+
+		ret = dleaf2_write(&btree, 0, TUXKEY_LIMIT, leaf, &rq.key,
+				   &hint);
+		if (ret < 0) {
+			err = ret;
+			goto out_backend;
+		}
+		if (ret)
+			break;
+		if (dleaf3_test_check(leaf, 0, i + 2))
+			goto out_backend;
+	}
+	count = i;
+	/* dleaf3 should keep more extents than dleaf2 */
+	if (count <= dleaf2_max_entries(sb) ||
+	    dleaf3_test_check(leaf, 0, count))
+		goto out_backend;
+
+	/* Split at data extent of center */
+	split_at = (count / 2) & ~1;
+	hint = dleaf2_split(&btree, split_at, leaf, into);
+	if (hint != split_at ||
+	    dleaf3_test_check(leaf, 0, split_at + 1) ||
+	    dleaf3_test_check(into, split_at, count - split_at))
+		goto out_backend;
+
+	/* Chop at hole, then data extents after it are freed */
+	chop_at = (split_at / 2) | 1;
+	ret = dleaf2_chop(&btree, chop_at, TUXKEY_LIMIT, leaf);
+	if (ret != 1 ||
+	    dleaf3_test_check(leaf, 0, chop_at + 1) ||
+	    sb->defree.count != (split_at - chop_at - 1) / 2)
+		goto out_backend;
+
+	err = 0;
+out_backend:
+	tux3_end_backend();
+	destroy_defer_bfree(&sb->defree);
+out:
+	printk(KERN_INFO "TUX3: dleaf3 selftest %s\n", err ? "failed" : "passed");
+	kfree(logbuf);
+	kfree(into);
+	kfree(leaf);
+	kfree(sb);
+
+	return err;
+}
+#endif /* !TUX3_SELFTEST */
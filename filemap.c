@@ -20,6 +20,9 @@
  *
  * down_write(inode: btree->lock) (btree_chop, map_region for write)
  * down_read(inode: btree->lock) (map_region for read)
+ *     map_region for read tries without lock first, and validates the
+ *     result by btree->seq which writers bump on root change, split,
+ *     and redirect.
  *
  * inode->i_mutex
  *     mapping->private_lock (front uses to protect dirty buffer list)
@@ -129,7 +132,7 @@ static int map_region1(struct inode *inode, block_t start, unsigned count,
 		else {
 			/* If write, must be backend */
 			assert(tux3_under_backend(sb));
-			down_write(&btree->lock);
+			down_write_btree(btree);
 		}
 	} else {
 		/* If bitmap, must be backend */
@@ -358,7 +361,7 @@ out_unlock:
 		if (mode == MAP_READ)
 			up_read(&btree->lock);
 		else
-			up_write(&btree->lock);
+			up_write_btree(btree);
 	}
 	if (cursor)
 		free_cursor(cursor);
@@ -478,6 +481,47 @@ static int (*seg_alloc_funs[])(struct btree *, struct dleaf_req *, int) = {
 	[MAP_REDIRECT]	= redirect_seg_alloc,
 };
 
+/*
+ * Try map_region2() for read without btree->lock.
+ *
+ * return value:
+ * < 0 - error
+ *   0 - raced with writer, caller should retry with btree->lock
+ * 0 < - number of physical extents which were mapped
+ */
+static int map_region2_lockless(struct inode *inode, block_t start,
+				unsigned count, struct block_segment seg[],
+				unsigned seg_max)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct btree *btree = &tux_inode(inode)->btree;
+	struct dleaf_req rq = {
+		.key = {
+			.start	= start,
+			.len	= count,
+		},
+		.seg_max	= seg_max,
+		.seg		= seg,
+	};
+	struct cursor_stack stack;
+	struct cursor *cursor;
+	int err;
+
+	cursor = alloc_cursor_stack(btree, 1, &stack);
+	if (!cursor)
+		return -ENOMEM;
+
+	err = btree_read_lockless(cursor, &rq.key);
+	free_cursor(cursor);
+	if (err)
+		return err < 0 ? err : 0;
+
+	return rq.seg_idx;
+}
+
 /* map_region() by using dleaf2 */
 static int map_region2(struct inode *inode, block_t start, unsigned count,
 		       struct block_segment seg[], unsigned seg_max,
@@ -488,6 +532,7 @@ static int map_region2(struct inode *inode, block_t start, unsigned count,
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	struct btree *btree = &tux_inode(inode)->btree;
+	struct cursor_stack stack;
 	struct cursor *cursor = NULL;
 	int err, segs = 0;
 
@@ -507,10 +552,15 @@ static int map_region2(struct inode *inode, block_t start, unsigned count,
 	 * So, no need to lock.
 	 */
 	if (tux_inode(inode)->inum != TUX_BITMAP_INO) {
-		if (mode == MAP_READ)
+		if (mode == MAP_READ) {
+			/* Readers don't have to wait flush usually */
+			segs = map_region2_lockless(inode, start, count, seg,
+						    seg_max);
+			if (segs)
+				return segs;
 			down_read(&btree->lock);
-		else
-			down_write(&btree->lock);
+		} else
+			down_write_btree(btree);
 	}
 
 	if (!has_root(btree) && mode != MAP_READ) {
@@ -535,7 +585,8 @@ static int map_region2(struct inode *inode, block_t start, unsigned count,
 			.seg		= seg,
 		};
 
-		cursor = alloc_cursor(btree, 1); /* allows for depth increase */
+		/* allows for depth increase */
+		cursor = alloc_cursor_stack(btree, 1, &stack);
 		if (!cursor) {
 			segs = -ENOMEM;
 			goto out_unlock;
@@ -613,7 +664,7 @@ out_unlock:
 		if (mode == MAP_READ)
 			up_read(&btree->lock);
 		else
-			up_write(&btree->lock);
+			up_write_btree(btree);
 	}
 	if (cursor)
 		free_cursor(cursor);
@@ -1012,6 +1063,41 @@ error:
 	return NULL;
 }
 
+/*
+ * Readahead for blockread() user which walks blocks sequentially with
+ * file (e.g. readdir). If iblock is not cached yet, or we reached the
+ * readahead mark, start async read of following blocks below limit.
+ * ->readpages maps those blocks with one dtree lookup per extent.
+ */
+void blockread_ahead(struct file *file, struct address_space *mapping,
+		     block_t iblock, block_t limit)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct inode *inode = mapping->host;
+	unsigned shift = PAGE_CACHE_SHIFT - inode->i_blkbits;
+	pgoff_t index = iblock >> shift;
+	pgoff_t end = (limit + (1 << shift) - 1) >> shift;
+	struct page *page;
+
+	if (index >= end)
+		return;
+
+	page = find_get_page(mapping, index);
+	if (!page) {
+		page_cache_sync_readahead(mapping, &file->f_ra, file, index,
+					  end - index);
+		return;
+	}
+	if (PageReadahead(page)) {
+		page_cache_async_readahead(mapping, &file->f_ra, file, page,
+					   index, end - index);
+	}
+	page_cache_release(page);
+}
+
 struct buffer_head *blockget(struct address_space *mapping, block_t iblock)
 {
 	if(DEBUG_MODE_K==1)
@@ -1085,6 +1171,58 @@ struct buffer_head *blockget(struct address_space *mapping, block_t iblock)
 	return bh;
 }
 
+/*
+ * Inline data
+ *
+ * Small regular file keeps data in inode attributes instead of dtree
+ * (see tux3_flush_inline()). So page 0 of those is filled from the
+ * inline copy, instead of reading block.
+ *
+ * Return 1 if page was filled. Caller must hold lock_page().
+ */
+static int tux3_inline_readpage(struct inode *inode, struct page *page)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct tux3_inode *tuxnode = tux_inode(inode);
+	unsigned size = 0;
+	int filled = 0;
+	void *kaddr;
+
+	if (page->index || !tuxnode->inline_data)
+		return 0;
+
+	kaddr = kmap_atomic(page);
+	spin_lock(&tuxnode->lock);
+	if (tuxnode->inline_data) {
+		size = min_t(loff_t, tuxnode->inline_size, i_size_read(inode));
+		memcpy(kaddr, tuxnode->inline_data, size);
+		filled = 1;
+	}
+	spin_unlock(&tuxnode->lock);
+	if (filled)
+		memset(kaddr + size, 0, PAGE_CACHE_SIZE - size);
+	kunmap_atomic(kaddr);
+
+	if (!filled)
+		return 0;
+
+	flush_dcache_page(page);
+	if (page_has_buffers(page)) {
+		struct buffer_head *bh, *head;
+		bh = head = page_buffers(page);
+		do {
+			set_buffer_uptodate(bh);
+			bh = bh->b_this_page;
+		} while (bh != head);
+	}
+	SetPageUptodate(page);
+
+	return 1;
+}
+
 static int tux3_readpage(struct file *file, struct page *page)
 {
 	if(DEBUG_MODE_K==1)
@@ -1092,6 +1230,10 @@ static int tux3_readpage(struct file *file, struct page *page)
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	printk(KERN_INFO "\n\n***IN READPAGE***");
+	if (tux3_inline_readpage(page->mapping->host, page)) {
+		unlock_page(page);
+		return 0;
+	}
 	int err = mpage_readpage(page, tux3_get_block);
 	assert(!PageForked(page));	/* FIXME: handle forked page */
 	return err;
@@ -1104,6 +1246,10 @@ static int tux3_readpages(struct file *file, struct address_space *mapping,
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
+	/* Leave inline data to ->readpage() */
+	if (tux_inode(mapping->host)->inline_data)
+		return 0;
+
 	if(ENABLE_TRANSPARENT_COMPRESSION && S_ISREG(mapping->host->i_mode))
 		return mpage_readpages_compressed(mapping, pages, nr_pages, tux3_get_block);
 	
@@ -1132,6 +1278,40 @@ static void tux3_write_failed(struct address_space *mapping, loff_t to)
 	}
 }
 
+/*
+ * File is growing beyond inline data size. Rewrite inline data to
+ * page as usual dirty block 0, so delta flush writes it into dtree
+ * instead of inline.
+ */
+int tux3_inline_convert(struct inode *inode, loff_t newsize)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	loff_t max = tux3_inline_max(tux_sb(inode->i_sb));
+	loff_t size = inode->i_size;
+	struct page *page;
+	unsigned len;
+	int err;
+
+	/* Only if inline data is there, and doesn't fit anymore */
+	if (!S_ISREG(inode->i_mode) || !size || size > max || newsize <= max)
+		return 0;
+	/* size <= max, so this fits */
+	len = size;
+
+	err = tux3_write_begin(inode->i_mapping, 0, len,
+			       AOP_FLAG_UNINTERRUPTIBLE, &page,
+			       tux3_da_get_block, 1);
+	if (err)
+		return err;
+	/* Data is in page already, just commit as dirty */
+	tux3_write_end(NULL, inode->i_mapping, 0, len, len, page, NULL);
+
+	return 0;
+}
+
 /* Use delalloc and check buffer fork. */
 static int __tux3_file_write_begin(struct file *file,
 				   struct address_space *mapping,
@@ -1145,6 +1325,10 @@ static int __tux3_file_write_begin(struct file *file,
 	}
 	int ret;
 
+	ret = tux3_inline_convert(mapping->host, pos + len);
+	if (ret)
+		return ret;
+
 	ret = tux3_write_begin(mapping, pos, len, flags, pagep,
 			       tux3_da_get_block, check_fork);
 	if (ret < 0)
@@ -1376,6 +1560,16 @@ static int tux3_blk_readpage(struct file *file, struct page *page)
 	return err;
 }
 
+static int tux3_blk_readpages(struct file *file, struct address_space *mapping,
+			      struct list_head *pages, unsigned nr_pages)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return mpage_readpages(mapping, pages, nr_pages, tux3_get_block);
+}
+
 /* Use delalloc and doesn't check buffer fork */
 static int tux3_blk_write_begin(struct file *file,
 				struct address_space *mapping,
@@ -1403,6 +1597,7 @@ static int tux3_blk_writepage(struct page *page, struct writeback_control *wbc)
 
 const struct address_space_operations tux_blk_aops = {
 	.readpage	= tux3_blk_readpage,
+	.readpages	= tux3_blk_readpages,
 //	.writepage	= tux3_blk_writepage,
 //	.writepages	= tux3_writepages,
 	.writepage	= tux3_disable_writepage,
@@ -205,6 +205,10 @@ retry:
 		page = tmp;
 	}
 
+	/* Fill inline data before partial write */
+	if (!PageUptodate(page))
+		tux3_inline_readpage(mapping->host, page);
+
 	status = __tux3_write_begin(page, pos, len, get_block);
 	if (unlikely(status)) {
 		unlock_page(page);
@@ -18,6 +18,7 @@
  *
  *    immediate data: kind+version:16, bytes:16, data[bytes]
  *    immediate xattr: kind+version:16, bytes:16, atom:16, data[bytes - 2]
+ *    external xattr: kind+version:16, bytes:16, atom:16, size:16, slot:32
  */
 
 unsigned atsize[MAX_ATTRS] = {
@@ -28,9 +29,11 @@ unsigned atsize[MAX_ATTRS] = {
 	[DATA_BTREE_ATTR] = 8,
 	[LINK_COUNT_ATTR] = 4,
 	[MTIME_ATTR] = 8,
+	[DIR_INDEX_ATTR] = 4,
 	/* Variable size (extended) attrs */
 	[IDATA_ATTR] = 2,
 	[XATTR_ATTR] = 4,
+	[XATTR_EXT_ATTR] = 4,
 };
 
 /*
@@ -150,7 +153,11 @@ void dump_attrs(struct inode *inode)
 		case MTIME_ATTR:
 			__tux3_dbg("mtime %Lx ", tuxtime(inode->i_mtime));
 			break;
+		case DIR_INDEX_ATTR:
+			__tux3_dbg("dxroot %x ", tuxnode->dx_root);
+			break;
 		case XATTR_ATTR:
+		case XATTR_EXT_ATTR:
 			__tux3_dbg("xattr(s) ");
 			break;
 		default:
@@ -160,6 +167,8 @@ void dump_attrs(struct inode *inode)
 	}
 	if (has_root(&tuxnode->btree))
 		__tux3_dbg("root %Lx:%u ", tuxnode->btree.root.block, tuxnode->btree.root.depth);
+	if (tuxnode->inline_data)
+		__tux3_dbg("inline %u ", tuxnode->inline_size);
 	__tux3_dbg("\n");
 }
 
@@ -214,6 +223,10 @@ static void *encode_attrs(struct btree *btree, void *data, void *attrs,
 		case MTIME_ATTR:
 			attrs = encode64(attrs, tuxtime(idata->i_mtime) >> TIME_ATTR_SHIFT);
 			break;
+		case DIR_INDEX_ATTR:
+			/* Never changed after set, so inode has stable value */
+			attrs = encode32(attrs, tux_inode(iattr_data->inode)->dx_root);
+			break;
 		}
 	}
 	return attrs;
@@ -288,9 +301,24 @@ static void *decode_attrs(struct inode *inode, void *attrs, unsigned size)
 			attrs = decode64(attrs, &v64);
 			inode->i_mtime = spectime(v64 << TIME_ATTR_SHIFT);
 			break;
+		case DIR_INDEX_ATTR:
+			attrs = decode32(attrs, &tuxnode->dx_root);
+			break;
+		case IDATA_ATTR: {
+			/* inline_data was allocated by decode_isize() size */
+			unsigned bytes;
+			attrs = decode16(attrs, &bytes);
+			memcpy(tuxnode->inline_data, attrs, bytes);
+			tuxnode->inline_size = bytes;
+			attrs += bytes;
+			goto skip_present;
+		}
 		case XATTR_ATTR:
 			attrs = decode_xattr(inode, attrs);
 			break;
+		case XATTR_EXT_ATTR:
+			attrs = decode_xattr_ext(inode, attrs);
+			break;
 		default:
 			return NULL;
 		}
@@ -306,6 +334,83 @@ static void *decode_attrs(struct inode *inode, void *attrs, unsigned size)
 	return attrs;
 }
 
+/*
+ * Inline data is owned by backend (see tux3_flush_inline()). If
+ * i_size was truncated, encode only until i_size.
+ */
+static unsigned inline_bytes(struct inode *inode,
+			     struct tux3_iattr_data *idata)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct tux3_inode *tuxnode = tux_inode(inode);
+
+	if (!tuxnode->inline_data)
+		return 0;
+	return min_t(loff_t, tuxnode->inline_size, idata->i_size);
+}
+
+static unsigned encode_isize(struct inode *inode,
+			     struct tux3_iattr_data *idata)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned bytes = inline_bytes(inode, idata);
+
+	return bytes ? 2 + 2 + bytes : 0;
+}
+
+static void *encode_inline(struct inode *inode, struct tux3_iattr_data *idata,
+			   void *attrs)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned bytes = inline_bytes(inode, idata);
+
+	if (!bytes)
+		return attrs;
+
+	// immediate data: kind+version:16, bytes:16, data[bytes]
+	attrs = encode_kind(attrs, IDATA_ATTR, tux_sb(inode->i_sb)->version);
+	attrs = encode16(attrs, bytes);
+	memcpy(attrs, tux_inode(inode)->inline_data, bytes);
+	return attrs + bytes;
+}
+
+static unsigned decode_isize(struct inode *inode, void *attrs, unsigned size)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(inode->i_sb);
+	unsigned total = 0, bytes;
+	void *limit = attrs + size;
+
+	while (attrs < limit - 1) {
+		unsigned kind, version;
+		attrs = decode_kind(attrs, &kind, &version);
+		switch (kind) {
+		case XATTR_ATTR:
+		case XATTR_EXT_ATTR:
+		case IDATA_ATTR:
+			attrs = decode16(attrs, &bytes);
+			attrs += bytes;
+			if (kind == IDATA_ATTR && version == sb->version)
+				total = bytes;
+			continue;
+		}
+		attrs += atsize[kind];
+	}
+	return total;
+}
+
 static int iattr_encoded_size(struct btree *btree, void *data)
 {
 	if(DEBUG_MODE_K==1)
@@ -315,7 +420,8 @@ static int iattr_encoded_size(struct btree *btree, void *data)
 	struct iattr_req_data *iattr_data = data;
 	struct inode *inode = iattr_data->inode;
 
-	return encode_asize(iattr_data->idata->present) + encode_xsize(inode);
+	return encode_asize(iattr_data->idata->present) +
+		encode_isize(inode, iattr_data->idata) + encode_xsize(inode);
 }
 
 static void iattr_encode(struct btree *btree, void *data, void *attrs, int size)
@@ -329,6 +435,7 @@ static void iattr_encode(struct btree *btree, void *data, void *attrs, int size)
 	void *attr;
 
 	attr = encode_attrs(btree, data, attrs, size);
+	attr = encode_inline(inode, iattr_data->idata, attr);
 	attr = encode_xattrs(inode, attr, attrs + size - attr);
 	assert(attr == attrs + size);
 }
@@ -340,7 +447,7 @@ static int iattr_decode(struct btree *btree, void *data, void *attrs, int size)
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	struct inode *inode = data;
-	unsigned xsize;
+	unsigned xsize, isize;
 
 	xsize = decode_xsize(inode, attrs, size);
 	if (xsize) {
@@ -349,6 +456,18 @@ static int iattr_decode(struct btree *btree, void *data, void *attrs, int size)
 			return err;
 	}
 
+	/* Drop old inline data, if inode is decoded again */
+	free(tux_inode(inode)->inline_data);
+	tux_inode(inode)->inline_data = NULL;
+	tux_inode(inode)->inline_size = 0;
+
+	isize = decode_isize(inode, attrs, size);
+	if (isize) {
+		tux_inode(inode)->inline_data = malloc(isize);
+		if (!tux_inode(inode)->inline_data)
+			return -ENOMEM;
+	}
+
 	decode_attrs(inode, attrs, size); // error???
 	if (tux3_trace)
 		dump_attrs(inode);
@@ -13,12 +13,12 @@ enum atkind {
 	/* i_generation	= 7 */
 	/* i_version	= 8 */
 	/* i_flag	= 9 */
-	RESERVED1_ATTR	= 10,
+	DIR_INDEX_ATTR	= 10,
 	VAR_ATTRS,
 	/* Variable size (extended) attrs */
 	IDATA_ATTR	= 11,
 	XATTR_ATTR	= 12,
-	/* acl		= 13 */
+	XATTR_EXT_ATTR	= 13,
 	/* allocation hint = 14 */
 	RESERVED2_ATTR	= 15,
 	MAX_ATTRS,
@@ -32,9 +32,11 @@ enum atbit {
 	DATA_BTREE_BIT	= 1 << DATA_BTREE_ATTR,
 	LINK_COUNT_BIT	= 1 << LINK_COUNT_ATTR,
 	MTIME_BIT	= 1 << MTIME_ATTR,
+	DIR_INDEX_BIT	= 1 << DIR_INDEX_ATTR,
 	/* Variable size (extended) attrs */
 	IDATA_BIT	= 1 << IDATA_ATTR,
 	XATTR_BIT	= 1 << XATTR_ATTR,
+	XATTR_EXT_BIT	= 1 << XATTR_EXT_ATTR,
 };
 
 extern unsigned atsize[MAX_ATTRS];
@@ -167,6 +167,222 @@ void del_defer_alloc_inum(struct inode *inode)
 	list_del_init(&tux_inode(inode)->alloc_list);
 }
 
+/*
+ * In-memory index of used inums
+ *
+ * To find free inum without scanning ileaf dicts, inum space is
+ * divided into regions, and the region is loaded from itree into
+ * bitmap on first use. After that, alloc_inum() and purge_inode()
+ * keep it up to date, so no itree I/O is needed for loaded region.
+ *
+ * must hold itree->btree.lock
+ */
+#define INUM_REGION_BITS	15
+#define INUM_REGION_SIZE	((inum_t)1 << INUM_REGION_BITS)
+#define INUM_REGION_MASK	(INUM_REGION_SIZE - 1)
+/* Bitmap is allocated separately, to fit in 4KB without header */
+#define INUM_REGION_BYTES	(BITS_TO_LONGS(INUM_REGION_SIZE) * sizeof(long))
+
+struct inum_region {
+	unsigned long index;		/* Index of region in inum_index */
+	unsigned used;			/* Number of used inums */
+	unsigned long *bitmap;		/* INUM_REGION_BYTES bitmap */
+};
+
+static void inum_region_free(struct inum_region *region)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	free(region->bitmap);
+	free(region);
+}
+
+static struct inum_region *inum_region_lookup(struct sb *sb, inum_t inum)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return radix_tree_lookup(&sb->inum_index, inum >> INUM_REGION_BITS);
+}
+
+static void inum_region_set(struct inum_region *region, inum_t inum)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	if (!__test_and_set_bit(inum & INUM_REGION_MASK, region->bitmap))
+		region->used++;
+}
+
+/* Mark inum as used, if region was loaded */
+static void inum_index_set(struct sb *sb, inum_t inum)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct inum_region *region = inum_region_lookup(sb, inum);
+	if (region)
+		inum_region_set(region, inum);
+}
+
+/* Mark inum as free, if region was loaded */
+static void inum_index_clear(struct sb *sb, inum_t inum)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct inum_region *region = inum_region_lookup(sb, inum);
+	if (region && __test_and_clear_bit(inum & INUM_REGION_MASK,
+					   region->bitmap))
+		region->used--;
+}
+
+static int inum_region_enum(struct btree *btree, inum_t inum, void *attrs,
+			    unsigned size, void *data)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	inum_region_set(data, inum);
+	return 0;
+}
+
+/* Load used inums of region from itree */
+static struct inum_region *inum_region_load(struct cursor *cursor,
+					    inum_t inum)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = cursor->btree->sb;
+	unsigned long index = inum >> INUM_REGION_BITS;
+	inum_t start = (inum_t)index << INUM_REGION_BITS;
+	struct inum_region *region;
+	int err;
+
+	region = malloc(sizeof(*region));
+	if (!region)
+		return ERR_PTR(-ENOMEM);
+	region->bitmap = malloc(INUM_REGION_BYTES);
+	if (!region->bitmap) {
+		free(region);
+		return ERR_PTR(-ENOMEM);
+	}
+	memset(region->bitmap, 0, INUM_REGION_BYTES);
+	region->index = index;
+	region->used = 0;
+
+	if (has_root(cursor->btree)) {
+		struct ileaf_enumrate_cb cb = {
+			.callback	= inum_region_enum,
+			.data		= region,
+		};
+
+		err = btree_probe(cursor, start);
+		if (err)
+			goto error;
+		err = btree_traverse(cursor, start, INUM_REGION_SIZE,
+				     ileaf_enumerate, &cb);
+		release_cursor(cursor);
+		if (err < 0)
+			goto error;
+	}
+
+	/* Reserved inums are allocated only by specific inum */
+	if (start < TUX_NORMAL_INO) {
+		for (inum = start; inum < TUX_NORMAL_INO; inum++)
+			inum_region_set(region, inum);
+	}
+
+	err = radix_tree_insert(&sb->inum_index, index, region);
+	if (err)
+		goto error;
+
+	return region;
+
+error:
+	inum_region_free(region);
+	return ERR_PTR(err);
+}
+
+/*
+ * Find free inum from goal with index, and wrapped to TUX_NORMAL_INO
+ * if not found.
+ */
+static int inum_index_find(struct cursor *cursor, inum_t goal,
+			   inum_t *allocated)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = cursor->btree->sb;
+	inum_t inum = goal;
+	int wrapped = 0;
+
+	while (1) {
+		struct inum_region *region;
+
+		if (inum >= MAX_INODES) {
+			if (wrapped)
+				return -ENOSPC;
+			inum = TUX_NORMAL_INO;
+			wrapped = 1;
+		}
+		if (wrapped && inum >= goal)
+			return -ENOSPC;
+
+		region = inum_region_lookup(sb, inum);
+		if (!region) {
+			region = inum_region_load(cursor, inum);
+			if (IS_ERR(region))
+				return PTR_ERR(region);
+		}
+		if (region->used < INUM_REGION_SIZE) {
+			unsigned long bit;
+
+			bit = find_next_zero_bit(region->bitmap,
+						 INUM_REGION_SIZE,
+						 inum & INUM_REGION_MASK);
+			if (bit < INUM_REGION_SIZE) {
+				inum = (inum & ~INUM_REGION_MASK) + bit;
+				if (wrapped && inum >= goal)
+					return -ENOSPC;
+				*allocated = inum;
+				return 0;
+			}
+		}
+		inum = (inum | INUM_REGION_MASK) + 1;
+	}
+}
+
+void free_inum_index(struct sb *sb)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct inum_region *regions[16];
+	unsigned i, count;
+
+	while ((count = radix_tree_gang_lookup(&sb->inum_index,
+					       (void **)regions, 0,
+					       ARRAY_SIZE(regions)))) {
+		for (i = 0; i < count; i++) {
+			radix_tree_delete(&sb->inum_index, regions[i]->index);
+			inum_region_free(regions[i]);
+		}
+	}
+}
+
 /*
  * Inode btree expansion algorithm
  *
@@ -206,6 +422,14 @@ static int find_free_inum(struct cursor *cursor, inum_t goal, inum_t *allocated)
 	}
 #endif
 
+	/* Reserved inums are allocated by specific inum, not by index */
+	if (goal >= TUX_NORMAL_INO) {
+		ret = inum_index_find(cursor, goal, allocated);
+		if (ret != -ENOMEM)
+			return ret;
+		/* Couldn't make index, fallback to scan itree */
+	}
+
 	ret = btree_probe(cursor, goal);
 	if (ret)
 		return ret;
@@ -252,7 +476,9 @@ out:
 
 struct ialloc_policy {
 	inum_t (*goal)(struct inode *, void *);
-	void (*update)(struct inode *, inum_t);
+	/* Check free inum found from goal. Return new goal to retry, or 0 */
+	inum_t (*check)(struct inode *, inum_t, inum_t, void *);
+	void (*update)(struct inode *, inum_t, void *);
 };
 
 /*
@@ -267,7 +493,7 @@ static inum_t ialloc_specific_goal(struct inode *inode, void *data)
 	return *(inum_t *)data;
 }
 
-static void ialloc_noop_update(struct inode *inode, inum_t inum)
+static void ialloc_noop_update(struct inode *inode, inum_t inum, void *data)
 {
 	if(DEBUG_MODE_K==1)
 	{
@@ -281,37 +507,86 @@ static struct ialloc_policy ialloc_specific = {
 };
 
 /*
- * Try to allocate inum linearly.
- * FIXME: we should use per-directory inum policy.
+ * Try to allocate inum near the parent directory.
+ *
+ * A new directory takes new range of IALLOC_DIR_RANGE inums from
+ * sb->nextinum, and other inodes are allocated linearly in the range
+ * of the parent directory. So inodes of one directory are clustered
+ * in a few ileaf blocks. If the range of directory was filled, the
+ * directory takes new range.
+ *
+ * ->ialloc_goal is not persistent. After the directory was evicted,
+ * the goal restarts from the directory inum, and ialloc_dir_check()
+ * stops the scan from running past the range.
  */
-static inum_t ialloc_linear_goal(struct inode *inode, void *data)
+#define IALLOC_DIR_RANGE	256
+
+static inum_t ialloc_dir_goal(struct inode *inode, void *data)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	struct sb *sb = tux_sb(inode->i_sb);
-	return sb->nextinum;
+	struct inode *dir = data;
+
+	if (dir && !S_ISDIR(inode->i_mode)) {
+		struct tux3_inode *tuxdir = tux_inode(dir);
+		inum_t goal = tuxdir->ialloc_goal;
+
+		if (!goal)
+			goal = tuxdir->inum + 1;
+		/* Still in the range of directory? */
+		if (goal >= TUX_NORMAL_INO && (goal & (IALLOC_DIR_RANGE - 1)))
+			return goal;
+	}
+
+	return ALIGN(sb->nextinum, IALLOC_DIR_RANGE);
 }
 
-static void ialloc_linear_update(struct inode *inode, inum_t inum)
+static inum_t ialloc_dir_check(struct inode *inode, inum_t goal, inum_t inum,
+			       void *data)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	struct sb *sb = tux_sb(inode->i_sb);
+	inum_t start = goal & ~(inum_t)(IALLOC_DIR_RANGE - 1);
+	inum_t next = ALIGN(sb->nextinum, IALLOC_DIR_RANGE);
 
-	inum++;
-	if (inum >= MAX_INODES)
-		sb->nextinum = TUX_NORMAL_INO;
-	else
-		sb->nextinum = inum;
+	/* Range of goal is full, take new range */
+	if ((inum < start || inum >= start + IALLOC_DIR_RANGE) && start != next)
+		return next;
+	return 0;
 }
 
-static struct ialloc_policy ialloc_linear = {
-	.goal	= ialloc_linear_goal,
-	.update	= ialloc_linear_update,
+static void ialloc_dir_update(struct inode *inode, inum_t inum, void *data)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(inode->i_sb);
+	struct inode *dir = data;
+
+	if (dir && !S_ISDIR(inode->i_mode))
+		tux_inode(dir)->ialloc_goal = inum + 1;
+
+	/* Reserve the rest of range for this directory */
+	if (inum >= sb->nextinum) {
+		inum = ALIGN(inum + 1, IALLOC_DIR_RANGE);
+		if (inum >= MAX_INODES)
+			sb->nextinum = TUX_NORMAL_INO;
+		else
+			sb->nextinum = inum;
+	}
+}
+
+static struct ialloc_policy ialloc_dir = {
+	.goal	= ialloc_dir_goal,
+	.check	= ialloc_dir_check,
+	.update	= ialloc_dir_update,
 };
 
 static int tux_test(struct inode *inode, void *data)
@@ -342,20 +617,31 @@ static int alloc_inum(struct inode *inode, struct ialloc_policy *policy,
 	}
 	struct sb *sb = tux_sb(inode->i_sb);
 	struct btree *itree = itree_btree(sb);
+	struct cursor_stack stack;
 	struct cursor *cursor;
-	inum_t goal;
+	inum_t base, goal, inum;
 	int err = 0;
 
-	cursor = alloc_cursor(itree, 1); /* +1 for now depth */
+	cursor = alloc_cursor_stack(itree, 1, &stack); /* +1 for now depth */
 	if (!cursor)
 		return -ENOMEM;
 
-	down_write(&cursor->btree->lock);
-	goal = policy->goal(inode, policy_data);
+	down_write_btree(cursor->btree);
+	base = goal = policy->goal(inode, policy_data);
 	while (1) {
-		err = find_free_inum(cursor, goal, &goal);
+		err = find_free_inum(cursor, goal, &inum);
 		if (err)
 			goto error;
+		/* Policy doesn't want inum too far from goal? */
+		if (policy->check) {
+			inum_t retry = policy->check(inode, base, inum,
+						     policy_data);
+			if (retry) {
+				base = goal = retry;
+				continue;
+			}
+		}
+		goal = inum;
 
 		/*
 		 * Is this inum already used by deferred inum allocation?
@@ -365,6 +651,7 @@ static int alloc_inum(struct inode *inode, struct ialloc_policy *policy,
 		 */
 		if (insert_inode_locked4(inode, goal, tux_test, &goal) >= 0)
 			break;
+		inum_index_set(sb, goal);
 
 		/*
 		 * Skip deferred allocate inums.
@@ -384,8 +671,9 @@ static int alloc_inum(struct inode *inode, struct ialloc_policy *policy,
 	tux_setup_inode(inode);
 
 	add_defer_alloc_inum(inode);
+	inum_index_set(sb, goal);
 
-	policy->update(inode, goal);
+	policy->update(inode, goal, policy_data);
 
 	/*
 	 * If inum is not reserved area, account it. If inum is
@@ -399,7 +687,7 @@ static int alloc_inum(struct inode *inode, struct ialloc_policy *policy,
 	}
 
 error:
-	up_write(&cursor->btree->lock);
+	up_write_btree(cursor->btree);
 	free_cursor(cursor);
 
 	return err;
@@ -449,7 +737,7 @@ __tux_create_inode(struct inode *dir, struct tux_iattr *iattr, dev_t rdev,
 	return inode;
 }
 
-/* Allocate inode with linear inum allocation policy */
+/* Allocate inode with per-directory inum allocation policy */
 struct inode *tux_create_inode(struct inode *dir, struct tux_iattr *iattr,
 			       dev_t rdev)
 {
@@ -457,7 +745,7 @@ struct inode *tux_create_inode(struct inode *dir, struct tux_iattr *iattr,
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	return __tux_create_inode(dir, iattr, rdev, &ialloc_linear, NULL);
+	return __tux_create_inode(dir, iattr, rdev, &ialloc_dir, dir);
 }
 
 /* Allocate inode with specific inum allocation policy */
@@ -526,9 +814,10 @@ static int open_inode(struct inode *inode)
 	}
 	struct sb *sb = tux_sb(inode->i_sb);
 	struct btree *itree = itree_btree(sb);
+	struct cursor_stack stack;
 	int err;
 
-	struct cursor *cursor = alloc_cursor(itree, 0);
+	struct cursor *cursor = alloc_cursor_stack(itree, 0, &stack);
 	if (!cursor)
 		return -ENOMEM;
 
@@ -582,6 +871,161 @@ struct inode *tux3_iget(struct sb *sb, inum_t inum)
 	return inode;
 }
 
+/*
+ * Statahead: read attributes of many inodes at once (e.g. entries
+ * returned by readdir), so following stat() finds inodes in cache.
+ *
+ * The inums are sorted, and each ileaf is probed once to decode all
+ * new inodes in it, instead of btree_probe() for each inode.
+ */
+struct statahead_entry {
+	struct inode *inode;
+	int err;
+};
+
+struct statahead {
+	struct statahead_entry *entries;
+	unsigned count, next;
+};
+
+static int statahead_cmp(const void *a, const void *b)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	inum_t inum_a = *(inum_t *)a, inum_b = *(inum_t *)b;
+
+	if (inum_a < inum_b)
+		return -1;
+	return inum_a > inum_b;
+}
+
+/* Decode inodes in this ileaf (callback for btree_traverse()) */
+static int ileaf_statahead(struct btree *btree, tuxkey_t key_bottom,
+			   tuxkey_t key_limit, void *leaf,
+			   tuxkey_t key, u64 len, void *data)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct ileaf_attr_ops *attr_ops = btree->ops->private_ops;
+	struct statahead *sa = data;
+
+	while (sa->next < sa->count) {
+		struct statahead_entry *entry = &sa->entries[sa->next];
+		inum_t inum = tux_inode(entry->inode)->inum;
+		unsigned size;
+		void *attrs;
+
+		/* Next inode is in other ileaf, probe again */
+		if (inum >= key_limit)
+			return 1;
+
+		attrs = ileaf_lookup(btree, inum, leaf, &size);
+		if (attrs)
+			entry->err = attr_ops->decode(btree, entry->inode, attrs,
+						      size);
+		else
+			entry->err = -ENOENT;
+		sa->next++;
+	}
+
+	return 0;
+}
+
+static void statahead_read(struct sb *sb, struct statahead *sa)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct btree *itree = itree_btree(sb);
+	struct cursor *cursor;
+	int err = 0;
+
+	cursor = alloc_cursor(itree, 0);
+	if (!cursor)
+		return;
+
+	down_read(&cursor->btree->lock);
+	while (sa->next < sa->count) {
+		struct statahead_entry *last = &sa->entries[sa->count - 1];
+		inum_t inum = tux_inode(sa->entries[sa->next].inode)->inum;
+
+		err = btree_probe(cursor, inum);
+		if (err)
+			break;
+		err = btree_traverse(cursor, inum,
+				     tux_inode(last->inode)->inum - inum + 1,
+				     ileaf_statahead, sa);
+		release_cursor(cursor);
+		if (err < 0)
+			break;
+	}
+	up_read(&cursor->btree->lock);
+	free_cursor(cursor);
+}
+
+void tux3_statahead(struct sb *sb, inum_t *inums, unsigned count)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct statahead sa = {};
+	unsigned i;
+
+	sa.entries = malloc(count * sizeof(*sa.entries));
+	if (!sa.entries)
+		return;
+
+	/*
+	 * Sort inums, and make new inodes for inums which are not
+	 * cached yet. Skip duplicated inum (hardlinks), otherwise
+	 * iget5_locked() waits for our own I_NEW inode.
+	 */
+	sort(inums, count, sizeof(*inums), statahead_cmp, NULL);
+	for (i = 0; i < count; i++) {
+		struct inode *inode;
+
+		if (i && inums[i] == inums[i - 1])
+			continue;
+
+		inode = iget5_locked(vfs_sb(sb), inums[i], tux_test, tux_set,
+				     &inums[i]);
+		if (!inode)
+			continue;
+		if (!(inode->i_state & I_NEW)) {
+			iput(inode);
+			continue;
+		}
+		sa.entries[sa.count].inode = inode;
+		sa.entries[sa.count].err = -EIO;
+		sa.count++;
+	}
+	if (!sa.count)
+		goto out;
+
+	statahead_read(sb, &sa);
+
+	for (i = 0; i < sa.count; i++) {
+		struct statahead_entry *entry = &sa.entries[i];
+
+		if (entry->err) {
+			iget_failed(entry->inode);
+			continue;
+		}
+		check_present(entry->inode);
+		tux_setup_inode(entry->inode);
+		unlock_new_inode(entry->inode);
+		iput(entry->inode);
+	}
+out:
+	free(sa.entries);
+}
+
 struct inode *tux3_ilookup_nowait(struct sb *sb, inum_t inum)
 {
 	if(DEBUG_MODE_K==1)
@@ -617,19 +1061,21 @@ static int save_inode(struct inode *inode, struct tux3_iattr_data *idata,
 #ifndef __KERNEL__
 	/* FIXME: kill this, only mkfs path needs this */
 	/* FIXME: this should be merged to btree_expand()? */
-	down_write(&itree->lock);
+	down_write_btree(itree);
 	if (!has_root(itree))
 		err = alloc_empty_btree(itree);
-	up_write(&itree->lock);
+	up_write_btree(itree);
 	if (err)
 		return err;
 #endif
 
-	struct cursor *cursor = alloc_cursor(itree, 1); /* +1 for new depth */
+	struct cursor_stack stack;
+	/* +1 for new depth */
+	struct cursor *cursor = alloc_cursor_stack(itree, 1, &stack);
 	if (!cursor)
 		return -ENOMEM;
 
-	down_write(&cursor->btree->lock);
+	down_write_btree(cursor->btree);
 	if ((err = btree_probe(cursor, inum)))
 		goto out;
 	/* paranoia check */
@@ -669,7 +1115,7 @@ static int save_inode(struct inode *inode, struct tux3_iattr_data *idata,
 error_release:
 	release_cursor(cursor);
 out:
-	up_write(&cursor->btree->lock);
+	up_write_btree(cursor->btree);
 	free_cursor(cursor);
 	return err;
 }
@@ -724,6 +1170,10 @@ static int tux3_truncate(struct inode *inode, loff_t newsize)
 		err = tux3_truncate_partial_block(inode, newsize);
 		if (err)
 			goto error;
+	} else {
+		err = tux3_inline_convert(inode, newsize);
+		if (err)
+			goto error;
 	}
 
 	/* Change i_size, then clean buffers */
@@ -760,8 +1210,9 @@ static int purge_inode(struct inode *inode)
 	struct sb *sb = tux_sb(inode->i_sb);
 	struct btree *itree = itree_btree(sb);
 	int reserved_inum = tux_inode(inode)->inum < TUX_NORMAL_INO;
+	int err;
 
-	down_write(&itree->lock);	/* FIXME: spinlock is enough? */
+	down_write_btree(itree);	/* FIXME: spinlock is enough? */
 
 	/*
 	 * If inum is not reserved area, account it.
@@ -774,10 +1225,11 @@ static int purge_inode(struct inode *inode)
 
 	if (is_defer_alloc_inum(inode)) {
 		del_defer_alloc_inum(inode);
-		up_write(&itree->lock);
+		inum_index_clear(sb, tux_inode(inode)->inum);
+		up_write_btree(itree);
 		return 0;
 	}
-	up_write(&itree->lock);
+	up_write_btree(itree);
 
 	/*
 	 * If inode is deleted from itree, account to on-disk usedinodes.
@@ -790,7 +1242,13 @@ static int purge_inode(struct inode *inode)
 	}
 
 	/* Remove inum from inode btree */
-	return btree_chop(itree, tux_inode(inode)->inum, 1);
+	err = btree_chop(itree, tux_inode(inode)->inum, 1);
+	if (!err) {
+		down_write_btree(itree);
+		inum_index_clear(sb, tux_inode(inode)->inum);
+		up_write_btree(itree);
+	}
+	return err;
 }
 
 static int tux3_truncate_blocks(struct inode *inode, loff_t newsize)
@@ -805,6 +1263,64 @@ static int tux3_truncate_blocks(struct inode *inode, loff_t newsize)
 	return btree_chop(&tux_inode(inode)->btree, index, TUXKEY_LIMIT);
 }
 
+/* Free the empty dtree, xattrs, and inode number of dead inode */
+static int tux3_purge_finish(struct inode *inode)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	int err;
+
+	err = free_empty_btree(&tux_inode(inode)->btree);
+	if (err)
+		return err;
+
+	err = xcache_remove_all(inode);
+	if (err)
+		return err;
+
+	return purge_inode(inode);
+}
+
+/*
+ * Free one chunk of dtree of dead inode, from the end toward the head.
+ *
+ * The remaining size is written back to idata and inode, so saved
+ * inode (and replay of orphan) continues from there.
+ *
+ * Return 1 if dtree still has blocks to free, 0 if inode was purged.
+ */
+int tux3_purge_inode_step(struct inode *inode, struct tux3_iattr_data *idata)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(inode->i_sb);
+	tuxkey_t end = (idata->i_size + sb->blockmask) >> sb->blockbits;
+	tuxkey_t start = end > TUX3_PURGE_BLOCKS ? end - TUX3_PURGE_BLOCKS : 0;
+	int err;
+
+	/* Chop until TUXKEY_LIMIT to catch extents beyond i_size too */
+	err = btree_chop(&tux_inode(inode)->btree, start, TUXKEY_LIMIT);
+	if (err)
+		return err;
+
+	idata->i_size = (loff_t)start << sb->blockbits;
+	i_size_write(inode, idata->i_size);
+	if (start)
+		return 1;
+
+	return tux3_purge_finish(inode);
+}
+
+/*
+ * Purge dead inode.
+ *
+ * Return 1 if dtree is huge and purge was started by chunk. Caller
+ * has to continue by tux3_purge_inode_step() on following deltas.
+ */
 int tux3_purge_inode(struct inode *inode, struct tux3_iattr_data *idata,
 		     unsigned delta)
 {
@@ -812,6 +1328,7 @@ int tux3_purge_inode(struct inode *inode, struct tux3_iattr_data *idata,
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
+	struct sb *sb = tux_sb(inode->i_sb);
 	int err, has_hole;
 
 	/*
@@ -831,23 +1348,20 @@ int tux3_purge_inode(struct inode *inode, struct tux3_iattr_data *idata,
 	 * if (inode->i_blocks)
 	 */
 	if (idata->i_size || has_hole) {
+		/*
+		 * Chopping huge dtree at once makes this delta too
+		 * long. So, free it by chunk over deltas.
+		 */
+		if ((idata->i_size >> sb->blockbits) > TUX3_PURGE_BLOCKS)
+			return tux3_purge_inode_step(inode, idata);
+
 		idata->i_size = 0;
 		err = tux3_truncate_blocks(inode, 0);
 		if (err)
-			goto error;
+			return err;
 	}
-	err = free_empty_btree(&tux_inode(inode)->btree);
-	if (err)
-		goto error;
-
-	err = xcache_remove_all(inode);
-	if (err)
-		goto error;
 
-	err = purge_inode(inode);
-
-error:
-	return err;
+	return tux3_purge_finish(inode);
 }
 
 /*
@@ -932,6 +1446,9 @@ void tux3_evict_inode(struct inode *inode)
 
 	clear_inode(inode);
 	free_xcache(inode);
+	free_dir_space(inode);
+	free(tux_inode(inode)->inline_data);
+	tux_inode(inode)->inline_data = NULL;
 }
 
 #ifdef __KERNEL__
@@ -961,6 +1478,14 @@ int tux3_sync_file(struct file *file, loff_t start, loff_t end, int datasync)
 	}
 	struct inode *inode = file->f_mapping->host;
 	struct sb *sb = tux_sb(inode->i_sb);
+	int err;
+
+	/* Try to write only this inode without committing delta */
+	mutex_lock(&inode->i_mutex);
+	err = tux3_fast_fsync(inode);
+	mutex_unlock(&inode->i_mutex);
+	if (!err)
+		return 0;
 
 	/* FIXME: this is sync(2). We should implement real one */
 	static int print_once;
@@ -59,11 +59,18 @@
  *
  *  - Integer fields are big endian, byte aligned.
  *
+ *  - If header has LOGBLOCK_COMPACT, LOG_BALLOC and LOG_BFREE* entries
+ *    are "code, nr, nr * (delta, count)". delta is zigzag varint of
+ *    block from end of previous extent in same entry (0 for first),
+ *    and count is varint. Sequential calls of same kind are batched
+ *    into one entry, so runs of near blocks take a few bytes each.
+ *
  * Log block locking
  *
  *  - Log block must be touched only by the backend. So, we don't need to lock.
  */
 
+/* Size for LOG_BALLOC and LOG_BFREE* is for !LOGBLOCK_COMPACT */
 unsigned log_size[] = {
 	[LOG_BALLOC]		= 11,
 	[LOG_BFREE]		= 11,
@@ -85,8 +92,65 @@ unsigned log_size[] = {
 	[LOG_FREEBLOCKS]	= 7,
 	[LOG_UNIFY]		= 1,
 	[LOG_DELTA]		= 1,
+	[LOG_FSYNC_DATA]	= 21,
+	[LOG_FSYNC_ATTR]	= 39,
 };
 
+/*
+ * Size of log entry at data, including variable size part. Return 0 if
+ * variable size part is corrupted.
+ */
+unsigned log_entry_size(struct logblock *log, unsigned char *data)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	u8 code = *data;
+
+	if (log_compact(log) &&
+	    code >= LOG_BALLOC && code <= LOG_BFREE_RELOG) {
+		unsigned char *end = log->data + be16_to_cpu(log->bytes);
+		unsigned char *p = data + 2;
+		unsigned nr;
+		u64 val;
+
+		if (p > end)
+			return 0;
+		nr = data[1];
+		while (nr--) {
+			p = decode_varint(p, end, &val);
+			if (p)
+				p = decode_varint(p, end, &val);
+			if (!p)
+				return 0;
+		}
+		return p - data;
+	}
+	return log_size[code];
+}
+
+/* Decode an extent of compact LOG_BALLOC/LOG_BFREE* entry */
+void *log_decode_extent(void *at, void *end, block_t *prev, u64 *block,
+			unsigned *count)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	u64 zigzag, val;
+
+	at = decode_varint(at, end, &zigzag);
+	if (at)
+		at = decode_varint(at, end, &val);
+	if (!at)
+		return NULL;
+	*block = *prev + ((s64)(zigzag >> 1) ^ -(s64)(zigzag & 1));
+	*count = val;
+	*prev = *block + *count;
+	return at;
+}
+
 void log_next(struct sb *sb)
 {
 	if(DEBUG_MODE_K==1)
@@ -97,6 +161,8 @@ void log_next(struct sb *sb)
 	sb->logbuf = blockget(mapping(sb->logmap), sb->lognext++);
 	sb->logpos = bufdata(sb->logbuf) + sizeof(struct logblock);
 	sb->logtop = bufdata(sb->logbuf) + sb->blocksize;
+	/* Don't append extent to entry on other log block */
+	sb->logext = sb->logext_end = NULL;
 }
 
 void log_drop(struct sb *sb)
@@ -162,6 +228,7 @@ static void *log_begin(struct sb *sb, unsigned bytes)
 
 		*(struct logblock *)bufdata(sb->logbuf) = (struct logblock){
 			.magic = cpu_to_be16(TUX3_MAGIC_LOG),
+			.flags = cpu_to_be16(LOGBLOCK_COMPACT),
 		};
 
 		/* Dirty for write, and prevent to be reclaimed */
@@ -179,6 +246,38 @@ static void log_end(struct sb *sb, void *pos)
 	sb->logpos = pos;
 }
 
+/*
+ * Allocate log blocks just after current logchain if possible. With
+ * this, replay can read the contiguous log blocks at once.
+ *
+ * This doesn't change ->nextblock, to keep the goal for data blocks.
+ */
+static int logblock_balloc(struct sb *sb, unsigned blocks,
+			   struct block_segment *seg)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	block_t logchain = be64_to_cpu(sb->super.logchain);
+	block_t nextblock = sb->nextblock;
+	block_t goal;
+	int err;
+
+	if (!logchain)
+		return balloc_partial(sb, blocks, seg, 1);
+
+	goal = logchain + 1;
+	if (goal >= sb->volblocks)
+		goal = 0;
+
+	err = balloc_from_range(sb, goal, sb->volblocks, blocks,
+				BALLOC_PARTIAL, seg, 1);
+	sb->nextblock = nextblock;
+
+	return err;
+}
+
 /*
  * Flush log blocks.
  *
@@ -204,7 +303,7 @@ int tux3_logmap_io(int rw, struct bufvec *bufvec)
 		block_t block, limit;
 		int err;
 
-		err = balloc_partial(sb, count, &seg, 1);
+		err = logblock_balloc(sb, count, &seg);
 		if (err) {
 			assert(err);
 			return err;
@@ -213,10 +312,9 @@ int tux3_logmap_io(int rw, struct bufvec *bufvec)
 		/*
 		 * Link log blocks to logchain.
 		 *
-		 * FIXME: making the link for each block is
-		 * inefficient to read on replay. Instead, we would be
-		 * able to use the link of extent. With it, we can
-		 * read multiple blocks at once.
+		 * If previous logblock is at block - 1, record how
+		 * many previous logblocks are contiguous. Replay uses
+		 * it to read those blocks at once.
 		 */
 		block = seg.block;
 		limit = seg.block + seg.count;
@@ -224,6 +322,13 @@ int tux3_logmap_io(int rw, struct bufvec *bufvec)
 			struct logblock *log = bufdata(buffer);
 
 			assert(log->magic == cpu_to_be16(TUX3_MAGIC_LOG));
+			if (block == be64_to_cpu(sb->super.logchain) + 1) {
+				/* Saturated count is still true */
+				if (sb->logcontig < USHRT_MAX)
+					sb->logcontig++;
+			} else
+				sb->logcontig = 0;
+			log->logcontig = cpu_to_be16(sb->logcontig);
 			log->logchain = sb->super.logchain;
 
 			trace("logchain %lld", block);
@@ -291,18 +396,6 @@ static void log_u16_u48(struct sb *sb, u8 intent, u16 v1, u64 v2)
 	log_end(sb, encode48(data, v2));
 }
 
-static void log_u32_u48(struct sb *sb, u8 intent, u32 v1, u64 v2)
-{
-	if(DEBUG_MODE_K==1)
-	{
-		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
-	}
-	unsigned char *data = log_begin(sb, log_size[intent]);
-	*data++ = intent;
-	data = encode32(data, v1);
-	log_end(sb, encode48(data, v2));
-}
-
 static void log_u48_u48(struct sb *sb, u8 intent, u64 v1, u64 v2)
 {
 	if(DEBUG_MODE_K==1)
@@ -341,6 +434,39 @@ static void log_u48_u48_u48(struct sb *sb, u8 intent, u64 v1, u64 v2, u64 v3)
 	log_end(sb, encode48(data, v3));
 }
 
+/*
+ * Log extent as compact entry. If last entry on this log block is same
+ * intent, append extent to it.
+ */
+static void log_extent(struct sb *sb, u8 intent, block_t block,
+		       unsigned count)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned char *data = log_begin(sb, 2 + 2 * VARINT_MAX);
+	s64 delta;
+
+	if (data == sb->logext_end && sb->logext[0] == intent &&
+	    sb->logext[1] < 0xff) {
+		sb->logext[1]++;
+	} else {
+		sb->logext = data;
+		*data++ = intent;
+		*data++ = 1;
+		sb->logext_prev = 0;
+	}
+
+	delta = block - sb->logext_prev;
+	data = encode_varint(data, (u64)(delta << 1) ^ (u64)(delta >> 63));
+	data = encode_varint(data, count);
+	sb->logext_prev = block + count;
+	sb->logext_end = data;
+
+	log_end(sb, data);
+}
+
 /* balloc() until next unify */
 void log_balloc(struct sb *sb, block_t block, unsigned count)
 {
@@ -348,8 +474,7 @@ void log_balloc(struct sb *sb, block_t block, unsigned count)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	/* FIXME: 32bits count is too big? */
-	log_u32_u48(sb, LOG_BALLOC, count, block);
+	log_extent(sb, LOG_BALLOC, block, count);
 }
 
 /* bfree() */
@@ -359,8 +484,7 @@ void log_bfree(struct sb *sb, block_t block, unsigned count)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	/* FIXME: 32bits count is too big? */
-	log_u32_u48(sb, LOG_BFREE, count, block);
+	log_extent(sb, LOG_BFREE, block, count);
 }
 
 /* Defered bfree() until after next unify */
@@ -370,8 +494,7 @@ void log_bfree_on_unify(struct sb *sb, block_t block, unsigned count)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	/* FIXME: 32bits count is too big? */
-	log_u32_u48(sb, LOG_BFREE_ON_UNIFY, count, block);
+	log_extent(sb, LOG_BFREE_ON_UNIFY, block, count);
 }
 
 /* Same with log_bfree() (re-logged log_bfree_on_unify() on unify) */
@@ -381,8 +504,7 @@ void log_bfree_relog(struct sb *sb, block_t block, unsigned count)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	/* FIXME: 32bits count is too big? */
-	log_u32_u48(sb, LOG_BFREE_RELOG, count, block);
+	log_extent(sb, LOG_BFREE_RELOG, block, count);
 }
 
 /*
@@ -585,7 +707,10 @@ void log_unify(struct sb *sb)
 	log_intent(sb, LOG_UNIFY);
 }
 
-/* Just add log record as delta mark (for debugging) */
+/*
+ * Log to know where is delta. Replay uses this to know fast fsync
+ * logs before this were committed by delta.
+ */
 void log_delta(struct sb *sb)
 {
 	if(DEBUG_MODE_K==1)
@@ -595,80 +720,150 @@ void log_delta(struct sb *sb)
 	log_intent(sb, LOG_DELTA);
 }
 
-/* Stash infrastructure (struct stash must be initialized by zero clear) */
-
 /*
- * Stash utility - store an arbitrary number of u64 values in a linked queue
- * of pages.
+ * 1. Copy of count blocks from index of inum was written at block
+ * 2. balloc(block) until next delta
+ * (this is log of fast fsync, obsoleted by next LOG_DELTA)
  */
+void log_fsync_data(struct sb *sb, inum_t inum, block_t index, block_t block,
+		    unsigned count)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned char *data = log_begin(sb, log_size[LOG_FSYNC_DATA]);
+	*data++ = LOG_FSYNC_DATA;
+	data = encode16(data, count);
+	data = encode48(data, inum);
+	data = encode48(data, index);
+	log_end(sb, encode48(data, block));
+}
 
-static inline struct link *page_link(struct page *page)
+/*
+ * Set size, mtime and ctime of inum
+ * (this is log of fast fsync, obsoleted by next LOG_DELTA)
+ */
+void log_fsync_attr(struct sb *sb, inum_t inum, loff_t size,
+		    struct timespec mtime, struct timespec ctime)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	return (void *)&page->private;
+	unsigned char *data = log_begin(sb, log_size[LOG_FSYNC_ATTR]);
+	*data++ = LOG_FSYNC_ATTR;
+	data = encode48(data, inum);
+	data = encode64(data, size);
+	data = encode64(data, mtime.tv_sec);
+	data = encode32(data, mtime.tv_nsec);
+	data = encode64(data, ctime.tv_sec);
+	log_end(sb, encode32(data, ctime.tv_nsec));
 }
 
+/*
+ * Stash of block extents - store an arbitrary number of extents in an
+ * rbtree, sorted by block. Adjacent extents are merged when added, so
+ * e.g. a big truncate makes a few extents instead of one per leaf
+ * extent, and actor is called in block order (i.e. each bitmap block
+ * is modified once in sequence).
+ */
+
+struct stash_extent {
+	struct rb_node node;
+	block_t block;
+	unsigned count;
+};
+
 void stash_init(struct stash *stash)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	init_flink_head(&stash->head);
-	stash->pos = stash->top = NULL;
+	stash->root = RB_ROOT;
+	stash->count = 0;
 }
 
-/* Add new entry (value) to stash */
-int stash_value(struct stash *stash, u64 value)
+/* Add extent to stash, and merge with adjacent extents */
+static int stash_extent(struct stash *stash, block_t block, unsigned count)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	if (stash->pos == stash->top) {
-		struct page *page = alloc_page(GFP_NOFS);
-		if (!page)
-			return -ENOMEM;
-		stash->top = page_address(page) + PAGE_SIZE;
-		stash->pos = page_address(page);
-		if (!flink_empty(&stash->head))
-			flink_add(page_link(page), &stash->head);
-		else
-			flink_first_add(page_link(page), &stash->head);
+	struct rb_node **p = &stash->root.rb_node, *parent = NULL;
+	struct stash_extent *prev = NULL, *next = NULL, *extent;
+
+	/* Find nearest extents, prev->block <= block < next->block */
+	while (*p) {
+		parent = *p;
+		extent = rb_entry(parent, struct stash_extent, node);
+		if (block < extent->block) {
+			next = extent;
+			p = &parent->rb_left;
+		} else {
+			prev = extent;
+			p = &parent->rb_right;
+		}
+	}
+
+	/* Extents must not be overlapped (i.e. no double free) */
+	assert(!prev || prev->block + prev->count <= block);
+	assert(!next || block + count <= next->block);
+
+	if (prev && prev->block + prev->count == block &&
+	    prev->count <= UINT_MAX - count) {
+		prev->count += count;
+		/* Filled hole between prev and next? */
+		if (next && block + count == next->block &&
+		    prev->count <= UINT_MAX - next->count) {
+			prev->count += next->count;
+			rb_erase(&next->node, &stash->root);
+			free(next);
+			stash->count--;
+		}
+		return 0;
+	}
+	if (next && block + count == next->block &&
+	    next->count <= UINT_MAX - count) {
+		/* Order in tree is not changed */
+		next->block = block;
+		next->count += count;
+		return 0;
 	}
-	*stash->pos++ = value;
+
+	extent = malloc(sizeof(*extent));
+	if (!extent)
+		return -ENOMEM;
+	extent->block = block;
+	extent->count = count;
+	rb_link_node(&extent->node, parent, p);
+	rb_insert_color(&extent->node, &stash->root);
+	stash->count++;
+
 	return 0;
 }
 
-/* Free all pages in stash to empty. */
+/* Free all extents in stash to empty. */
 static void empty_stash(struct stash *stash)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	struct flink_head *head = &stash->head;
+	struct rb_node *node;
 
-	if (!flink_empty(head)) {
-		struct page *page;
-		while (1) {
-			page = __flink_next_entry(head, struct page, private);
-			if (flink_is_last(head))
-				break;
-			flink_del_next(head);
-			__free_page(page);
-		}
-		__free_page(page);
-		stash_init(stash);
+	while ((node = rb_first(&stash->root))) {
+		rb_erase(node, &stash->root);
+		free(rb_entry(node, struct stash_extent, node));
 	}
+	stash_init(stash);
 }
 
 /*
- * Call actor() for each entries. And, prepare to add new entry to stash.
- * (NOTE: after this, stash keeps one page for future stash_value().)
+ * Call actor() for each extents in block order, and remove those. If
+ * actor() returned error, stop and keep remaining extents.
  */
 int unstash(struct sb *sb, struct stash *stash, unstash_t actor)
 {
@@ -676,34 +871,26 @@ int unstash(struct sb *sb, struct stash *stash, unstash_t actor)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	struct flink_head *head = &stash->head;
-	struct page *page;
+	struct rb_node *node;
 
-	if (flink_empty(head))
-		return 0;
-	while (1) {
-		page = __flink_next_entry(head, struct page, private);
-		u64 *vec = page_address(page);
-		u64 *top = page_address(page) + PAGE_SIZE;
-
-		if (top == stash->top)
-			top = stash->pos;
-		for (; vec < top; vec++) {
-			int err;
-			if ((err = actor(sb, *vec)))
-				return err;
-		}
-		if (flink_is_last(head))
-			break;
-		flink_del_next(head);
-		__free_page(page);
+	while ((node = rb_first(&stash->root))) {
+		struct stash_extent *extent =
+			rb_entry(node, struct stash_extent, node);
+		int err;
+
+		err = actor(sb, extent->block, extent->count);
+		if (err)
+			return err;
+
+		rb_erase(node, &stash->root);
+		free(extent);
+		stash->count--;
 	}
-	stash->pos = page_address(page);
 	return 0;
 }
 
 /*
- * Call actor() for each entries without freeing pages.
+ * Call actor() for each extents in block order without removing.
  */
 int stash_walk(struct sb *sb, struct stash *stash, unstash_t actor)
 {
@@ -711,29 +898,17 @@ int stash_walk(struct sb *sb, struct stash *stash, unstash_t actor)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	struct flink_head *head = &stash->head;
-	struct page *page;
+	struct rb_node *node;
 
-	if (flink_empty(head))
-		return 0;
-
-	struct link *link, *first;
-	link = first = flink_next(head);
-	do {
-		page = __link_entry(link, struct page, private);
-		u64 *vec = page_address(page);
-		u64 *top = page_address(page) + PAGE_SIZE;
-
-		if (top == stash->top)
-			top = stash->pos;
-		for (; vec < top; vec++) {
-			int err;
-			if ((err = actor(sb, *vec)))
-				return err;
-		}
+	for (node = rb_first(&stash->root); node; node = rb_next(node)) {
+		struct stash_extent *extent =
+			rb_entry(node, struct stash_extent, node);
+		int err;
 
-		link = link->next;
-	} while (link != first);
+		err = actor(sb, extent->block, extent->count);
+		if (err)
+			return err;
+	}
 
 	return 0;
 }
@@ -746,25 +921,9 @@ int defer_bfree(struct stash *defree, block_t block, unsigned count)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	static const unsigned limit = ULLONG_MAX >> 48;
-
-	/*
-	 * count field of stash is 16bits. So, this separates to
-	 * multiple records to avoid overflow.
-	 */
-	while (count) {
-		unsigned c = min(count, limit);
-		int err;
-
-		err = stash_value(defree, ((u64)c << 48) + block);
-		if (err)
-			return err;
-
-		count -= c;
-		block += c;
-	}
-
-	return 0;
+	if (!count)
+		return 0;
+	return stash_extent(defree, block, count);
 }
 
 void destroy_defer_bfree(struct stash *defree)
@@ -30,6 +30,9 @@ static struct dentry *tux3_lookup(struct inode *dir, struct dentry *dentry,
 	inum = be64_to_cpu(entry->inum);
 	blockput(buffer);
 
+	/* Stat of children after readdir? (e.g. "ls -l") */
+	tux_readdir_hit(dir);
+
 	inode = tux3_iget(sb, inum);
 	if (IS_ERR(inode) && PTR_ERR(inode) == -ENOENT)
 		tux3_warn(sb, "%s: inum %Lu not found", __func__, inum);
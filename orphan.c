@@ -123,10 +123,10 @@ int tux3_unify_orphan_add(struct sb *sb, struct list_head *orphan_add)
 	if (list_empty(orphan_add))
 		return 0;
 
-	down_write(&otree->lock);
+	down_write_btree(otree);
 	if (!has_root(otree))
 		err = alloc_empty_btree(otree);
-	up_write(&otree->lock);
+	up_write_btree(otree);
 	if (err)
 		return err;
 
@@ -135,7 +135,7 @@ int tux3_unify_orphan_add(struct sb *sb, struct list_head *orphan_add)
 	if (!cursor)
 		return -ENOMEM;
 
-	down_write(&cursor->btree->lock);
+	down_write_btree(cursor->btree);
 	while (!list_empty(orphan_add)) {
 		struct tux3_inode *tuxnode =orphan_list_entry(orphan_add->next);
 
@@ -161,7 +161,7 @@ int tux3_unify_orphan_add(struct sb *sb, struct list_head *orphan_add)
 		list_del_init(&tuxnode->orphan_list);
 	}
 out:
-	up_write(&cursor->btree->lock);
+	up_write_btree(cursor->btree);
 	free_cursor(cursor);
 
 	return err;
@@ -444,7 +444,7 @@ static int load_otree_orphan_inode(struct replay *rp)
 	if (!cursor)
 		return -ENOMEM;
 
-	down_write(&cursor->btree->lock);
+	down_write_btree(cursor->btree);
 	err = btree_probe(cursor, 0);
 	if (err)
 		goto error;
@@ -454,7 +454,7 @@ static int load_otree_orphan_inode(struct replay *rp)
 
 	release_cursor(cursor);
 error:
-	up_write(&cursor->btree->lock);
+	up_write_btree(cursor->btree);
 	free_cursor(cursor);
 
 	return err;
@@ -31,9 +31,50 @@ static const char *log_name[] = {
 	X(LOG_FREEBLOCKS),
 	X(LOG_UNIFY),
 	X(LOG_DELTA),
+	X(LOG_FSYNC_DATA),
+	X(LOG_FSYNC_ATTR),
 #undef X
 };
 
+/* Log of fast fsync, which was not obsoleted by LOG_DELTA */
+struct fsync_redo {
+	struct list_head list;
+	u8 code;			/* LOG_FSYNC_DATA or LOG_FSYNC_ATTR */
+	inum_t inum;
+	block_t index, block;		/* LOG_FSYNC_DATA */
+	unsigned count;
+	loff_t size;			/* LOG_FSYNC_ATTR */
+	struct timespec mtime, ctime;
+};
+
+static int fsync_redo_add(struct replay *rp, struct fsync_redo *src)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct fsync_redo *redo = malloc(sizeof(*redo));
+	if (!redo)
+		return -ENOMEM;
+	*redo = *src;
+	list_add_tail(&redo->list, &rp->fsync_redo);
+	return 0;
+}
+
+static void fsync_redo_discard(struct list_head *head)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct fsync_redo *redo, *safe;
+
+	list_for_each_entry_safe(redo, safe, head, list) {
+		list_del(&redo->list);
+		free(redo);
+	}
+}
+
 static struct replay *alloc_replay(struct sb *sb, unsigned logcount)
 {
 	if(DEBUG_MODE_K==1)
@@ -41,11 +82,15 @@ static struct replay *alloc_replay(struct sb *sb, unsigned logcount)
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	struct replay *rp;
+	int i;
 
 	rp = malloc(sizeof(*rp) + logcount * sizeof(block_t));
 	if (!rp)
 		return ERR_PTR(-ENOMEM);
 
+	for (i = 0; i < REPLAY_BITMAP_QUEUES; i++)
+		INIT_LIST_HEAD(&rp->bitmap_queue[i]);
+
 	rp->sb = sb;
 	rp->unify_pos = NULL;
 	rp->unify_index = -1;
@@ -53,6 +98,7 @@ static struct replay *alloc_replay(struct sb *sb, unsigned logcount)
 
 	INIT_LIST_HEAD(&rp->log_orphan_add);
 	INIT_LIST_HEAD(&rp->orphan_in_otree);
+	INIT_LIST_HEAD(&rp->fsync_redo);
 
 	return rp;
 }
@@ -63,8 +109,13 @@ static void free_replay(struct replay *rp)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
+	int i;
+
+	for (i = 0; i < REPLAY_BITMAP_QUEUES; i++)
+		assert(list_empty(&rp->bitmap_queue[i]));
 	assert(list_empty(&rp->log_orphan_add));
 	assert(list_empty(&rp->orphan_in_otree));
+	assert(list_empty(&rp->fsync_redo));
 	free(rp);
 }
 
@@ -76,19 +127,25 @@ static int replay_check_log(struct replay *rp, struct buffer_head *logbuf)
 	}
 	struct sb *sb = rp->sb;
 	struct logblock *log = bufdata(logbuf);
-	unsigned char *data = log->data;
+	unsigned char *data = log->data, *end;
 
 	if (log->magic != cpu_to_be16(TUX3_MAGIC_LOG)) {
 		tux3_err(sb, "bad log magic %x", be16_to_cpu(log->magic));
 		return -EINVAL;
 	}
+	if (be16_to_cpu(log->flags) & ~LOGBLOCK_COMPACT) {
+		tux3_err(sb, "unknown log flags %x", be16_to_cpu(log->flags));
+		return -EINVAL;
+	}
 	if (be16_to_cpu(log->bytes) + sizeof(*log) > sb->blocksize) {
 		tux3_err(sb, "log bytes is too big");
 		return -EINVAL;
 	}
 
-	while (data < log->data + be16_to_cpu(log->bytes)) {
+	end = log->data + be16_to_cpu(log->bytes);
+	while (data < end) {
 		u8 code = *data;
+		unsigned size;
 
 		/* Find latest unify. */
 		if (code == LOG_UNIFY && rp->unify_index == -1) {
@@ -99,11 +156,16 @@ static int replay_check_log(struct replay *rp, struct buffer_head *logbuf)
 			rp->unify_index = bufindex(logbuf);
 		}
 
-		if (log_size[code] == 0) {
+		if (code >= LOG_TYPES || log_size[code] == 0) {
 			tux3_err(sb, "invalid log code: 0x%02x", code);
 			return -EINVAL;
 		}
-		data += log_size[code];
+		size = log_entry_size(log, data);
+		if (!size || size > end - data) {
+			tux3_err(sb, "log entry 0x%02x is truncated", code);
+			return -EINVAL;
+		}
+		data += size;
 	}
 
 	return 0;
@@ -128,17 +190,28 @@ static void replay_unpin_logblocks(struct sb *sb, unsigned i, unsigned logcount)
 	}
 }
 
-/* Prepare log info for replay and pin logblocks. */
+#define REPLAY_BIO_VECS		16
+
+/*
+ * Prepare log info for replay and pin logblocks.
+ *
+ * ->logcontig of logblock tells how many previous logblocks are
+ * placed just before it. So, we read those logblocks at once, instead
+ * of following logchain block by block.
+ */
 static struct replay *replay_prepare(struct sb *sb)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
+	unsigned max_vecs = min(REPLAY_BIO_VECS, bio_get_nr_vecs(sb_dev(sb)));
+	struct buffer_head *bufs[REPLAY_BIO_VECS];
+	struct bio_vec vecs[REPLAY_BIO_VECS];
 	block_t logchain = be64_to_cpu(sb->super.logchain);
 	unsigned i, logcount = be32_to_cpu(sb->super.logcount);
+	unsigned contig = 1;
 	struct replay *rp;
-	struct buffer_head *buffer;
 	int err;
 
 	/* FIXME: this address array is quick hack. Rethink about log
@@ -147,32 +220,69 @@ static struct replay *replay_prepare(struct sb *sb)
 	if (IS_ERR(rp))
 		return rp;
 
-	/* FIXME: maybe, we should use bufvec to read log blocks */
+	sb->logcontig = 0;
+
 	trace("load %u logblocks", logcount);
 	i = logcount;
-	while (i-- > 0) {
+	while (i > 0) {
+		unsigned j, n = min(min(contig, max_vecs), i);
+		block_t start = logchain - n + 1;
 		struct logblock *log;
 
-		buffer = blockget(mapping(sb->logmap), i);
-		if (!buffer) {
-			i++;
-			err = -ENOMEM;
-			goto error;
+		/* Read logblocks [start, logchain] to index [i - n, i) */
+		for (j = 0; j < n; j++) {
+			struct buffer_head *buffer;
+
+			buffer = blockget(mapping(sb->logmap), i - n + j);
+			if (!buffer) {
+				while (j-- > 0)
+					blockput(bufs[j]);
+				err = -ENOMEM;
+				goto error;
+			}
+			assert(bufindex(buffer) == i - n + j);
+			bufs[j] = buffer;
+			vecs[j] = (struct bio_vec){
+				.bv_page	= buffer->b_page,
+				.bv_offset	= bh_offset(buffer),
+				.bv_len		= sb->blocksize,
+			};
 		}
-		assert(bufindex(buffer) == i);
-		err = blockio(READ, sb, buffer, logchain);
-		if (err)
+		err = syncio(READ, sb_dev(sb), start << sb->blockbits, n, vecs);
+		if (err) {
+			for (j = 0; j < n; j++)
+				blockput(bufs[j]);
 			goto error;
+		}
+		i -= n;
 
-		err = replay_check_log(rp, buffer);
-		if (err)
-			goto error;
+		/* Check from newer logblock, like following logchain */
+		for (j = n; j-- > 0;) {
+			err = replay_check_log(rp, bufs[j]);
+			if (err)
+				goto error;
+
+			/* Store index => blocknr map */
+			rp->blocknrs[i + j] = start + j;
+		}
 
-		/* Store index => blocknr map */
-		rp->blocknrs[bufindex(buffer)] = logchain;
+		/* Remember ->logcontig of head for future logging */
+		if (i + n == logcount) {
+			log = bufdata(bufs[n - 1]);
+			sb->logcontig = be16_to_cpu(log->logcontig);
+		}
 
-		log = bufdata(buffer);
+		log = bufdata(bufs[0]);
 		logchain = be64_to_cpu(log->logchain);
+		contig = be16_to_cpu(log->logcontig);
+		if (!contig)
+			contig = 1;
+		else if (logchain != start - 1) {
+			tux3_err(sb, "broken logcontig %u: logchain %Lx",
+				 contig, logchain);
+			err = -EINVAL;
+			goto error;
+		}
 	}
 
 	return rp;
@@ -194,6 +304,8 @@ static void replay_done(struct replay *rp)
 	struct sb *sb = rp->sb;
 
 	clean_orphan_list(&rp->log_orphan_add);	/* for error path */
+	fsync_redo_discard(&rp->fsync_redo);	/* for error path */
+	replay_discard_bitmap(rp);		/* for error path */
 	free_replay(rp);
 
 	sb->lognext = be32_to_cpu(sb->super.logcount);
@@ -340,6 +452,10 @@ static int replay_log_stage1(struct replay *rp, struct buffer_head *logbuf)
 		case LOG_BFREE:
 		case LOG_BFREE_ON_UNIFY:
 		case LOG_BFREE_RELOG:
+			/* Variable size if LOGBLOCK_COMPACT */
+			data += log_entry_size(log, data - sizeof(code)) -
+				sizeof(code);
+			break;
 		case LOG_LEAF_REDIRECT:
 		case LOG_LEAF_FREE:
 		case LOG_BNODE_FREE:
@@ -347,6 +463,8 @@ static int replay_log_stage1(struct replay *rp, struct buffer_head *logbuf)
 		case LOG_ORPHAN_DEL:
 		case LOG_UNIFY:
 		case LOG_DELTA:
+		case LOG_FSYNC_DATA:
+		case LOG_FSYNC_ATTR:
 			data += log_size[code] - sizeof(code);
 			break;
 		default:
@@ -358,6 +476,23 @@ static int replay_log_stage1(struct replay *rp, struct buffer_head *logbuf)
 	return 0;
 }
 
+/* Replay an extent of LOG_BALLOC or LOG_BFREE* */
+static int replay_extent(struct replay *rp, u8 code, block_t block,
+			 unsigned count)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	trace("%s: count %u, block %Lx", log_name[code], count, block);
+
+	if (code == LOG_BALLOC)
+		return replay_update_bitmap(rp, block, count, 1);
+	if (code == LOG_BFREE_ON_UNIFY)
+		return defer_bfree(&rp->sb->deunify, block, count);
+	return replay_update_bitmap(rp, block, count, 0);
+}
+
 static int replay_log_stage2(struct replay *rp, struct buffer_head *logbuf)
 {
 	if(DEBUG_MODE_K==1)
@@ -368,6 +503,7 @@ static int replay_log_stage2(struct replay *rp, struct buffer_head *logbuf)
 	struct logblock *log = bufdata(logbuf);
 	block_t blocknr = rp->blocknrs[bufindex(logbuf)];
 	unsigned char *data = log->data;
+	unsigned char *end = log->data + be16_to_cpu(log->bytes);
 	int err;
 
 	/*
@@ -391,7 +527,7 @@ static int replay_log_stage2(struct replay *rp, struct buffer_head *logbuf)
 	if (bufindex(logbuf) == rp->unify_index)
 		data = rp->unify_pos;
 
-	while (data < log->data + be16_to_cpu(log->bytes)) {
+	while (data < end) {
 		u8 code = *data++;
 		switch (code) {
 		case LOG_BALLOC:
@@ -400,21 +536,29 @@ static int replay_log_stage2(struct replay *rp, struct buffer_head *logbuf)
 		case LOG_BFREE_RELOG:
 		{
 			u64 block;
-			u32 count;
-			data = decode32(data, &count);
-			data = decode48(data, &block);
-			trace("%s: count %u, block %Lx",
-			      log_name[code], count, block);
-
-			err = 0;
-			if (code == LOG_BALLOC)
-				err = replay_update_bitmap(rp, block, count, 1);
-			else if (code == LOG_BFREE_ON_UNIFY)
-				defer_bfree(&sb->deunify, block, count);
-			else
-				err = replay_update_bitmap(rp, block, count, 0);
-			if (err)
-				return err;
+			unsigned count;
+
+			if (!log_compact(log)) {
+				data = decode32(data, &count);
+				data = decode48(data, &block);
+				err = replay_extent(rp, code, block, count);
+				if (err)
+					return err;
+			} else {
+				unsigned nr = *data++;
+				block_t prev = 0;
+
+				/* Entry was checked by replay_check_log() */
+				while (nr--) {
+					data = log_decode_extent(data, end,
+								 &prev, &block,
+								 &count);
+					err = replay_extent(rp, code, block,
+							    count);
+					if (err)
+						return err;
+				}
+			}
 			break;
 		}
 		case LOG_LEAF_REDIRECT:
@@ -517,13 +661,61 @@ static int replay_log_stage2(struct replay *rp, struct buffer_head *logbuf)
 				return err;
 			break;
 		}
+		case LOG_FSYNC_DATA:
+		{
+			struct fsync_redo redo = { .code = code, };
+			u64 index, block;
+			data = decode16(data, &redo.count);
+			data = decode48(data, &redo.inum);
+			data = decode48(data, &index);
+			data = decode48(data, &block);
+			trace("%s: inum 0x%Lx, index 0x%Lx, block %Lx, count %u",
+			      log_name[code], redo.inum, index, block,
+			      redo.count);
+			redo.index = index;
+			redo.block = block;
+			/* Copy is used until next delta, or redo */
+			err = replay_update_bitmap(rp, redo.block, redo.count, 1);
+			if (err)
+				return err;
+			err = fsync_redo_add(rp, &redo);
+			if (err)
+				return err;
+			break;
+		}
+		case LOG_FSYNC_ATTR:
+		{
+			struct fsync_redo redo = { .code = code, };
+			u64 size, sec, csec;
+			unsigned nsec, cnsec;
+			data = decode48(data, &redo.inum);
+			data = decode64(data, &size);
+			data = decode64(data, &sec);
+			data = decode32(data, &nsec);
+			data = decode64(data, &csec);
+			data = decode32(data, &cnsec);
+			trace("%s: inum 0x%Lx, size %Lu", log_name[code],
+			      redo.inum, size);
+			redo.size = size;
+			redo.mtime.tv_sec = sec;
+			redo.mtime.tv_nsec = nsec;
+			redo.ctime.tv_sec = csec;
+			redo.ctime.tv_nsec = cnsec;
+			err = fsync_redo_add(rp, &redo);
+			if (err)
+				return err;
+			break;
+		}
+		case LOG_DELTA:
+			/* Fast fsync logs before this were committed */
+			fsync_redo_discard(&rp->fsync_redo);
+			break;
 		case LOG_FREEBLOCKS:
 		case LOG_BNODE_ADD:
 		case LOG_BNODE_UPDATE:
 		case LOG_BNODE_DEL:
 		case LOG_BNODE_ADJUST:
 		case LOG_UNIFY:
-		case LOG_DELTA:
 			data += log_size[code] - sizeof(code);
 			break;
 		default:
@@ -588,6 +780,11 @@ int replay_stage2(struct replay *rp)
 	if (err)
 		goto error;
 
+	/* Apply bitmap updates queued by replay_log_stage2() */
+	err = replay_apply_bitmap(rp);
+	if (err)
+		goto error;
+
 	/*
 	 * Load orphan inodes into sb->orphan_add to decide what to do
 	 * by caller.
@@ -604,6 +801,99 @@ error:
 	return err;
 }
 
+/* Read copy of data into page cache, and dirty it as frontend write */
+static int fsync_redo_data(struct inode *inode, struct fsync_redo *redo)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(inode->i_sb);
+	unsigned delta = tux3_get_current_delta();
+	unsigned i;
+
+	for (i = 0; i < redo->count; i++) {
+		struct buffer_head *buffer, *clone;
+		int err;
+
+		buffer = blockget(mapping(inode), redo->index + i);
+		if (!buffer)
+			return -ENOMEM;
+
+		err = blockio(READ, sb, buffer, redo->block + i);
+		if (err) {
+			blockput(buffer);
+			return err;
+		}
+		set_buffer_uptodate(buffer);
+
+		/* No other users yet, blockdirty() should never fail */
+		clone = blockdirty(buffer, delta);
+		if (IS_ERR(clone)) {
+			blockput(buffer);
+			return PTR_ERR(clone);
+		}
+		mark_buffer_dirty_non(clone);
+		blockput(clone);
+	}
+
+	/* The copy is not needed after next delta */
+	return defer_bfree(&sb->fsync_blocks, redo->block, redo->count);
+}
+
+static int fsync_redo_apply(struct sb *sb, struct fsync_redo *redo)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct inode *inode;
+	int err = 0;
+
+	inode = tux3_iget(sb, redo->inum);
+	if (IS_ERR(inode)) {
+		tux3_err(sb, "failed to load inode %Lu for fsync redo",
+			 redo->inum);
+		return PTR_ERR(inode);
+	}
+
+	change_begin(sb);
+	if (redo->code == LOG_FSYNC_DATA)
+		err = fsync_redo_data(inode, redo);
+	else {
+		tux3_iattrdirty(inode);
+		i_size_write(inode, redo->size);
+		inode->i_mtime = redo->mtime;
+		inode->i_ctime = redo->ctime;
+		tux3_mark_inode_dirty(inode);
+	}
+	change_end(sb);
+
+	iput(inode);
+
+	return err;
+}
+
+/* Redo fast fsync logs, next delta commit will write those */
+static int replay_fsync_redo(struct sb *sb, struct list_head *head)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct fsync_redo *redo;
+	int err = 0;
+
+	list_for_each_entry(redo, head, list) {
+		err = fsync_redo_apply(sb, redo);
+		if (err)
+			break;
+	}
+	fsync_redo_discard(head);
+
+	return err;
+}
+
 /*
  * Replay pending frontend request like orphan, etc. I.e. this starts
  * to modify FS.
@@ -616,12 +906,21 @@ int replay_stage3(struct replay *rp, int apply)
 	}
 	struct sb *sb = rp->sb;
 	LIST_HEAD(orphan_in_otree);
+	LIST_HEAD(fsync_redo);
+	int err = 0;
 
 	list_splice_init(&rp->orphan_in_otree, &orphan_in_otree);
+	list_splice_init(&rp->fsync_redo, &fsync_redo);
 	replay_done(rp);
 	/* Start logging after replay_done() */
 
+	/* Redo fast fsync before orphan inodes may be destroyed */
+	if (apply)
+		err = replay_fsync_redo(sb, &fsync_redo);
+	else
+		fsync_redo_discard(&fsync_redo);
+
 	replay_iput_orphan_inodes(sb, &orphan_in_otree, apply);
 
-	return 0;
+	return err;
 }
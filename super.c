@@ -12,6 +12,7 @@
 #ifdef __KERNEL__
 #include <linux/module.h>
 #include <linux/statfs.h>
+#include <linux/parser.h>
 #include "kcompat.h"
 
 /* This will go to include/linux/magic.h */
@@ -104,7 +105,7 @@ static void cleanup_dirty_for_umount(struct sb *sb)
 	clean_orphan_list(&sb->orphan_del);
 
 	/* defree must be flushed for each delta */
-	assert(flink_empty(&sb->defree.head)||flink_is_last(&sb->defree.head));
+	assert(RB_EMPTY_ROOT(&sb->defree.root));
 }
 
 static void __tux3_put_super(struct sb *sbi)
@@ -113,6 +114,9 @@ static void __tux3_put_super(struct sb *sbi)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
+	/* Wait the commit block of last delta */
+	tux3_wait_commit_work(sbi);
+
 	cleanup_dirty_for_umount(sbi);
 
 	/* All forked buffers should be freed here */
@@ -120,6 +124,7 @@ static void __tux3_put_super(struct sb *sbi)
 
 	destroy_defer_bfree(&sbi->deunify);
 	destroy_defer_bfree(&sbi->defree);
+	destroy_defer_bfree(&sbi->fsync_blocks);
 
 	iput(sbi->rootdir);
 	sbi->rootdir = NULL;
@@ -139,6 +144,13 @@ static void __tux3_put_super(struct sb *sbi)
 
 	/* FIXME: add more sanity check */
 	assert(list_empty(&sbi->alloc_inodes));
+	free_inum_index(sbi);
+	free_atom_hash(sbi);
+	/* Can't purge on read-only or after error, orphan replay resumes it */
+	if (atomic_read(&sbi->purging_inodes)) {
+		tux3_warn(sbi, "%d dead inodes are not purged yet",
+			  atomic_read(&sbi->purging_inodes));
+	}
 	assert(link_empty(&sbi->forked_buffers));
 }
 
@@ -306,6 +318,15 @@ static void tux3_inode_init_always(struct tux3_inode *tuxnode)
 
 	tuxnode->btree		= (struct btree){ };
 	tuxnode->present	= 0;
+	tuxnode->dx_root	= 0;
+	tuxnode->ialloc_goal	= 0;
+	tuxnode->dir_space	= NULL;
+	atomic_set(&tuxnode->dir_space_stale, 0);
+	tuxnode->statahead	= 0;
+	tuxnode->sa_entries	= 0;
+	tuxnode->sa_hits	= 0;
+	tuxnode->inline_data	= NULL;
+	tuxnode->inline_size	= 0;
 	tuxnode->xcache		= NULL;
 	tuxnode->flags		= 0;
 #ifdef __KERNEL__
@@ -426,8 +447,9 @@ static int tux3_sync_fs(struct super_block *sb, int wait)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	/* FIXME: We should support "wait" parameter. */
-	trace_on("wait (%u) parameter is unsupported for now", wait);
+	/* If !wait, just start the commit. Waiters are coalesced per delta */
+	if (!wait)
+		return kick_delta(tux_sb(sb));
 	return force_delta(tux_sb(sb));
 }
 #endif
@@ -487,6 +509,133 @@ static const struct super_operations tux3_super_ops = {
 	.statfs		= tux3_statfs,
 };
 
+enum {
+	Opt_dleaf3, Opt_dirindex, Opt_inline, Opt_xvalue,
+	Opt_delta_max_kb, Opt_delta_max_inodes, Opt_delta_max_changes,
+	Opt_delta_max_age, Opt_delta_max_logkb,
+	Opt_unify_min_logblocks, Opt_unify_max_logblocks, Opt_err,
+};
+
+static const match_table_t tux3_tokens = {
+	{Opt_dleaf3, "dleaf3"},
+	{Opt_dirindex, "dirindex"},
+	{Opt_inline, "inline"},
+	{Opt_xvalue, "xvalue"},
+	{Opt_delta_max_kb, "delta_max_kb=%u"},
+	{Opt_delta_max_inodes, "delta_max_inodes=%u"},
+	{Opt_delta_max_changes, "delta_max_changes=%u"},
+	{Opt_delta_max_age, "delta_max_age=%u"},
+	{Opt_delta_max_logkb, "delta_max_logkb=%u"},
+	{Opt_unify_min_logblocks, "unify_min_logblocks=%u"},
+	{Opt_unify_max_logblocks, "unify_max_logblocks=%u"},
+	{Opt_err, NULL},
+};
+
+/*
+ * Parse mount options. Options to enable new format set the flag to
+ * sb->super, and it is written by next commit. Once set, the flag
+ * can't be cleared, because data may be using the format.
+ *
+ * Limit options override defaults set by init_sb(), see need_delta()
+ * and need_unify(). delta_max_age is in seconds.
+ */
+static int tux3_parse_options(struct sb *sbi, char *options, int rdonly)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	substring_t args[MAX_OPT_ARGS];
+	u64 flags = 0;
+	char *p;
+	int val;
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+
+		switch (match_token(p, tux3_tokens, args)) {
+		case Opt_dleaf3:
+			flags |= TUX3_FLAG_DLEAF3;
+			break;
+		case Opt_dirindex:
+			flags |= TUX3_FLAG_DIRINDEX;
+			break;
+		case Opt_inline:
+			flags |= TUX3_FLAG_INLINE;
+			break;
+		case Opt_xvalue:
+			flags |= TUX3_FLAG_XVALUE;
+			break;
+		case Opt_delta_max_kb:
+			if (match_int(args, &val) || val <= 0)
+				goto error_value;
+			sbi->delta_max_bytes = (u64)val << 10;
+			sbi->dirty_max_bytes = 2 * sbi->delta_max_bytes;
+			break;
+		case Opt_delta_max_inodes:
+			if (match_int(args, &val) || val <= 0)
+				goto error_value;
+			sbi->delta_max_inodes = val;
+			break;
+		case Opt_delta_max_changes:
+			if (match_int(args, &val) || val <= 0)
+				goto error_value;
+			sbi->delta_max_changes = val;
+			break;
+		case Opt_delta_max_age:
+			if (match_int(args, &val) || val <= 0)
+				goto error_value;
+			sbi->delta_max_age = (unsigned long)val * HZ;
+			break;
+		case Opt_delta_max_logkb:
+			if (match_int(args, &val) || val <= 0)
+				goto error_value;
+			sbi->delta_max_logbytes = (u64)val << 10;
+			break;
+		case Opt_unify_min_logblocks:
+			if (match_int(args, &val) || val < 0)
+				goto error_value;
+			sbi->unify_min_logblocks = val;
+			break;
+		case Opt_unify_max_logblocks:
+			if (match_int(args, &val) || val <= 0)
+				goto error_value;
+			sbi->unify_max_logblocks = val;
+			break;
+		default:
+			tux3_err(sbi, "unrecognized mount option \"%s\"", p);
+			return -EINVAL;
+		}
+	}
+
+	if (sbi->unify_min_logblocks > sbi->unify_max_logblocks) {
+		tux3_err(sbi, "unify_min_logblocks %u is over unify_max_logblocks %u",
+			 sbi->unify_min_logblocks, sbi->unify_max_logblocks);
+		return -EINVAL;
+	}
+
+	/* Enable only new flags */
+	flags &= ~be64_to_cpu(sbi->super.flags);
+	if (flags) {
+		if (rdonly) {
+			tux3_err(sbi, "can't enable format flags %Lx on read-only mount",
+				 flags);
+			return -EROFS;
+		}
+		sbi->super.flags |= cpu_to_be64(flags);
+	}
+
+	return 0;
+
+error_value:
+	tux3_err(sbi, "bad value for mount option \"%s\"", p);
+	return -EINVAL;
+}
+
 static int tux3_fill_super(struct super_block *sb, void *data, int silent)
 {
 	if(DEBUG_MODE_K==1)
@@ -526,7 +675,7 @@ static int tux3_fill_super(struct super_block *sb, void *data, int silent)
 			if (err == -EINVAL)
 				tux3_err(sbi, "invalid superblock [%Lx]",
 				     be64_to_cpup((__be64 *)sbi->super.magic));
-			else
+			else if (err != -EOPNOTSUPP)
 				tux3_err(sbi, "unable to read superblock");
 		}
 		goto error;
@@ -540,6 +689,10 @@ static int tux3_fill_super(struct super_block *sb, void *data, int silent)
 	}
 	tux3_dbg("s_blocksize %lu", sb->s_blocksize);
 
+	err = tux3_parse_options(sbi, data, sb->s_flags & MS_RDONLY);
+	if (err)
+		goto error;
+
 	rp = tux3_init_fs(sbi);
 	if (IS_ERR(rp)) {
 		err = PTR_ERR(rp);
@@ -581,12 +734,40 @@ static struct dentry *tux3_mount(struct file_system_type *fs_type, int flags,
 	return mount_bdev(fs_type, flags, dev_name, data, tux3_fill_super);
 }
 
+static void tux3_kill_sb(struct super_block *sb)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sbi = tux_sb(sb);
+
+	/*
+	 * Dead inodes purged by chunk over deltas are pinned until
+	 * purge is done. Run deltas to finish those, before umount
+	 * evicts inodes.
+	 */
+	if (sbi && sb->s_root) {
+		while (atomic_read(&sbi->purging_inodes) &&
+		       !(sb->s_flags & MS_RDONLY)) {
+			int err = sync_filesystem(sb);
+			if (err) {
+				tux3_err(sbi, "couldn't purge dead inodes (err %d)",
+					 err);
+				break;
+			}
+		}
+	}
+
+	kill_block_super(sb);
+}
+
 static struct file_system_type tux3_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= "tux3",
 	.fs_flags	= FS_REQUIRES_DEV,
 	.mount		= tux3_mount,
-	.kill_sb	= kill_block_super,
+	.kill_sb	= tux3_kill_sb,
 };
 
 static int __init init_tux3(void)
@@ -597,6 +778,15 @@ static int __init init_tux3(void)
 	}
 	int err;
 
+#ifdef TUX3_SELFTEST
+	err = dleaf3_selftest();
+	if (err)
+		goto error;
+	err = dx_selftest();
+	if (err)
+		goto error;
+#endif
+
 	err = tux3_init_inodecache();
 	if (err)
 		goto error;
@@ -605,6 +795,14 @@ static int __init init_tux3(void)
 	if (err)
 		goto error_hole;
 
+	err = tux3_init_cursor_cache();
+	if (err)
+		goto error_cursor;
+
+	err = tux3_init_commit_wq();
+	if (err)
+		goto error_commit;
+
 	err = register_filesystem(&tux3_fs_type);
 	if (err)
 		goto error_fs;
@@ -612,9 +810,13 @@ static int __init init_tux3(void)
 	return 0;
 
 error_fs:
-	tux3_destroy_inodecache();
-error_hole:
+	tux3_destroy_commit_wq();
+error_commit:
+	tux3_destroy_cursor_cache();
+error_cursor:
 	tux3_destroy_hole_cache();
+error_hole:
+	tux3_destroy_inodecache();
 error:
 	return err;
 }
@@ -626,6 +828,8 @@ static void __exit exit_tux3(void)
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	unregister_filesystem(&tux3_fs_type);
+	tux3_destroy_commit_wq();
+	tux3_destroy_cursor_cache();
 	tux3_destroy_hole_cache();
 	tux3_destroy_inodecache();
 }
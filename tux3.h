@@ -15,6 +15,9 @@
 #include <linux/slab.h>
 #include <linux/xattr.h>
 #include <linux/list_sort.h>
+#include <linux/sort.h>
+#include <linux/hash.h>
+#include <linux/rbtree.h>
 
 #include "newDefines.h"
 
@@ -83,6 +86,39 @@ static inline void *decode48(void *at, u64 *val)
 	return at;
 }
 
+/* Variable length integer, 7 bits per byte, little endian */
+#define VARINT_MAX		10	/* Max bytes of encoded u64 */
+
+static inline void *encode_varint(void *at, u64 val)
+{
+	unsigned char *p = at;
+
+	while (val >= 0x80) {
+		*p++ = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+	*p++ = val;
+	return p;
+}
+
+/* Return NULL if encoding doesn't end before end, or is too long */
+static inline void *decode_varint(void *at, void *end, u64 *val)
+{
+	unsigned char *p = at, *limit = end;
+	unsigned shift = 0;
+
+	if (limit - p > VARINT_MAX)
+		limit = p + VARINT_MAX;
+	*val = 0;
+	do {
+		if (p >= limit)
+			return NULL;
+		*val |= (u64)(*p & 0x7f) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+	return p;
+}
+
 /* Tux3 disk format */
 
 /*
@@ -99,17 +135,25 @@ static inline void *decode48(void *at, u64 *val)
  * 2012-02-16: Update for atomic commit
  * 2012-07-02: Use timestamp 32.32 fixed point. Increase log_balloc size.
  * 2012-12-20: Add ->usedinodes
+ * 2026-10-18: Add ->flags formats, xattr value slots, logblock->flags
  */
-#define TUX3_MAGIC		{ 't', 'u', 'x', '3', 0x20, 0x12, 0x12, 0x20 }
+#define TUX3_MAGIC		{ 't', 'u', 'x', '3', 0x20, 0x26, 0x10, 0x18 }
 #define TUX3_MAGIC_STR					\
 	((typeof(((struct disksuper *)0)->magic))TUX3_MAGIC)
+/* Previous format, still mountable. Upgraded to TUX3_MAGIC on commit */
+#define TUX3_MAGIC_OLD		{ 't', 'u', 'x', '3', 0x20, 0x12, 0x12, 0x20 }
+#define TUX3_MAGIC_OLD_STR				\
+	((typeof(((struct disksuper *)0)->magic))TUX3_MAGIC_OLD)
 
+/* Old logblock has zero padding at ->flags, so it reads as !LOGBLOCK_COMPACT */
 #define TUX3_MAGIC_LOG		0x10ad
 #define TUX3_MAGIC_BNODE	0xb4de
 #define TUX3_MAGIC_DLEAF	0x1eaf
 #define TUX3_MAGIC_DLEAF2	0xbeaf
+#define TUX3_MAGIC_DLEAF3	0xceaf
 #define TUX3_MAGIC_ILEAF	0x90de
 #define TUX3_MAGIC_OLEAF	0x6eaf
+#define TUX3_MAGIC_DXNODE	0xd1de
 
 /* Number of available inum ("0" - "((1 << 48) - 1)") */
 #define MAX_INODES_BITS		48
@@ -135,11 +179,21 @@ static inline void *decode48(void *at, u64 *val)
 #define TUX_INVALID_INO		63	/* FIXME: just for debugging */
 #define TUX_NORMAL_INO		64	/* until this ino, reserved ino */
 
+/* disksuper->flags */
+#define TUX3_FLAG_DLEAF3	(1ULL << 0)	/* New dtree leaves are dleaf3 */
+#define TUX3_FLAG_DIRINDEX	(1ULL << 1)	/* Index big directories */
+#define TUX3_FLAG_INLINE	(1ULL << 2)	/* Small file data in inode */
+#define TUX3_FLAG_XVALUE	(1ULL << 3)	/* Large xattr values in atable */
+/* Flags supported by this code. Mount is refused if other flag is set */
+#define TUX3_FLAGS_SUPPORTED	\
+	(TUX3_FLAG_DLEAF3 | TUX3_FLAG_DIRINDEX | TUX3_FLAG_INLINE |	\
+	 TUX3_FLAG_XVALUE)
+
 struct disksuper {
 	/* Update magic on any incompatible format change */
 	char magic[8];		/* Contains TUX3_LABEL magic string */
 	__be64 birthdate;	/* Volume creation date */
-	__be64 flags;		/* Need to assign some flags */
+	__be64 flags;		/* TUX3_FLAG_* */
 	__be16 blockbits;	/* Shift to get volume block size */
 	__be16 unused[3];	/* Padding for alignment */
 	__be64 volblocks;	/* Volume size */
@@ -161,6 +215,8 @@ struct disksuper {
 	__be32 atomgen;		/* Next atom number if there are no free atoms */
 	__be64 logchain;	/* Most recent delta commit block pointer */
 	__be32 logcount;	/* Count of log blocks in the current log chain */
+	__be32 freexvalue;	/* Beginning of free xattr value slot list */
+	__be32 xvaluegen;	/* Last xattr value slot allocated */
 } __packed;
 
 struct root {
@@ -170,6 +226,7 @@ struct root {
 
 struct btree {
 	struct rw_semaphore lock;
+	seqcount_t seq;		/* Bumped by writers to validate lockless readers */
 	struct sb *sb;		/* Convenience to reduce parameter list size */
 	struct btree_ops *ops;	/* Generic btree low level operations */
 	struct root root;	/* Cached description of btree root */
@@ -196,8 +253,12 @@ struct cursor {
 #ifdef CURSOR_DEBUG
 #define FREE_BUFFER	((void *)0xdbc06505)
 #define FREE_NEXT	((void *)0xdbc06507)
-	int maxlevel;
 #endif
+	int maxlevel;			/* Last level of ->path[] */
+#define CURSOR_FROM_CACHE	0	/* from tux_cursor_cachep */
+#define CURSOR_FROM_MALLOC	1	/* from malloc(), for deep btree */
+#define CURSOR_ON_STACK		2	/* struct cursor_stack on caller */
+	int origin;
 	int level;
 	struct path_level {
 		struct buffer_head *buffer;
@@ -205,7 +266,18 @@ struct cursor {
 	} path[];
 };
 
-struct stash { struct flink_head head; u64 *pos, *top; };
+/* Number of path levels in cursor from cache, enough for usual btree */
+#define CURSOR_CACHE_LEVELS	8
+/* Number of path levels in cursor on stack, for shallow btree */
+#define CURSOR_STACK_LEVELS	4
+
+struct cursor_stack {
+	struct cursor cursor;
+	struct path_level path[CURSOR_STACK_LEVELS];
+};
+
+/* Sorted and merged block extents (see defer_bfree()) */
+struct stash { struct rb_root root; unsigned count; };
 
 /* Flush synchronously */
 #define TUX3_FLUSHER_SYNC		1
@@ -226,6 +298,11 @@ struct delta_ref {
 /* Per-delta data structure for sb */
 struct sb_delta_dirty {
 	struct list_head dirty_inodes;	/* dirty inodes list */
+	unsigned dirty_count;		/* number of dirty_inodes */
+	atomic_t dirty_blocks;		/* number of dirtied buffers */
+	atomic_t changes;		/* number of change_end() */
+	atomic_t log_blocks;		/* log blocks written by fast fsync */
+	unsigned long start;		/* jiffies when delta was started */
 };
 
 /* Tux3-specific sb is a handle for the entire volume state */
@@ -245,12 +322,15 @@ struct sb {
 
 #define TUX3_COMMIT_RUNNING_BIT		0
 #define TUX3_COMMIT_PENDING_BIT		1
+#define TUX3_COMMIT_WRITING_BIT		2
+#define TUX3_COMMIT_ERROR_BIT		3	/* some delta failed to commit */
 	unsigned long backend_state;		/* delta state */
 #ifdef UNIFY_DEBUG
 	struct delta_ref *pending_delta;	/* pending delta for commit */
 #endif
 	unsigned marshal_delta;			/* marshaling delta */
 	unsigned committed_delta;		/* committed delta */
+	unsigned sync_delta;			/* latest delta sync was started */
 	wait_queue_head_t delta_event_wq;	/* wait queue for delta event */
 #if TUX3_FLUSHER == TUX3_FLUSHER_ASYNC_OWN
 	struct task_struct *flush_task;		/* work to flush delta */
@@ -278,9 +358,15 @@ struct sb {
 
 	unsigned atomref_base;	/* Index of atom refcount base */
 	unsigned unatom_base;	/* Index of unatom base */
+	unsigned xvalue_base;	/* Index of xattr value slots base */
 	loff_t atomdictsize;	/* Atom dictionary size */
 	unsigned freeatom;	/* Start of free atom list in atom table */
 	unsigned atomgen;	/* Next atom number to allocate if no free atoms */
+	spinlock_t atom_hash_lock; /* lock for atom_hash */
+	struct hlist_head *atom_hash; /* name => atom hash (see xattr.c) */
+	struct mutex xvalue_lock; /* lock for freexvalue and xvaluegen */
+	unsigned freexvalue;	/* Start of free xattr value slot list */
+	unsigned xvaluegen;	/* Last xattr value slot allocated */
 
 	/*
 	 * For backend only
@@ -289,28 +375,52 @@ struct sb {
 	unsigned lognext;	/* Index of next log block in log map */
 	struct buffer_head *logbuf; /* Cached log block */
 	unsigned char *logpos, *logtop; /* Where to emit next log entry */
+	unsigned logcontig;	/* ->logcontig of logblock at super.logchain */
+	unsigned char *logext;	/* Last compact extent record on ->logbuf */
+	unsigned char *logext_end; /* End of ->logext record */
+	block_t logext_prev;	/* End block of last extent in ->logext */
 
 	struct list_head orphan_add; /* defered orphan inode add list */
 	struct list_head orphan_del; /* defered orphan inode del list */
+	atomic_t purging_inodes; /* dead inodes freeing dtree over deltas */
 
 	struct stash defree;	/* defer extent frees until after delta */
 	struct stash deunify;	/* defer extent frees until after unify */
+	struct stash fsync_blocks; /* data copies of fast fsync */
+	unsigned fsync_max_blocks; /* max dirty blocks to use fast fsync */
 
 	struct list_head unify_buffers; /* dirty metadata flushed at unify */
+	unsigned unify_buffers_count;	/* number of buffers on unify_buffers */
+	/* Bounds of log blocks to replay, to decide unify */
+	unsigned unify_min_logblocks;	/* don't unify under this */
+	unsigned unify_max_logblocks;	/* always unify over this */
 
 	struct iowait *iowait;		/* helper for waiting I/O */
+	struct iowait commit_iowait;	/* I/O of delta before commit block */
+	struct work_struct commit_work;	/* write commit block, and finish */
+	unsigned commit_delta;		/* delta of commit_work */
 
 	/*
 	 * For frontend and backend
 	 */
 	struct list_head alloc_inodes;	/* deferred inum allocation inodes */
+	struct radix_tree_root inum_index; /* in-memory index of used inums */
 
 	spinlock_t forked_buffers_lock;
 	struct link forked_buffers;	/* forked buffers list */
+	atomic_t forked_count;		/* number of forked_buffers */
 
 	spinlock_t dirty_inodes_lock;	/* lock of dirty_inodes for frontend */
 	/* Per-delta dirty data for sb */
 	struct sb_delta_dirty s_ddc[TUX3_MAX_DELTA];
+	/* Limits of delta, exceeding one of them starts delta transition */
+	u64 delta_max_bytes;		/* dirty bytes */
+	unsigned delta_max_inodes;	/* dirty inodes */
+	unsigned delta_max_changes;	/* change_begin/end pairs */
+	unsigned long delta_max_age;	/* jiffies since delta was started */
+	u64 delta_max_logbytes;		/* log bytes written by fast fsync */
+	/* Limit of dirty state, writers are throttled over half of this */
+	u64 dirty_max_bytes;
 #ifdef __KERNEL__
 	struct super_block *vfs_sb;	/* Generic kernel superblock */
 #else
@@ -341,11 +451,20 @@ struct block_segment {
 struct logblock {
 	__be16 magic;		/* Magic number */
 	__be16 bytes;		/* Total data bytes on this block */
-	u32 unused;		/* padding */
+	__be16 flags;		/* Format of log entries (LOGBLOCK_*) */
+	__be16 logcontig;	/* Previous logblocks at block - 1, - 2, ... */
 	__be64 logchain;	/* Block number to previous logblock */
 	unsigned char data[];	/* Log data */
 };
 
+/* LOG_BALLOC and LOG_BFREE* are delta-coded extent lists */
+#define LOGBLOCK_COMPACT	(1 << 0)
+
+static inline int log_compact(struct logblock *log)
+{
+	return !!(be16_to_cpu(log->flags) & LOGBLOCK_COMPACT);
+}
+
 enum {
 	LOG_BALLOC = 0x33,	/* Log of block allocation */
 	LOG_BFREE,		/* Log of freeing block after delta */
@@ -366,7 +485,9 @@ enum {
 	LOG_ORPHAN_DEL,		/* Log of deleting orphan inode */
 	LOG_FREEBLOCKS,		/* Log of freeblocks in bitmap on unify */
 	LOG_UNIFY,		/* Log of marking unify */
-	LOG_DELTA,		/* just for debugging */
+	LOG_DELTA,		/* Log of marking delta */
+	LOG_FSYNC_DATA,		/* Log of data copy by fast fsync */
+	LOG_FSYNC_ATTR,		/* Log of inode attributes by fast fsync */
 	LOG_TYPES
 };
 
@@ -402,12 +523,22 @@ struct inode_delta_dirty {
 };
 
 struct xcache;
+struct dir_space;
 struct tux3_inode {
 	struct btree btree;
 	inum_t inum;			/* Inode number */
 	struct xcache *xcache;		/* Extended attribute cache */
 	struct list_head alloc_list;	/* link for deferred inum allocation */
 	struct list_head orphan_list;	/* link for orphan inode list */
+	u32 dx_root;			/* Block of directory index root */
+	inum_t ialloc_goal;		/* Next inum goal for children */
+	struct dir_space *dir_space;	/* Free space map of directory */
+	atomic_t dir_space_stale;	/* Backend changed dirent blocks */
+	unsigned long statahead;	/* TUX3_SA_* of directory */
+	unsigned sa_entries;		/* Entries returned by readdir */
+	unsigned sa_hits;		/* Lookups of children after readdir */
+	void *inline_data;		/* Data of small file (under ->lock) */
+	unsigned inline_size;		/* Size of inline_data */
 
 	/* FIXME: we can use RCU for hole_extents? */
 	spinlock_t hole_extents_lock;	/* lock for hole_extents */
@@ -426,11 +557,28 @@ struct tux3_inode {
 	struct inode vfs_inode;
 };
 
+/* tux3_inode->statahead bits, see tux_readdir() */
+#define TUX3_SA_READDIR		0	/* readdir was done */
+#define TUX3_SA_STAT		1	/* lookup of child after readdir */
+/* Lookups of children after readdir to start statahead */
+#define TUX3_SA_MIN_HITS	8
+
 static inline struct tux3_inode *tux_inode(struct inode *inode)
 {
 	return container_of(inode, struct tux3_inode, vfs_inode);
 }
 
+/*
+ * Max size of regular file to keep data in inode attributes. This
+ * must be small enough to fit into ileaf with other attributes.
+ */
+static inline loff_t tux3_inline_max(struct sb *sb)
+{
+	if (!(sb->super.flags & cpu_to_be64(TUX3_FLAG_INLINE)))
+		return 0;
+	return sb->blocksize >> 3;
+}
+
 static inline struct inode *btree_inode(struct btree *btree)
 {
 	return &container_of(btree, struct tux3_inode, btree)->vfs_inode;
@@ -586,14 +734,21 @@ struct btree_ops {
 };
 
 /* Information for replay */
+/* Partitions of bitmap replay, applied in parallel */
+#define REPLAY_BITMAP_QUEUES	16
+
 struct replay {
 	struct sb *sb;
 
+	/* For balloc.c */
+	struct list_head bitmap_queue[REPLAY_BITMAP_QUEUES]; /* by bitmap page */
+
 	/* For orphan.c */
 	struct list_head log_orphan_add;   /* To remember LOG_ORPHAN_ADD */
 	struct list_head orphan_in_otree; /* Orphan inodes in sb->otree */
 
 	/* For replay.c */
+	struct list_head fsync_redo; /* LOG_FSYNC_* not committed by delta */
 	void *unify_pos;	/* position of unify log in a log block */
 	block_t unify_index;	/* index of a log block including unify log */
 	block_t blocknrs[];	/* block address of log blocks */
@@ -650,7 +805,10 @@ extern const struct inode_operations tux_dir_iops;
 int tux3_get_block(struct inode *inode, sector_t iblock,
 		   struct buffer_head *bh_result, int create);
 struct buffer_head *__get_buffer(struct page *page, int offset);
+void blockread_ahead(struct file *file, struct address_space *mapping,
+		     block_t iblock, block_t limit);
 void tux3_try_cancel_dirty_page(struct page *page);
+int tux3_inline_convert(struct inode *inode, loff_t newsize);
 int tux3_truncate_partial_block(struct inode *inode, loff_t newsize);
 void tux3_truncate_inode_pages_range(struct address_space *mapping,
 				     loff_t lstart, loff_t lend);
@@ -701,12 +859,18 @@ int balloc_partial(struct sb *sb, unsigned blocks,
 		   struct block_segment *seg, int segs);
 int bfree(struct sb *sb, block_t start, unsigned blocks);
 int replay_update_bitmap(struct replay *rp, block_t start, unsigned blocks, int set);
+int replay_apply_bitmap(struct replay *rp);
+void replay_discard_bitmap(struct replay *rp);
 
 /* btree.c */
 unsigned calc_entries_per_node(unsigned blocksize);
 struct buffer_head *cursor_leafbuf(struct cursor *cursor);
 void release_cursor(struct cursor *cursor);
+int tux3_init_cursor_cache(void);
+void tux3_destroy_cursor_cache(void);
 struct cursor *alloc_cursor(struct btree *btree, int);
+struct cursor *alloc_cursor_stack(struct btree *btree, int extra,
+				  struct cursor_stack *stack);
 void free_cursor(struct cursor *cursor);
 
 void init_btree(struct btree *btree, struct sb *sb, struct root root, struct btree_ops *ops);
@@ -716,6 +880,9 @@ struct buffer_head *new_leaf(struct btree *btree);
 tuxkey_t cursor_next_key(struct cursor *cursor);
 tuxkey_t cursor_this_key(struct cursor *cursor);
 int btree_probe(struct cursor *cursor, tuxkey_t key);
+void down_write_btree(struct btree *btree);
+void up_write_btree(struct btree *btree);
+int btree_read_lockless(struct cursor *cursor, struct btree_key_range *key);
 typedef int (*btree_traverse_func_t)(struct btree *btree, tuxkey_t key_bottom,
 				     tuxkey_t key_limit, void *leaf,
 				     tuxkey_t key, u64 len, void *data);
@@ -743,12 +910,17 @@ int replay_bnode_adjust(struct replay *rp, block_t bnode, tuxkey_t from, tuxkey_
 void setup_sb(struct sb *sb, struct disksuper *super);
 int load_sb(struct sb *sb);
 int save_sb(struct sb *sb);
-int apply_defered_bfree(struct sb *sb, u64 val);
+int apply_defered_bfree(struct sb *sb, block_t block, unsigned count);
 void tux3_start_backend(struct sb *sb);
 void tux3_end_backend(void);
 int tux3_under_backend(struct sb *sb);
+void tux3_wait_commit_work(struct sb *sb);
+int tux3_init_commit_wq(void);
+void tux3_destroy_commit_wq(void);
+int tux3_fast_fsync(struct inode *inode);
 int force_unify(struct sb *sb);
 int force_delta(struct sb *sb);
+int kick_delta(struct sb *sb);
 unsigned tux3_get_current_delta(void);
 unsigned tux3_inode_delta(struct inode *inode);
 void change_begin_atomic(struct sb *sb);
@@ -775,13 +947,17 @@ int tux_delete_entry(struct inode *dir, struct buffer_head *buffer,
 int tux_delete_dirent(struct inode *dir, struct buffer_head *buffer,
 		      tux_dirent *entry);
 int tux_readdir(struct file *file, void *state, filldir_t filldir);
+void tux_readdir_hit(struct inode *dir);
 int tux_dir_is_empty(struct inode *dir);
+void free_dir_space(struct inode *dir);
+int dx_selftest(void);
 
 /* dleaf.c */
 #include "dleaf.h"
 
 /* dleaf2.c */
 extern struct btree_ops dtree2_ops;
+int dleaf3_selftest(void);
 static inline struct btree_ops *dtree_ops(void)
 {
 	return &dtree2_ops;
@@ -823,11 +999,16 @@ struct inode *tux_create_inode(struct inode *dir, struct tux_iattr *iattr,
 			       dev_t rdev);
 struct inode *tux_create_specific_inode(struct inode *dir, inum_t inum,
 					struct tux_iattr *iattr, dev_t rdev);
+void free_inum_index(struct sb *sb);
 struct inode *tux3_iget(struct sb *sb, inum_t inum);
+void tux3_statahead(struct sb *sb, inum_t *inums, unsigned count);
 struct inode *tux3_ilookup_nowait(struct sb *sb, inum_t inum);
 struct inode *tux3_ilookup(struct sb *sb, inum_t inum);
 int tux3_save_inode(struct inode *inode, struct tux3_iattr_data *idata,
 		    unsigned delta);
+/* Max blocks of dead inode's dtree to free per delta */
+#define TUX3_PURGE_BLOCKS	(1 << 18)
+int tux3_purge_inode_step(struct inode *inode, struct tux3_iattr_data *idata);
 int tux3_purge_inode(struct inode *inode, struct tux3_iattr_data *idata,
 		     unsigned delta);
 int tux3_drop_inode(struct inode *inode);
@@ -836,6 +1017,9 @@ void iget_if_dirty(struct inode *inode);
 
 /* log.c */
 extern unsigned log_size[];
+unsigned log_entry_size(struct logblock *log, unsigned char *data);
+void *log_decode_extent(void *at, void *end, block_t *prev, u64 *block,
+			unsigned *count);
 void log_next(struct sb *sb);
 void log_drop(struct sb *sb);
 void log_finish(struct sb *sb);
@@ -863,10 +1047,13 @@ void log_orphan_del(struct sb *sb, unsigned version, tuxkey_t inum);
 void log_freeblocks(struct sb *sb, block_t freeblocks);
 void log_delta(struct sb *sb);
 void log_unify(struct sb *sb);
+void log_fsync_data(struct sb *sb, inum_t inum, block_t index, block_t block,
+		    unsigned count);
+void log_fsync_attr(struct sb *sb, inum_t inum, loff_t size,
+		    struct timespec mtime, struct timespec ctime);
 
-typedef int (*unstash_t)(struct sb *sb, u64 val);
+typedef int (*unstash_t)(struct sb *sb, block_t block, unsigned count);
 void stash_init(struct stash *stash);
-int stash_value(struct stash *stash, u64 value);
 int unstash(struct sb *sb, struct stash *defree, unstash_t actor);
 int stash_walk(struct sb *sb, struct stash *stash, unstash_t actor);
 int defer_bfree(struct stash *defree, block_t block, unsigned count);
@@ -932,8 +1119,10 @@ static inline void tux3_mark_inode_dirty_sync(struct inode *inode)
 void tux3_dirty_inode(struct inode *inode, int flags);
 void tux3_mark_inode_to_delete(struct inode *inode);
 void tux3_iattrdirty(struct inode *inode);
+int tux3_iattr_changed(struct inode *inode, unsigned delta);
 void tux3_xattrdirty(struct inode *inode);
-void tux3_xattr_read_and_clear(struct inode *inode);
+void tux3_xattr_read_and_clear(struct inode *inode, unsigned delta);
+int tux3_xattr_is_dirty(struct inode *inode);
 void tux3_clear_dirty_inode(struct inode *inode);
 void __tux3_mark_buffer_dirty(struct buffer_head *buffer, unsigned delta);
 void tux3_mark_buffer_dirty(struct buffer_head *buffer);
@@ -954,6 +1143,7 @@ void tux3_check_destroy_inode_flags(struct inode *inode);
 #include "compression.h"
 
 void atable_init_base(struct sb *sb);
+void free_atom_hash(struct sb *sb);
 int xcache_dump(struct inode *inode);
 void free_xcache(struct inode *inode);
 int new_xcache(struct inode *inode, unsigned size);
@@ -968,6 +1158,7 @@ unsigned encode_xsize(struct inode *inode);
 void *encode_xattrs(struct inode *inode, void *attrs, unsigned size);
 unsigned decode_xsize(struct inode *inode, void *attrs, unsigned size);
 void *decode_xattr(struct inode *inode, void *attrs);
+void *decode_xattr_ext(struct inode *inode, void *attrs);
 
 static inline struct buffer_head *vol_find_get_block(struct sb *sb, block_t block)
 {
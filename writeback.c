@@ -29,6 +29,7 @@
  * - delete dirty flags
  * - btree dirty
  * - inode is orphaned flag
+ * - inode is purging flag
  * - inode is dead flag
  * - inode is flushed own timing flag
  */
@@ -53,6 +54,8 @@
 
 /* btree root is modified from only backend, so no need per-delta flag */
 #define TUX3_DIRTY_BTREE	(1 << 28)
+/* the purging flag is set by only backend, so no need per-delta flag */
+#define TUX3_INODE_PURGING	(1 << 27)
 /* the orphaned flag is set by only backend, so no need per-delta flag */
 #define TUX3_INODE_ORPHANED	(1 << 29)
 /* the dead flag is set by only backend, so no need per-delta flag */
@@ -60,8 +63,9 @@
 /* If no-flush flag is set, tux3_flush_inodes() doesn't flush */
 #define TUX3_INODE_NO_FLUSH	(1 << 31)
 
-#define NON_DIRTY_FLAGS					\
-	(TUX3_INODE_ORPHANED | TUX3_INODE_DEAD | TUX3_INODE_NO_FLUSH)
+#define NON_DIRTY_FLAGS						\
+	(TUX3_INODE_PURGING | TUX3_INODE_ORPHANED | TUX3_INODE_DEAD |	\
+	 TUX3_INODE_NO_FLUSH)
 
 /*
  * If no-flush flag is set, tux3_flush_inodes() doesn't flush. Some
@@ -185,9 +189,11 @@ void tux3_dirty_inode(struct inode *inode, int flags)
 		if (s_ddc) {
 			spin_lock(&sb->dirty_inodes_lock);
 			was_clean = list_empty(&s_ddc->dirty_inodes);
-			if (list_empty(&i_ddc->dirty_list))
+			if (list_empty(&i_ddc->dirty_list)) {
 				list_add_tail(&i_ddc->dirty_list,
 					      &s_ddc->dirty_inodes);
+				s_ddc->dirty_count++;
+			}
 			spin_unlock(&sb->dirty_inodes_lock);
 		}
 	}
@@ -442,8 +448,9 @@ void tux3_mark_buffer_unify(struct buffer_head *buffer)
 	sb = tux_sb(inode->i_sb);
 	assert(inode == sb->volmap); /* must be volmap */
 
-	tux3_set_buffer_dirty_list(mapping(inode), buffer, sb->unify,
-				   &sb->unify_buffers);
+	if (tux3_set_buffer_dirty_list(mapping(inode), buffer, sb->unify,
+				       &sb->unify_buffers))
+		sb->unify_buffers_count++;
 	/*
 	 * FIXME: we don't call __tux3_mark_buffer_dirty() here, but
 	 * mark_buffer_dirty() marks inode as I_DIRTY_PAGES. This
@@ -470,6 +477,81 @@ int tux3_inode_is_orphan(struct tux3_inode *tuxnode)
 	return !!(tuxnode->flags & TUX3_INODE_ORPHANED);
 }
 
+/*
+ * Dead inode with huge dtree is purged by chunk over deltas. While
+ * purging, the inode is pinned, and is kept dirty for next delta.
+ */
+static void tux3_set_inode_purging(struct inode *inode)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct tux3_inode *tuxnode = tux_inode(inode);
+
+	/* Pin inode, evict_inodes() on umount must not free it */
+	spin_lock(&inode->i_lock);
+	iget_if_dirty(inode);
+	spin_unlock(&inode->i_lock);
+
+	spin_lock(&tuxnode->lock);
+	tuxnode->flags |= TUX3_INODE_PURGING;
+	spin_unlock(&tuxnode->lock);
+
+	atomic_inc(&tux_sb(inode->i_sb)->purging_inodes);
+}
+
+static void tux3_clear_inode_purging(struct inode *inode)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct tux3_inode *tuxnode = tux_inode(inode);
+
+	spin_lock(&tuxnode->lock);
+	tuxnode->flags &= ~TUX3_INODE_PURGING;
+	spin_unlock(&tuxnode->lock);
+
+	atomic_dec(&tux_sb(inode->i_sb)->purging_inodes);
+
+	/* Inode is still dirty for this delta, so this doesn't evict */
+	iput(inode);
+}
+
+static int tux3_inode_is_purging(struct inode *inode)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return !!(tux_inode(inode)->flags & TUX3_INODE_PURGING);
+}
+
+/* Mark purging inode dirty on frontend delta to flush it again */
+static void tux3_dirty_purging_inode(struct inode *inode)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(inode->i_sb);
+	void *ptr;
+
+	/* Backend is running, so use *_nested() to get frontend delta */
+	change_begin_atomic_nested(sb, &ptr);
+	/*
+	 * Hack: inode was unhashed already. So, like
+	 * __tux3_mark_inode_to_delete(), call internal ->dirty_inode()
+	 * and change inode->i_state directly.
+	 */
+	spin_lock(&inode->i_lock);
+	tux3_dirty_inode(inode, I_DIRTY_SYNC);
+	inode->i_state |= I_DIRTY_SYNC;
+	spin_unlock(&inode->i_lock);
+	change_end_atomic_nested(sb, ptr);
+}
+
 static void tux3_state_read_and_clear(struct inode *inode,
 				      struct tux3_iattr_data *idata,
 				      unsigned *orphaned, unsigned *deleted,
@@ -485,6 +567,7 @@ static void tux3_state_read_and_clear(struct inode *inode,
 
 	/* Get iattr data */
 	tux3_iattr_read_and_clear(inode, idata, delta);
+	tux3_xattr_read_and_clear(inode, delta);
 
 	/* Check orphan state */
 	*orphaned = 0;
@@ -500,6 +583,67 @@ static void tux3_state_read_and_clear(struct inode *inode,
 	spin_unlock(&tuxnode->lock);
 }
 
+/*
+ * Keep data of small regular file in inode attributes (inline data),
+ * instead of writing block into dtree. Dirty block 0 is copied to
+ * inline data, and removed from dirty buffers.
+ *
+ * If file grew, drop inline data. Block 0 was dirtied by
+ * tux3_inline_convert(), so it goes into dtree by usual flush.
+ *
+ * Return 1 if inline data was changed.
+ */
+static int tux3_flush_inline(struct inode *inode,
+			     struct tux3_iattr_data *idata, unsigned delta)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(inode->i_sb);
+	struct tux3_inode *tuxnode = tux_inode(inode);
+	struct list_head *dirty_buffers = tux3_dirty_buffers(inode, delta);
+	struct buffer_head *buffer, *block0 = NULL;
+	unsigned size = idata->i_size;
+	void *data = NULL, *old;
+
+	if (!S_ISREG(inode->i_mode))
+		return 0;
+
+	list_for_each_entry(buffer, dirty_buffers, b_assoc_buffers) {
+		if (bufindex(buffer))
+			goto drop;
+		block0 = buffer;
+	}
+	if (!size || size > tux3_inline_max(sb) || has_root(&tuxnode->btree))
+		goto drop;
+	/* Not changed. If i_size was truncated, encode trims it */
+	if (!block0)
+		return 0;
+
+	data = malloc(size);
+	if (!data)
+		goto drop;	/* Fallback to write block0 into dtree */
+	memcpy(data, bufdata(block0), size);
+
+	tux3_cancel_dirty_buffer(sb, block0);
+	goto change;
+
+drop:
+	if (!tuxnode->inline_data)
+		return 0;
+	size = 0;
+change:
+	spin_lock(&tuxnode->lock);
+	old = tuxnode->inline_data;
+	tuxnode->inline_data = data;
+	tuxnode->inline_size = size;
+	spin_unlock(&tuxnode->lock);
+	free(old);
+
+	return 1;
+}
+
 static inline int tux3_flush_buffers(struct inode *inode,
 				     struct tux3_iattr_data *idata,
 				     unsigned delta)
@@ -538,7 +682,7 @@ int tux3_flush_inode(struct inode *inode, unsigned delta)
 	/* FIXME: linux writeback doesn't allow to control writeback
 	 * timing. */
 	struct tux3_iattr_data idata;
-	unsigned dirty = 0, orphaned, deleted;
+	unsigned dirty = 0, orphaned, deleted, purging = 0, inline_dirty = 0;
 	int ret = 0, err;
 
 	/*
@@ -557,14 +701,29 @@ int tux3_flush_inode(struct inode *inode, unsigned delta)
 			if (err && !ret)
 				ret = err;
 		}
-	} else {
-		/* If orphaned on past delta, delete orphan */
-		if (!orphaned) {
-			err = tux3_make_orphan_del(inode);
-			if (err && !ret)
-				ret = err;
-		}
 
+		/* Free next chunk of dtree of dead inode */
+		if (tux3_inode_is_purging(inode)) {
+			err = tux3_purge_inode_step(inode, &idata);
+			if (err > 0)
+				purging = 1;
+			else if (err) {
+				/*
+				 * Keep purging state and orphan, replay
+				 * will retry to purge.
+				 */
+				if (!ret)
+					ret = err;
+			} else {
+				tux3_clear_inode_purging(inode);
+				err = tux3_make_orphan_del(inode);
+				if (err && !ret)
+					ret = err;
+				/* Inode was removed from itree, don't save */
+				deleted = 1;
+			}
+		}
+	} else {
 		/*
 		 * Remove from hash before deleting the inode from itree.
 		 * Otherwise, when inum is reused, this inode will be
@@ -574,22 +733,49 @@ int tux3_flush_inode(struct inode *inode, unsigned delta)
 
 		/* If inode was deleted and referencer was gone, delete inode */
 		err = tux3_purge_inode(inode, &idata, delta);
+		if (err > 0) {
+			/*
+			 * Purge continues on following deltas. Keep
+			 * orphan until purge is done, to allow replay to
+			 * finish it.
+			 */
+			tux3_set_inode_purging(inode);
+			purging = 1;
+			err = 0;
+			if (orphaned)
+				err = tux3_make_orphan_add(inode);
+		} else if (err) {
+			/* Keep orphan, replay will retry to purge */
+			if (orphaned)
+				tux3_make_orphan_add(inode);
+		} else if (!orphaned) {
+			/* If orphaned on past delta, delete orphan */
+			int err2 = tux3_make_orphan_del(inode);
+			if (!err)
+				err = err2;
+		}
 		if (err && !ret)
 			ret = err;
 	}
 
+	/* Take small file data into inode before flushing buffers */
+	if (!deleted)
+		inline_dirty = tux3_flush_inline(inode, &idata, delta);
+
 	err = tux3_flush_buffers(inode, &idata, delta);
 	if (err && !ret)
 		ret = err;
 
 	/*
 	 * Get flags after tux3_flush_buffers() to check TUX3_DIRTY_BTREE.
-	 * If inode is dead, we don't need to save inode.
+	 * If inode is dead, we don't need to save inode. But purging
+	 * inode has to save dtree root and size for each chunk.
 	 */
-	if (!deleted)
+	if (!deleted || purging)
 		dirty = tux3_dirty_flags(inode, delta);
 
-	if (dirty & (TUX3_DIRTY_BTREE | I_DIRTY_SYNC | I_DIRTY_DATASYNC)) {
+	if (inline_dirty ||
+	    dirty & (TUX3_DIRTY_BTREE | I_DIRTY_SYNC | I_DIRTY_DATASYNC)) {
 		/*
 		 * If there is btree root, adjust present after
 		 * tux3_flush_buffers().
@@ -601,6 +787,10 @@ int tux3_flush_inode(struct inode *inode, unsigned delta)
 			ret = err;
 	}
 
+	/* Continue to purge on next delta */
+	if (purging)
+		tux3_dirty_purging_inode(inode);
+
 	/* FIXME: In the error path, dirty state would still be
 	 * remaining, we have to do something. */
 
@@ -101,6 +101,43 @@ void tux3_iattrdirty(struct inode *inode)
 	spin_unlock(&tuxnode->lock);
 }
 
+/*
+ * Were iattrs other than i_size and timestamps changed on delta?
+ * (fast fsync logs only those)
+ */
+int tux3_iattr_changed(struct inode *inode, unsigned delta)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct tux3_inode *tuxnode = tux_inode(inode);
+	struct tux3_iattr_data *idata;
+	unsigned flags;
+	int changed = 0;
+
+	spin_lock(&tuxnode->lock);
+	flags = tuxnode->flags;
+	if (tux3_iattrsta_has_delta(flags) &&
+	    tux3_iattrsta_get_delta(flags) == tux3_delta(delta)) {
+		/* Iattrs before change on delta were forked to this slot */
+		idata = &tux3_inode_ddc(inode, delta - 1)->idata;
+		/* ->present is invalidated after backend read the slot */
+		if (idata->present != TUX3_INVALID_PRESENT &&
+		    idata->present != tuxnode->present)
+			changed = 1;
+		if (idata->i_mode != inode->i_mode ||
+		    idata->i_uid != i_uid_read(inode) ||
+		    idata->i_gid != i_gid_read(inode) ||
+		    idata->i_nlink != inode->i_nlink ||
+		    idata->i_rdev != inode->i_rdev)
+			changed = 1;
+	}
+	spin_unlock(&tuxnode->lock);
+
+	return changed;
+}
+
 /* Caller must hold tuxnode->lock */
 static void tux3_iattr_clear_dirty(struct tux3_inode *tuxnode)
 {
@@ -1,7 +1,13 @@
 /*
  * Xcache  Fork (Copy-On-Write of extended attributes)
+ *
+ * FIXME: xcache is not forked yet. For now, this only remembers the
+ * delta number when xattrs were dirtied, to tell fast fsync that
+ * xattrs were changed after last commit.
  */
 
+TUX3_DEFINE_STATE_FNS(unsigned, xattr, XATTR_DIRTY,
+		      IFLAGS_XATTR_BITS, IFLAGS_XATTR_SHIFT);
 
 void tux3_xattrdirty(struct inode *inode)
 {
@@ -9,12 +15,36 @@ void tux3_xattrdirty(struct inode *inode)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
+	struct tux3_inode *tuxnode = tux_inode(inode);
+	unsigned delta = tux3_inode_delta(inode);
+
+	spin_lock(&tuxnode->lock);
+	tuxnode->flags = tux3_xattrsta_update(tuxnode->flags, delta);
+	spin_unlock(&tuxnode->lock);
+}
+
+/* Caller must hold tuxnode->lock */
+void tux3_xattr_read_and_clear(struct inode *inode, unsigned delta)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct tux3_inode *tuxnode = tux_inode(inode);
+	unsigned flags = tuxnode->flags;
+
+	/* If dirtied again by later delta, keep it */
+	if (tux3_xattrsta_has_delta(flags) &&
+	    tux3_xattrsta_get_delta(flags) == tux3_delta(delta))
+		tuxnode->flags = tux3_xattrsta_clear(flags);
 }
 
-void tux3_xattr_read_and_clear(struct inode *inode)
+/* Were xattrs changed after last flush of inode? */
+int tux3_xattr_is_dirty(struct inode *inode)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
+	return tux3_xattrsta_has_delta(tux_inode(inode)->flags);
 }
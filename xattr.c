@@ -39,6 +39,14 @@
  *   = 2^35 revmap bytes = 2^23 4K blocks. This starts just above the count
  *   table, which puts it at logical offset 2^28 + 2^23, leaving a gap after
  *   the count table in case we decide 32 bits of ref count is not enough.
+ *
+ * Xattr value slots:
+ *
+ * * If TUX3_FLAG_XVALUE is set, xattr values bigger than an eighth of a
+ *   block are not kept in the inode attributes. Instead each value goes
+ *   into one block slot of the atable, starting just above the reverse
+ *   map (2^35 bytes), and inode attributes keep only the slot number.
+ *   Free slots are chained through their first 8 bytes like free atoms.
  */
 
 typedef u32 atom_t;
@@ -60,6 +68,7 @@ typedef u32 atom_t;
 #define ATOMREF_SIZE		2
 #define ATOMREF_BLKBITS		1
 
+#define UNATOM_TABLE_BITS	35
 #define UNATOM_SIZE		8
 #define UNATOM_BLKBITS		3
 /* Sign bit is used for error */
@@ -76,6 +85,8 @@ void atable_init_base(struct sb *sb)
 	sb->atomref_base = 1U << (ATOM_DICT_BITS - sb->blockbits);
 	sb->unatom_base =
 		sb->atomref_base + (1U << (ATOMREF_TABLE_BITS - sb->blockbits));
+	sb->xvalue_base =
+		sb->unatom_base + (1U << (UNATOM_TABLE_BITS - sb->blockbits));
 }
 
 static inline atom_t entry_atom(tux_dirent *entry)
@@ -87,6 +98,20 @@ static inline atom_t entry_atom(tux_dirent *entry)
 	return be64_to_cpu(entry->inum);
 }
 
+/* see dir.c */
+static inline unsigned entry_rec_len(tux_dirent *entry)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned len = be16_to_cpu(entry->rec_len);
+
+	if (len == (1 << 16) - 1)
+		return 1 << 16;
+	return len;
+}
+
 static struct buffer_head *blockread_unatom(struct inode *atable, atom_t atom,
 					    unsigned *offset)
 {
@@ -245,6 +270,243 @@ static int get_freeatom(struct inode *atable, atom_t *atom)
 tux_dirent *tux_find_entry(struct inode *dir, const char *name, unsigned len, struct buffer_head **result, loff_t size);
 loff_t tux_create_entry(struct inode *dir, const char *name, unsigned len, inum_t inum, umode_t mode, loff_t *size);
 
+/*
+ * Atom name hash:
+ *
+ * Name to atom lookup by tux_find_entry() is a linear scan of the atom
+ * dictionary, which reads every dictionary block for each xattr access.
+ * So, we keep an in-memory hash of name => atom. The hash is built from
+ * the atom dictionary on first use, then maintained by make_atom() and
+ * atomref(). atomref() is also called by inode purge on backend without
+ * atable's i_mutex, so the hash is protected by ->atom_hash_lock.
+ * Loading and freeing hash table is still under i_mutex (or umount).
+ *
+ * If the hash can't be built, find_atom() falls back to the linear scan.
+ */
+
+#define ATOM_HASH_BITS		8
+#define ATOM_HASH_SIZE		(1 << ATOM_HASH_BITS)
+
+struct atom_hash_entry {
+	struct hlist_node node;
+	atom_t atom;
+	unsigned len;
+	char name[];
+};
+
+static struct hlist_head *atom_hash_head(struct hlist_head *hash,
+					 const char *name, unsigned len)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return &hash[hash_32(full_name_hash(name, len), ATOM_HASH_BITS)];
+}
+
+static struct atom_hash_entry *atom_hash_lookup(struct hlist_head *hash,
+						const char *name, unsigned len)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct atom_hash_entry *entry;
+
+	hlist_for_each_entry(entry, atom_hash_head(hash, name, len), node) {
+		if (entry->len == len && !memcmp(entry->name, name, len))
+			return entry;
+	}
+	return NULL;
+}
+
+static struct atom_hash_entry *atom_hash_alloc(const char *name, unsigned len,
+					       atom_t atom)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct atom_hash_entry *entry;
+
+	entry = malloc(sizeof(*entry) + len);
+	if (!entry)
+		return NULL;
+
+	entry->atom = atom;
+	entry->len = len;
+	memcpy(entry->name, name, len);
+
+	return entry;
+}
+
+static int atom_hash_insert(struct sb *sb, const char *name, unsigned len,
+			    atom_t atom)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct atom_hash_entry *entry;
+
+	entry = atom_hash_alloc(name, len, atom);
+	if (!entry)
+		return -ENOMEM;
+
+	spin_lock(&sb->atom_hash_lock);
+	if (sb->atom_hash) {
+		hlist_add_head(&entry->node,
+			       atom_hash_head(sb->atom_hash, name, len));
+		entry = NULL;
+	}
+	spin_unlock(&sb->atom_hash_lock);
+	free(entry);
+
+	return 0;
+}
+
+static void atom_hash_remove(struct sb *sb, const char *name, unsigned len)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct atom_hash_entry *entry = NULL;
+
+	spin_lock(&sb->atom_hash_lock);
+	if (sb->atom_hash) {
+		entry = atom_hash_lookup(sb->atom_hash, name, len);
+		if (entry)
+			hlist_del(&entry->node);
+	}
+	spin_unlock(&sb->atom_hash_lock);
+	free(entry);
+}
+
+static int atom_hash_find(struct sb *sb, const char *name, unsigned len,
+			  atom_t *atom)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct atom_hash_entry *entry = NULL;
+
+	spin_lock(&sb->atom_hash_lock);
+	if (sb->atom_hash) {
+		entry = atom_hash_lookup(sb->atom_hash, name, len);
+		if (entry)
+			*atom = entry->atom;
+	}
+	spin_unlock(&sb->atom_hash_lock);
+
+	return entry ? 0 : -ENODATA;
+}
+
+static void free_atom_hash_table(struct hlist_head *hash)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct atom_hash_entry *entry;
+	struct hlist_node *n;
+	int i;
+
+	for (i = 0; i < ATOM_HASH_SIZE; i++) {
+		hlist_for_each_entry_safe(entry, n, &hash[i], node) {
+			hlist_del(&entry->node);
+			free(entry);
+		}
+	}
+	free(hash);
+}
+
+/* Free atom name hash */
+void free_atom_hash(struct sb *sb)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct hlist_head *hash;
+
+	spin_lock(&sb->atom_hash_lock);
+	hash = sb->atom_hash;
+	sb->atom_hash = NULL;
+	spin_unlock(&sb->atom_hash_lock);
+
+	if (hash)
+		free_atom_hash_table(hash);
+}
+
+/* Build atom name hash from atom dictionary */
+static int atom_hash_load(struct inode *atable)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(atable->i_sb);
+	block_t block, blocks = sb->atomdictsize >> sb->blockbits;
+	struct hlist_head *hash;
+	int i, err;
+
+	/* Build on private table, then publish it */
+	hash = malloc(sizeof(*hash) * ATOM_HASH_SIZE);
+	if (!hash)
+		return -ENOMEM;
+	for (i = 0; i < ATOM_HASH_SIZE; i++)
+		INIT_HLIST_HEAD(&hash[i]);
+
+	for (block = 0; block < blocks; block++) {
+		struct buffer_head *buffer = blockread(mapping(atable), block);
+		if (!buffer) {
+			err = -EIO;
+			goto error;
+		}
+
+		tux_dirent *entry = bufdata(buffer);
+		tux_dirent *limit = bufdata(buffer) + sb->blocksize;
+		while (entry < limit) {
+			unsigned rec_len = entry_rec_len(entry);
+			if (rec_len < HEAD_SIZE) {
+				tux3_fs_error(sb, "zero length atom entry");
+				blockput(buffer);
+				err = -EIO;
+				goto error;
+			}
+			if (entry->name_len) {
+				struct atom_hash_entry *hashed;
+
+				hashed = atom_hash_alloc(entry->name,
+							 entry->name_len,
+							 entry_atom(entry));
+				if (!hashed) {
+					blockput(buffer);
+					err = -ENOMEM;
+					goto error;
+				}
+				hlist_add_head(&hashed->node,
+					       atom_hash_head(hash, hashed->name,
+							      hashed->len));
+			}
+			entry = (void *)entry + rec_len;
+		}
+		blockput(buffer);
+	}
+
+	spin_lock(&sb->atom_hash_lock);
+	sb->atom_hash = hash;
+	spin_unlock(&sb->atom_hash_lock);
+
+	return 0;
+
+error:
+	free_atom_hash_table(hash);
+	return err;
+}
+
 /* Find atom of name */
 static int find_atom(struct inode *atable, const char *name, unsigned len,
 		     atom_t *atom)
@@ -257,6 +519,10 @@ static int find_atom(struct inode *atable, const char *name, unsigned len,
 	struct buffer_head *buffer;
 	tux_dirent *entry;
 
+	/* Caller holds i_mutex, so ->atom_hash is not loaded/freed */
+	if (sb->atom_hash || !atom_hash_load(atable))
+		return atom_hash_find(sb, name, len, atom);
+
 	entry = tux_find_entry(atable, name, len, &buffer, sb->atomdictsize);
 	if (IS_ERR(entry)) {
 		int err = PTR_ERR(entry);
@@ -305,6 +571,12 @@ static int make_atom(struct inode *atable, const char *name, unsigned len,
 		return where;
 	}
 
+	if (sb->atom_hash) {
+		/* If we can't remember the atom, fall back to linear scan */
+		if (atom_hash_insert(sb, name, len, *atom))
+			free_atom_hash(sb);
+	}
+
 	return 0;
 }
 
@@ -416,11 +688,17 @@ static int atomref(struct inode *atable, atom_t atom, int use)
 
 		tux_dirent *entry = bufdata(buffer) + (where & sb->blockmask);
 		if (entry_atom(entry) == atom) {
+			/* Entry is gone by delete, remember name for hash */
+			char name[TUX_NAME_LEN];
+			unsigned len = entry->name_len;
+
+			memcpy(name, entry->name, len);
 			/* FIXME: better set a flag that unatom broke
 			 * or something! */
 			err = tux_delete_entry(atable, buffer, entry);
 			if (err)
 				return err;
+			atom_hash_remove(sb, name, len);
 		} else {
 			/* FIXME: better set a flag that unatom broke
 			 * or something! */
@@ -501,21 +779,180 @@ eek:
 	tux3_err(sb, "eek");
 }
 
+/* Xattr values */
+
+/* Max size of xattr value to keep in inode attributes */
+static unsigned xvalue_inline_max(struct sb *sb)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	if (!(sb->super.flags & cpu_to_be64(TUX3_FLAG_XVALUE)))
+		return UINT_MAX;
+	return sb->blocksize >> 3;
+}
+
+static struct buffer_head *blockread_xvalue(struct inode *atable,
+					    unsigned slot)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(atable->i_sb);
+
+	return blockread(mapping(atable), (block_t)sb->xvalue_base + slot);
+}
+
+static int xvalue_read(struct inode *atable, unsigned slot, void *data,
+		       unsigned len)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct buffer_head *buffer;
+
+	buffer = blockread_xvalue(atable, slot);
+	if (!buffer)
+		return -EIO;
+
+	memcpy(data, bufdata(buffer), len);
+	blockput(buffer);
+
+	return 0;
+}
+
+static int xvalue_write(struct inode *atable, unsigned slot, const void *data,
+			unsigned len)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	unsigned delta = tux3_get_current_delta();
+	struct buffer_head *buffer, *clone;
+
+	buffer = blockread_xvalue(atable, slot);
+	if (!buffer)
+		return -EIO;
+
+	/*
+	 * The atable is protected by i_mutex for now.
+	 * blockdirty() should never return -EAGAIN.
+	 * FIXME: need finer granularity locking
+	 */
+	clone = blockdirty(buffer, delta);
+	if (IS_ERR(clone)) {
+		assert(PTR_ERR(clone) != -EAGAIN);
+		blockput(buffer);
+		return PTR_ERR(clone);
+	}
+
+	memcpy(bufdata(clone), data, len);
+	mark_buffer_dirty_non(clone);
+	blockput(clone);
+
+	return 0;
+}
+
+/*
+ * Get free xattr value slot.
+ *
+ * Backend frees slots of purged inode without atable i_mutex, so the
+ * free list is protected by ->xvalue_lock.
+ */
+static int xvalue_alloc(struct inode *atable, unsigned *slot)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(atable->i_sb);
+	unsigned freexvalue;
+	__be64 next;
+	int err = 0;
+
+	mutex_lock(&sb->xvalue_lock);
+	freexvalue = sb->freexvalue;
+	/* Slot 0 is never used, it means value is in inode */
+	if (!freexvalue) {
+		*slot = ++sb->xvaluegen;
+		goto out;
+	}
+
+	err = xvalue_read(atable, freexvalue, &next, sizeof(next));
+	if (err)
+		goto out;
+	if (!is_free_unatom(be64_to_cpu(next))) {
+		tux3_fs_error(sb, "xattr value slot %x is not free",
+			      freexvalue);
+		err = -EIO;
+		goto out;
+	}
+
+	*slot = freexvalue;
+	sb->freexvalue = be64_to_cpu(next) & ~UNATOM_FREE_MASK;
+out:
+	mutex_unlock(&sb->xvalue_lock);
+
+	return err;
+}
+
+/* Put xattr value slot to free list */
+static int xvalue_free(struct inode *atable, unsigned slot)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct sb *sb = tux_sb(atable->i_sb);
+	__be64 next;
+	int err;
+
+	mutex_lock(&sb->xvalue_lock);
+	next = cpu_to_be64(UNATOM_FREE_MAGIC | sb->freexvalue);
+	err = xvalue_write(atable, slot, &next, sizeof(next));
+	if (!err)
+		sb->freexvalue = slot;
+	mutex_unlock(&sb->xvalue_lock);
+
+	return err;
+}
+
 /* Xattr cache */
 
+/*
+ * The xcache keeps xattr bodies packed from the start of xattrs[], and
+ * a table of u16 offsets to them at the end of the allocated memory,
+ * growing down (like ileaf dict). The offset table is sorted by atom,
+ * so lookup is a binary search and encode emits xattrs in atom order.
+ *
+ *   xattrs[]: | entry | entry | ... free ... | offsets[count] |
+ *             0                size                    maxsize
+ *
+ * If the value is in an atable slot, the entry has no body[].
+ */
+
 struct xcache_entry {
 	/* FIXME: 16bits? */
 	u16 atom;		/* atom of xattr data */
-	u16 size;		/* size of body[] */
+	u16 size;		/* size of xattr value */
+	u32 slot;		/* atable slot of value, or 0 if in body[] */
 	char body[];
 };
 
 struct xcache {
 	u16 size;		/* size of xattrs[] */
+	u16 count;		/* number of xattrs */
 	u16 maxsize;		/* allocated memory size */
 	struct xcache_entry xattrs[];
 };
 
+#define XCACHE_OFFSET_SIZE	sizeof(u16)
+#define XCACHE_MAX_SIZE		(USHRT_MAX & ~(XCACHE_OFFSET_SIZE - 1))
+
 /* Free xcache memory */
 void free_xcache(struct inode *inode)
 {
@@ -538,17 +975,61 @@ int new_xcache(struct inode *inode, unsigned size)
 	}
 	struct xcache *xcache;
 
+	/* Keep offset table aligned */
+	size = ALIGN(size, XCACHE_OFFSET_SIZE);
+	assert(size <= XCACHE_MAX_SIZE);
+
 	xcache = malloc(sizeof(*xcache) + size);
 	if (!xcache)
 		return -ENOMEM;
 
 	xcache->size = 0;
+	xcache->count = 0;
 	xcache->maxsize = size;
 	tux_inode(inode)->xcache = xcache;
 
 	return 0;
 }
 
+/* Offset table of xcache, sorted by atom */
+static inline u16 *xcache_offsets(struct xcache *xcache)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return (u16 *)((void *)xcache->xattrs + xcache->maxsize) - xcache->count;
+}
+
+static inline struct xcache_entry *xcache_xattr(struct xcache *xcache,
+						unsigned i)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return (void *)xcache->xattrs + xcache_offsets(xcache)[i];
+}
+
+static inline unsigned xcache_entry_size(struct xcache_entry *xattr)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return sizeof(*xattr) + (xattr->slot ? 0 : xattr->size);
+}
+
+/* Unused space between xattr bodies and offset table */
+static inline unsigned xcache_free(struct xcache *xcache)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	return xcache->maxsize - xcache->size - xcache->count * XCACHE_OFFSET_SIZE;
+}
+
 /* Expand xcache memory */
 static int expand_xcache(struct inode *inode, unsigned size)
 {
@@ -561,52 +1042,38 @@ static int expand_xcache(struct inode *inode, unsigned size)
 
 	assert(!old || size > old->maxsize);
 
-	/* FIXME: better allocation strategy? See xcache_update() comment */
+	/* Expand by binary factor, so repeated updates don't realloc */
 	if (old)
 		size = max_t(unsigned, old->maxsize * 2, size);
-	else
-		size = ALIGN(size, MIN_ALLOC_SIZE);
+	size = ALIGN(size, MIN_ALLOC_SIZE);
+	size = min_t(unsigned, size, XCACHE_MAX_SIZE);
 	trace("realloc xcache to %i", size);
 
 	assert(size);
-	assert(size <= USHRT_MAX);
+	assert(!old || size > old->maxsize);
 
 	xcache = malloc(sizeof(*xcache) + size);
 	if (!xcache)
 		return -ENOMEM;
 
-	if (!old)
+	xcache->maxsize = size;
+	if (!old) {
 		xcache->size = 0;
-	else {
+		xcache->count = 0;
+	} else {
 		xcache->size = old->size;
+		xcache->count = old->count;
 		memcpy(xcache->xattrs, old->xattrs, old->size);
+		memcpy(xcache_offsets(xcache), xcache_offsets(old),
+		       old->count * XCACHE_OFFSET_SIZE);
 		free(old);
 	}
-	xcache->maxsize = size;
 
 	tux_inode(inode)->xcache = xcache;
 
 	return 0;
 }
 
-static inline struct xcache_entry *xcache_next(struct xcache_entry *xattr)
-{
-	if(DEBUG_MODE_K==1)
-	{
-		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
-	}
-	return (void *)xattr->body + xattr->size;
-}
-
-static inline struct xcache_entry *xcache_limit(struct xcache *xcache)
-{
-	if(DEBUG_MODE_K==1)
-	{
-		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
-	}
-	return (void *)xcache->xattrs + xcache->size;
-}
-
 int xcache_dump(struct inode *inode)
 {
 	if(DEBUG_MODE_K==1)
@@ -618,22 +1085,28 @@ int xcache_dump(struct inode *inode)
 	if (!xcache)
 		return 0;
 
-	struct xcache_entry *xattr = xcache->xattrs;
-	struct xcache_entry *xlimit = xcache_limit(xcache);
+	u16 *offsets = xcache_offsets(xcache);
+	unsigned i;
 
 	//__tux3_dbg("xattrs %p/%i", inode->xcache, inode->xcache->size);
-	while (xattr < xlimit) {
+	for (i = 0; i < xcache->count; i++) {
+		if (offsets[i] + sizeof(struct xcache_entry) > xcache->size)
+			goto fail;
+		struct xcache_entry *xattr = xcache_xattr(xcache, i);
 		if (xattr->size > tux_sb(inode->i_sb)->blocksize)
 			goto bail;
+		if (offsets[i] + xcache_entry_size(xattr) > xcache->size)
+			goto fail;
+		if (i && xcache_xattr(xcache, i - 1)->atom >= xattr->atom)
+			goto fail;
 		__tux3_dbg("atom %.3x => ", xattr->atom);
-		if (xattr->size)
+		if (xattr->slot)
+			__tux3_dbg("slot %x, %u bytes\n", xattr->slot, xattr->size);
+		else if (xattr->size)
 			hexdump(xattr->body, xattr->size);
 		else
 			__tux3_dbg("<empty>\n");
-		if ((xattr = xcache_next(xattr)) > xlimit)
-			goto fail;
 	}
-	assert(xattr == xlimit);
 	return 0;
 
 fail:
@@ -644,53 +1117,103 @@ bail:
 	return -1;
 }
 
-static struct xcache_entry *xcache_lookup(struct xcache *xcache, unsigned atom)
+/*
+ * Binary search atom in offset table. Returns index of atom if found,
+ * otherwise returns -(insert position + 1).
+ */
+static int xcache_search(struct xcache *xcache, unsigned atom)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	if (xcache) {
-		struct xcache_entry *xattr = xcache->xattrs;
-		struct xcache_entry *xlimit = xcache_limit(xcache);
-		while (xattr < xlimit) {
-			if (xattr->atom == atom)
-				return xattr;
-			if ((xattr = xcache_next(xattr)) > xlimit)
-				return ERR_PTR(-EINVAL);
-		}
-		assert(xattr == xlimit);
+	int lo = 0, hi = xcache ? xcache->count : 0;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		unsigned found = xcache_xattr(xcache, mid)->atom;
+		if (found == atom)
+			return mid;
+		if (found < atom)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return -(lo + 1);
+}
+
+static struct xcache_entry *xcache_lookup(struct xcache *xcache, unsigned atom)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
+	int i = xcache_search(xcache, atom);
+	if (i >= 0)
+		return xcache_xattr(xcache, i);
 	return ERR_PTR(-ENOATTR);
 }
 
-static inline int remove_old(struct xcache *xcache, struct xcache_entry *xattr)
+/* Insert offset of xattr body at i-th of offset table */
+static void xcache_insert_offset(struct xcache *xcache, unsigned i,
+				 unsigned offset)
 {
 	if(DEBUG_MODE_K==1)
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	if (xattr) {
-		void *xlimit = xcache_limit(xcache);
-		void *next = xcache_next(xattr);
-		memmove(xattr, next, xlimit - next);
-		xcache->size -= next - (void *)xattr;
-		return 1;
+	u16 *offsets = xcache_offsets(xcache) - 1;
+
+	memmove(offsets, offsets + 1, i * XCACHE_OFFSET_SIZE);
+	offsets[i] = offset;
+	xcache->count++;
+}
+
+/* Append xattr body, then insert it at i-th of offset table */
+static struct xcache_entry *xcache_insert(struct xcache *xcache, unsigned i,
+					  unsigned atom, unsigned len,
+					  unsigned slot)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
-	return 0;
+	struct xcache_entry *xattr = (void *)xcache->xattrs + xcache->size;
+
+	xattr->atom = atom;
+	xattr->size = len;
+	xattr->slot = slot;
+	assert(xcache_free(xcache) >=
+	       xcache_entry_size(xattr) + XCACHE_OFFSET_SIZE);
+	xcache_insert_offset(xcache, i, xcache->size);
+	xcache->size += xcache_entry_size(xattr);
+
+	return xattr;
+}
+
+/* Remove i-th xattr, and compact xattr bodies */
+static void remove_old(struct xcache *xcache, unsigned i)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	u16 *offsets = xcache_offsets(xcache);
+	struct xcache_entry *xattr = xcache_xattr(xcache, i);
+	unsigned offset = offsets[i], size = xcache_entry_size(xattr);
+	unsigned j;
+
+	memmove(xattr, (void *)xattr + size, xcache->size - (offset + size));
+	xcache->size -= size;
+	for (j = 0; j < xcache->count; j++) {
+		if (offsets[j] > offset)
+			offsets[j] -= size;
+	}
+
+	memmove(offsets + 1, offsets, i * XCACHE_OFFSET_SIZE);
+	xcache->count--;
 }
 
-/*
- * Things to improve about xcache_update:
- *
- *  * It always allocates the new attribute at the end of the list because it
- *    is lazy and works by always deleting the attribute first then putting
- *    the new one at the end
- *
- *  * If the size of the attribute did not change, does unecessary work
- *
- *  * Should expand by binary factor
- */
 static int xcache_update(struct inode *inode, unsigned atom, const void *data,
 			 unsigned len, unsigned flags)
 {
@@ -698,46 +1221,93 @@ static int xcache_update(struct inode *inode, unsigned atom, const void *data,
 	{
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
+	struct sb *sb = tux_sb(inode->i_sb);
+	struct inode *atable = sb->atable;
 	struct xcache *xcache = tux_inode(inode)->xcache;
-	struct xcache_entry *xattr = xcache_lookup(xcache, atom);
-	int use = 0;
+	struct xcache_entry *xattr, *old = NULL;
+	unsigned slot = 0, old_slot = 0;
+	int i = xcache_search(xcache, atom);
+	int use = 0, err;
 
-	if (IS_ERR(xattr)) {
-		if (PTR_ERR(xattr) != -ENOATTR || (flags & XATTR_REPLACE))
-			return PTR_ERR(xattr);
+	if (i < 0) {
+		if (flags & XATTR_REPLACE)
+			return -ENOATTR;
 
 		tux3_xattrdirty(inode);
+		i = -(i + 1);
 	} else {
 		if (flags & XATTR_CREATE)
 			return -EEXIST;
 
 		tux3_xattrdirty(inode);
+		old = xcache_xattr(xcache, i);
+		if (old->size == len) {
+			/* Same size, overwrite in place */
+			if (old->slot) {
+				err = xvalue_write(atable, old->slot, data, len);
+				if (err)
+					return err;
+			} else
+				memcpy(old->body, data, len);
+			tux3_mark_inode_dirty(inode);
+			return 0;
+		}
+	}
+
+	/* Big value goes to atable slot */
+	if (len > xvalue_inline_max(sb)) {
+		if (len > sb->blocksize)
+			return -ERANGE;
+		err = xvalue_alloc(atable, &slot);
+		if (err)
+			return err;
+		err = xvalue_write(atable, slot, data, len);
+		if (err)
+			goto error_slot;
+	}
+
+	if (old) {
+		old_slot = old->slot;
 		/* FIXME: if we can't insert new one, the xattr will lose */
-		use -= remove_old(xcache, xattr);
+		remove_old(xcache, i);
+		use--;
 	}
 
 	/* Insert new */
-	unsigned more = sizeof(*xattr) + len;
-	if (!xcache || xcache->size + more > xcache->maxsize) {
-		unsigned oldsize = xcache ? xcache->size : 0;
-		int err = expand_xcache(inode, oldsize + more);
+	unsigned more = sizeof(*xattr) + (slot ? 0 : len) + XCACHE_OFFSET_SIZE;
+	if (!xcache || xcache_free(xcache) < more) {
+		unsigned used = xcache ?
+			xcache->maxsize - xcache_free(xcache) : 0;
+		err = -ENOSPC;
+		if (used + more > XCACHE_MAX_SIZE)
+			goto error_slot;
+		err = expand_xcache(inode, used + more);
 		if (err)
-			return err;
+			goto error_slot;
+		xcache = tux_inode(inode)->xcache;
 	}
-	xattr = xcache_limit(tux_inode(inode)->xcache);
-	//trace("expand by %i\n", more);
-	tux_inode(inode)->xcache->size += more;
-	memcpy(xattr->body, data, (xattr->size = len));
-	xattr->atom = atom;
+	xattr = xcache_insert(xcache, i, atom, len, slot);
+	if (!slot)
+		memcpy(xattr->body, data, len);
 	tux3_mark_inode_dirty(inode);
 
 	use++;
 	if (use) {
-		/* FIXME: error check */
-		atomref(tux_sb(inode->i_sb)->atable, atom, use);
+		err = atomref(atable, atom, use);
+		if (err)
+			return err;
 	}
 
+	/* New value was set, so old slot is not referenced anymore */
+	if (old_slot)
+		return xvalue_free(atable, old_slot);
+
 	return 0;
+
+error_slot:
+	if (slot && xvalue_free(atable, slot))
+		tux3_err(sb, "leaked xattr value slot %x", slot);
+	return err;
 }
 
 /* Inode is going to purge, remove xattrs */
@@ -750,21 +1320,32 @@ int xcache_remove_all(struct inode *inode)
 	struct sb *sb = tux_sb(inode->i_sb);
 	struct xcache *xcache = tux_inode(inode)->xcache;
 
+	/*
+	 * If error, caller retries (e.g. by orphan replay). So forget
+	 * each step after it was done, to not free slot or drop atom
+	 * refcount twice.
+	 */
 	if (xcache) {
-		struct xcache_entry *xattr = xcache->xattrs;
-		struct xcache_entry *xlimit = xcache_limit(xcache);
-		while (xattr < xlimit) {
-			/*
-			 * FIXME: Inode is going to purse, what to do
-			 * if error ?
-			 */
-			int err = atomref(sb->atable, xattr->atom, -1);
+		unsigned i;
+		int err;
+
+		for (i = 0; i < xcache->count; i++) {
+			struct xcache_entry *xattr = xcache_xattr(xcache, i);
+			if (xattr->slot) {
+				err = xvalue_free(sb->atable, xattr->slot);
+				if (err)
+					return err;
+				xattr->slot = 0;
+			}
+		}
+		while (xcache->count) {
+			/* Removing offsets[0] is just to decrement count */
+			struct xcache_entry *xattr = xcache_xattr(xcache, 0);
+			err = atomref(sb->atable, xattr->atom, -1);
 			if (err)
 				return err;
-
-			xattr = xcache_next(xattr);
+			xcache->count--;
 		}
-		assert(xattr == xlimit);
 	}
 
 	free_xcache(inode);
@@ -795,9 +1376,14 @@ int get_xattr(struct inode *inode, const char *name, unsigned len, void *data,
 		goto out;
 	}
 	ret = xattr->size;
-	if (ret <= size)
-		memcpy(data, xattr->body, ret);
-	else if (size)
+	if (ret <= size) {
+		if (xattr->slot) {
+			int err = xvalue_read(atable, xattr->slot, data, ret);
+			if (err)
+				ret = err;
+		} else
+			memcpy(data, xattr->body, ret);
+	} else if (size)
 		ret = -ERANGE;
 out:
 	mutex_unlock(&atable->i_mutex);
@@ -849,19 +1435,19 @@ int del_xattr(struct inode *inode, const char *name, unsigned len)
 	err = find_atom(atable, name, len, &atom);
 	if (!err) {
 		struct xcache *xcache = tux_inode(inode)->xcache;
-		struct xcache_entry *xattr = xcache_lookup(xcache, atom);
-		if (IS_ERR(xattr)) {
-			err = PTR_ERR(xattr);
+		int i = xcache_search(xcache, atom);
+		if (i < 0) {
+			err = -ENOATTR;
 			goto out;
 		}
 
+		unsigned slot = xcache_xattr(xcache, i)->slot;
 		tux3_xattrdirty(inode);
-		int used = remove_old(xcache, xattr);
-		if (used) {
-			tux3_mark_inode_dirty(inode);
-			/* FIXME: error check */
-			atomref(atable, atom, -used);
-		}
+		remove_old(xcache, i);
+		tux3_mark_inode_dirty(inode);
+		err = atomref(atable, atom, -1);
+		if (!err && slot)
+			err = xvalue_free(atable, slot);
 	}
 out:
 	change_end(sb);
@@ -885,13 +1471,12 @@ int list_xattr(struct inode *inode, char *text, size_t size)
 	if (!xcache)
 		return 0;
 
-	struct xcache_entry *xattr = xcache->xattrs;
-	struct xcache_entry *xlimit = xcache_limit(xcache);
 	char *base = text, *top = text + size;
+	unsigned i;
 	int err;
 
-	while (xattr < xlimit) {
-		atom_t atom = xattr->atom;
+	for (i = 0; i < xcache->count; i++) {
+		atom_t atom = xcache_xattr(xcache, i)->atom;
 		if (size) {
 			/* FIXME: check error code for POSIX */
 			int tail = top - text;
@@ -915,14 +1500,7 @@ int list_xattr(struct inode *inode, char *text, size_t size)
 			}
 			text += len + 1;
 		}
-
-		if ((xattr = xcache_next(xattr)) > xlimit) {
-			tux3_fs_error(sb, "xcache bug");
-			err = -EIO;
-			goto error;
-		}
 	}
-	assert(xattr == xlimit);
 	mutex_unlock(&atable->i_mutex);
 
 	return text - base;
@@ -946,14 +1524,15 @@ unsigned encode_xsize(struct inode *inode)
 		return 0;
 
 	unsigned size = 0, xatsize = atsize[XATTR_ATTR];
-	struct xcache_entry *xattr = xcache->xattrs;
-	struct xcache_entry *xlimit = xcache_limit(xcache);
+	unsigned i;
 
-	while (xattr < xlimit) {
-		size += 2 + xatsize + xattr->size;
-		xattr = xcache_next(xattr);
+	for (i = 0; i < xcache->count; i++) {
+		struct xcache_entry *xattr = xcache_xattr(xcache, i);
+		if (xattr->slot)
+			size += 2 + atsize[XATTR_EXT_ATTR] + 6;
+		else
+			size += 2 + xatsize + xattr->size;
 	}
-	assert(xattr == xlimit);
 	return size;
 }
 
@@ -968,13 +1547,22 @@ void *encode_xattrs(struct inode *inode, void *attrs, unsigned size)
 	if (!xcache)
 		return attrs;
 
-	struct xcache_entry *xattr = xcache->xattrs;
-	struct xcache_entry *xlimit = xcache_limit(xcache);
 	void *limit = attrs + size - 3;
+	unsigned i;
 
-	while (xattr < xlimit) {
+	for (i = 0; i < xcache->count; i++) {
+		struct xcache_entry *xattr = xcache_xattr(xcache, i);
 		if (attrs >= limit)
 			break;
+		if (xattr->slot) {
+			// external xattr: kind+version:16, bytes:16, atom:16, size:16, slot:32
+			attrs = encode_kind(attrs, XATTR_EXT_ATTR, tux_sb(inode->i_sb)->version);
+			attrs = encode16(attrs, 8);
+			attrs = encode16(attrs, xattr->atom);
+			attrs = encode16(attrs, xattr->size);
+			attrs = encode32(attrs, xattr->slot);
+			continue;
+		}
 		//immediate xattr: kind+version:16, bytes:16, atom:16, data[bytes - 2]
 		//printf("xattr %x/%x ", xattr->atom, xattr->size);
 		attrs = encode_kind(attrs, XATTR_ATTR, tux_sb(inode->i_sb)->version);
@@ -982,7 +1570,6 @@ void *encode_xattrs(struct inode *inode, void *attrs, unsigned size)
 		attrs = encode16(attrs, xattr->atom);
 		memcpy(attrs, xattr->body, xattr->size);
 		attrs += xattr->size;
-		xattr = xcache_next(xattr);
 	}
 	return attrs;
 }
@@ -1002,13 +1589,21 @@ unsigned decode_xsize(struct inode *inode, void *attrs, unsigned size)
 		attrs = decode_kind(attrs, &kind, &version);
 		switch (kind) {
 		case XATTR_ATTR:
+		case XATTR_EXT_ATTR:
 		case IDATA_ATTR:
 			// immediate data: kind+version:16, bytes:16, data[bytes]
 			// immediate xattr: kind+version:16, bytes:16, atom:16, data[bytes - 2]
+			// external xattr: kind+version:16, bytes:16, atom:16, size:16, slot:32
 			attrs = decode16(attrs, &bytes);
 			attrs += bytes;
-			if (version == sb->version)
-				total += sizeof(struct xcache_entry) + bytes - 2;
+			if (version != sb->version)
+				continue;
+			if (kind == XATTR_ATTR)
+				total += sizeof(struct xcache_entry) + bytes - 2
+					+ XCACHE_OFFSET_SIZE;
+			else if (kind == XATTR_EXT_ATTR)
+				total += sizeof(struct xcache_entry)
+					+ XCACHE_OFFSET_SIZE;
 			continue;
 		}
 		attrs += atsize[kind];
@@ -1016,6 +1611,29 @@ unsigned decode_xsize(struct inode *inode, void *attrs, unsigned size)
 	return total;
 }
 
+/* Insert decoded xattr to xcache, or return NULL if atom is duplicated */
+static struct xcache_entry *decode_xcache_insert(struct inode *inode,
+						 unsigned atom, unsigned len,
+						 unsigned slot)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	struct xcache *xcache = tux_inode(inode)->xcache;
+	int i;
+
+	/* Xattrs are encoded in atom order, so this is usually append */
+	i = xcache_search(xcache, atom);
+	if (i >= 0) {
+		tux3_fs_error(tux_sb(inode->i_sb), "duplicate xattr atom %x",
+			      atom);
+		return NULL;
+	}
+	/* FIXME: check limit!!! */
+	return xcache_insert(xcache, -(i + 1), atom, len, slot);
+}
+
 void *decode_xattr(struct inode *inode, void *attrs)
 {
 	if(DEBUG_MODE_K==1)
@@ -1023,26 +1641,37 @@ void *decode_xattr(struct inode *inode, void *attrs)
 		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
 	}
 	// immediate xattr: kind+version:16, bytes:16, atom:16, data[bytes - 2]
-	struct xcache *xcache = tux_inode(inode)->xcache;
-	struct xcache_entry *xattr = xcache_limit(xcache);
-	void *limit = xcache->xattrs + xcache->maxsize;
-	unsigned xsize, bytes, atom;
+	struct xcache_entry *xattr;
+	unsigned bytes, atom;
 
 	attrs = decode16(attrs, &bytes);
 	attrs = decode16(attrs, &atom);
 
-	/* FIXME: check limit!!! */
-	assert((void *)xattr + sizeof(*xattr) <= limit);
-	*xattr = (struct xcache_entry){
-		.atom = atom,
-		.size = bytes - 2,
-	};
-	xsize = sizeof(*xattr) + xattr->size;
-	assert((void *)xattr + xsize <= limit);
-
-	memcpy(xattr->body, attrs, xattr->size);
-	attrs += xattr->size;
-	xcache->size += xsize;
+	xattr = decode_xcache_insert(inode, atom, bytes - 2, 0);
+	if (xattr)
+		memcpy(xattr->body, attrs, xattr->size);
+	attrs += bytes - 2;
 
 	return attrs;
 }
+
+void *decode_xattr_ext(struct inode *inode, void *attrs)
+{
+	if(DEBUG_MODE_K==1)
+	{
+		printk(KERN_INFO"%25s  %25s  %4d  #in\n",__FILE__,__func__,__LINE__);
+	}
+	// external xattr: kind+version:16, bytes:16, atom:16, size:16, slot:32
+	unsigned bytes, atom, size, slot;
+	void *limit;
+
+	attrs = decode16(attrs, &bytes);
+	limit = attrs + bytes;
+	attrs = decode16(attrs, &atom);
+	attrs = decode16(attrs, &size);
+	attrs = decode32(attrs, &slot);
+
+	decode_xcache_insert(inode, atom, size, slot);
+
+	return limit;
+}